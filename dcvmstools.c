@@ -27,26 +27,37 @@
 #include <sys/cdefs.h>
 #include <sys/bitops.h>
 #include <sys/endian.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <fnmatch.h>
+#include <fts.h>
+#include <iconv.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
+#include <sha2.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sysexits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "dcvmstools.h"
 #define PATH_DEV_MMEM_DEFAULT	"/dev/mmem0.0c"
 
 //#define JP_REGION
-#define OUTPUT_ENCODING	"EUC-JP-MS"	/* XXX */
+#ifndef OUTPUT_ENCODING
+#define OUTPUT_ENCODING	"UTF-8"
+#endif
 
 #ifndef __arraycount
 #define __arraycount(__x)	(sizeof(__x) / sizeof(__x[0]))
@@ -57,18 +68,139 @@ struct _vmsdirdesc {
 	int loc;
 };
 
+/* bitmap of block numbers */
+__BITMAP_TYPE(vms_blkmap, uint32_t, VMS_MAXNUM_BLOCKS);
+
 struct vmsfs_root *vms_rootblk;
 struct vmsfs_fat *vms_fatblk;
 struct vmsfs_dir *vms_dirblk;
 char *vms_filename;
 int vms_fd;
 
-static char strxxx_buf[128];
+/*
+ * geometry. the number of blocks is taken from fat_nblocksize of the root
+ * block when FAT is loaded. a multi-bank card (e.g. 4X) is a series of
+ * 128KB banks in one file, and vms_bank selects one of them (-b).
+ */
+static int vms_nblocks = VMS_NUM_BLOCKS;
+static int vms_bank = -1;		/* -1 if not specified */
+static off_t vms_bankoff;
+
+/*
+ * per-image arena. the root block, FAT, directory and directory handles
+ * of the image are allocated from it, and they are freed at once when
+ * the arena is reset by vms_open(). the arena grows by chunks while an
+ * image is processed, and the chunks are merged into one at the reset,
+ * so that the next image of the same geometry does not malloc at all,
+ * and the memory is not grown by the number of images.
+ */
+#define VMS_ARENA_ALIGN		16
+#define VMS_ARENA_SIZE		(VMS_BLOCKSIZE + sizeof(struct vmsfs_fat) + \
+				 VMS_DIRBLOCKSIZE * VMS_BLOCKSIZE + 1024)
+
+struct vms_arena_chunk {
+	struct vms_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __aligned(VMS_ARENA_ALIGN);
+};
+static struct vms_arena_chunk *vms_arena;
+
+static struct vms_arena_chunk *
+vms_arena_chunk_alloc(size_t size)
+{
+	struct vms_arena_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void *
+vms_arena_alloc(size_t size)
+{
+	struct vms_arena_chunk *chunk, *last;
+	void *p;
+
+	size = (size + VMS_ARENA_ALIGN - 1) & ~(size_t)(VMS_ARENA_ALIGN - 1);
+	for (last = NULL, chunk = vms_arena; chunk != NULL;
+	    last = chunk, chunk = chunk->next) {
+		if (chunk->size - chunk->used >= size)
+			break;
+	}
+	if (chunk == NULL) {
+		chunk = vms_arena_chunk_alloc(
+		    (size > VMS_ARENA_SIZE) ? size : VMS_ARENA_SIZE);
+		if (chunk == NULL)
+			return NULL;
+		if (last == NULL)
+			vms_arena = chunk;
+		else
+			last->next = chunk;
+	}
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+static void *
+vms_arena_calloc(size_t n, size_t size)
+{
+	void *p;
+
+	if (size != 0 && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = vms_arena_alloc(n * size)) != NULL)
+		memset(p, 0, n * size);
+	return p;
+}
+
+/* free everything allocated from the arena */
+static void
+vms_arena_reset(void)
+{
+	struct vms_arena_chunk *chunk, *next;
+	size_t total;
+
+	if (vms_arena == NULL || vms_arena->next == NULL) {
+		if (vms_arena != NULL)
+			vms_arena->used = 0;
+		return;
+	}
+
+	for (total = 0, chunk = vms_arena; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		total += chunk->size;
+		free(chunk);
+	}
+	/* if it fails, the next vms_arena_alloc() will try again */
+	vms_arena = vms_arena_chunk_alloc(total);
+}
+
+/*
+ * text in the file header.
+ * in JP region, vms_name and rom_name are CP932, and game_name is
+ * a string of game characters (gamechar_map, which is written in EUC-JP).
+ * otherwise they are shown as hex.
+ *
+ * the conversion tables are made with iconv(3) only once, and the table for
+ * each lead byte of CP932 is made when it is used at first.
+ */
+#define VMS_TEXTBUFSIZE	128
 
 #ifdef JP_REGION
-#include <iconv.h>
+bool vms_region_jp = true;
+#else
+bool vms_region_jp = false;
+#endif
 
-const char *gamechar_map[94] = {
+static const char *gamechar_map[94] = {
 	" ",
 	"", "", "", "", "", "", "", "", "", "", "",
 	"", "", "", "", "", "", "", "", "", "",
@@ -83,1158 +215,8865 @@ const char *gamechar_map[94] = {
 	"0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
 };
 
-static char *
-strjpstr(char *str, size_t len)
+#define CP932_ISLEAD(c)	(((c) >= 0x81 && (c) <= 0x9f) || ((c) >= 0xe0 && (c) <= 0xfc))
+
+struct vms_texttab {
+	iconv_t cd_cp932;
+	char sbcs[256][4];
+	char (*dbcs[256])[4];
+	char game[__arraycount(gamechar_map)][4];
+};
+static struct vms_texttab *vms_texttab;
+
+static void
+vms_iconv1(iconv_t cd, const char *in, size_t inlen, char out[4])
+{
+	char inbuf[4], *inp, *outp;
+	size_t outlen, rc;
+
+	memcpy(inbuf, in, inlen);
+	inp = inbuf;
+	outp = out;
+	outlen = 3;
+	iconv(cd, NULL, NULL, NULL, NULL);
+	rc = iconv(cd, &inp, &inlen, &outp, &outlen);
+	if (rc == (size_t)-1 || inlen != 0) {
+		strlcpy(out, "?", 4);
+		return;
+	}
+	*outp = '\0';
+}
+
+static int
+vms_text_init(void)
 {
+	struct vms_texttab *tab;
 	iconv_t cd;
-	char *bufp = strxxx_buf;
-	size_t buflen = sizeof(strxxx_buf) - 1;
+	char c;
+	size_t i;
+
+	if (vms_texttab != NULL)
+		return 0;
+
+	tab = calloc(1, sizeof(*tab));
+	if (tab == NULL)
+		return -1;
+
+	tab->cd_cp932 = iconv_open(OUTPUT_ENCODING, "CP932");
+	cd = iconv_open(OUTPUT_ENCODING, "EUC-JP");
+	if (tab->cd_cp932 == (iconv_t)-1 || cd == (iconv_t)-1) {
+		if (tab->cd_cp932 != (iconv_t)-1)
+			iconv_close(tab->cd_cp932);
+		free(tab);
+		return -1;
+	}
 
-	cd = iconv_open(OUTPUT_ENCODING, "CP932");
-	iconv(cd, &str, &len, &bufp, &buflen);
+	for (i = 0; i < 256; i++) {
+		if (CP932_ISLEAD(i))
+			continue;
+		c = (char)i;
+		vms_iconv1(tab->cd_cp932, &c, 1, tab->sbcs[i]);
+	}
+	for (i = 0; i < __arraycount(gamechar_map); i++)
+		vms_iconv1(cd, gamechar_map[i], strlen(gamechar_map[i]), tab->game[i]);
 	iconv_close(cd);
 
-	return strxxx_buf;
+	vms_texttab = tab;
+	return 0;
 }
 
-static char *
-strgamestr(uint8_t *gamestr, int len)
+static const char *
+vms_text_dbcs(int lead, int trail)
 {
-	int gamech, i;
+	char (*t)[4], in[2];
+	int i;
 
-	memset(strxxx_buf, 0, sizeof(strxxx_buf));
-	for (i = 0; i < len; i++) {
-		gamech = gamestr[i];
-		if (gamech < 0 || gamech > (int)__arraycount(gamechar_map))
-			gamech = 0;
-		strlcat(strxxx_buf, gamechar_map[gamech], sizeof(strxxx_buf));
+	t = vms_texttab->dbcs[lead];
+	if (t == NULL) {
+		t = calloc(256, sizeof(*t));
+		if (t == NULL)
+			return "?";
+		in[0] = (char)lead;
+		for (i = 0x40; i <= 0xfc; i++) {
+			in[1] = (char)i;
+			vms_iconv1(vms_texttab->cd_cp932, in, 2, t[i]);
+		}
+		vms_texttab->dbcs[lead] = t;
 	}
-	return strxxx_buf;
+	return (t[trail][0] == '\0') ? "?" : t[trail];
 }
-#else /* JP_REGION */
+
 static char *
-strgamestr(uint8_t *gamestr, int len)
+strhexstr(char *buf, size_t bufsize, const uint8_t *str, size_t len)
 {
-	char *p = strxxx_buf;
-	int i, gamech;
+	char *p = buf;
+	size_t i;
 
-	for (i = 0; i < len && p < (strxxx_buf + sizeof(strxxx_buf) - 4); i++) {
-		gamech = gamestr[i];
-		snprintf(p, 3, "%02x", gamech);
+	for (i = 0; i < len && p + 4 <= buf + bufsize; i++) {
+		snprintf(p, 3, "%02x", str[i]);
 		p += 2;
 		if (i < len - 1)
 			*p++ = ',';
 	}
-	return strxxx_buf;
+	*p = '\0';
+	return buf;
 }
 
 static char *
-strjpstr(char *str, size_t len)
+strtextcat(char *p, char *end, const char *s)
 {
-	return strgamestr((uint8_t *)str, (int)len);
+	size_t n;
+
+	n = strlen(s);
+	if (p + n > end)
+		return NULL;
+	memcpy(p, s, n);
+	return p + n;
 }
-#endif /* JP_REGION */
 
-static int
-vms_open(const char *file, int flags)
+static char *
+strjpstr(char *buf, size_t bufsize, const char *str, size_t len)
 {
-	/* for reopen */
-	if (vms_rootblk != NULL) {
-		free(vms_rootblk);
-		vms_rootblk = NULL;
-	}
-	if (vms_fatblk != NULL) {
-		free(vms_fatblk);
-		vms_fatblk = NULL;
+	char *p, *end;
+	size_t i;
+	int c;
+
+	if (!vms_region_jp || vms_text_init() != 0)
+		return strhexstr(buf, bufsize, (const uint8_t *)str, len);
+
+	*buf = '\0';
+	p = buf;
+	end = buf + bufsize - 1;
+	for (i = 0; i < len && p != NULL; i++) {
+		c = str[i] & 0xff;
+		if (c == '\0')
+			break;
+		if (CP932_ISLEAD(c) && i + 1 < len) {
+			p = strtextcat(p, end, vms_text_dbcs(c, str[++i] & 0xff));
+		} else {
+			p = strtextcat(p, end, vms_texttab->sbcs[c]);
+		}
+		if (p != NULL)
+			*p = '\0';
 	}
-	if (vms_dirblk != NULL) {
-		free(vms_dirblk);
-		vms_dirblk = NULL;
+	return buf;
+}
+
+static char *
+strgamestr(char *buf, size_t bufsize, const uint8_t *gamestr, size_t len)
+{
+	char *p, *end;
+	size_t i, gamech;
+
+	if (!vms_region_jp || vms_text_init() != 0)
+		return strhexstr(buf, bufsize, gamestr, len);
+
+	*buf = '\0';
+	p = buf;
+	end = buf + bufsize - 1;
+	for (i = 0; i < len && p != NULL; i++) {
+		gamech = gamestr[i];
+		if (gamech >= __arraycount(gamechar_map))
+			gamech = 0;
+		p = strtextcat(p, end, vms_texttab->game[gamech]);
+		if (p != NULL)
+			*p = '\0';
 	}
+	return buf;
+}
 
-	if (vms_filename != NULL) {
-		free(vms_filename);
+/*
+ * machine readable output (-o json|ndjson|csv)
+ *
+ * a small streaming writer to stdout. each image is one record.
+ * in JSON, a record is an object, and all records are in an array.
+ * in NDJSON, a record is an object in a line.
+ * in CSV, only the rows (the entries of a list, such as files) are written
+ * one per line, with the name of image as the first column. values of an
+ * array in a row are written in one column separated by spaces.
+ */
+enum vms_output {
+	VMS_OUTPUT_TEXT,
+	VMS_OUTPUT_JSON,
+	VMS_OUTPUT_NDJSON,
+	VMS_OUTPUT_CSV
+};
+enum vms_output vms_output = VMS_OUTPUT_TEXT;
+const char *vms_command;
+
+#define OUT_MAXDEPTH	8
+static struct out_level {
+	bool first;
+	bool array;
+} out_stack[OUT_MAXDEPTH];
+static int out_depth;
+static int out_rowdepth;	/* depth of the current CSV row, or 0 */
+static int out_csvcol;
+static bool out_csvheader;	/* the first CSV row, which makes the header */
+static bool out_csvheader_done;
+static char out_csvbuf[4096];	/* values of the first row */
+static size_t out_csvbuflen;
+
+static void
+out_write(const char *s, size_t len)
+{
+	if (out_csvheader) {
+		if (len > sizeof(out_csvbuf) - out_csvbuflen)
+			len = sizeof(out_csvbuf) - out_csvbuflen;
+		memcpy(out_csvbuf + out_csvbuflen, s, len);
+		out_csvbuflen += len;
+	} else {
+		fwrite(s, 1, len, stdout);
 	}
-	vms_filename = strdup(file);
+}
 
-	vms_fd = open(file, flags);
-	if (vms_fd < 0)
-		return -1;
-	return 0;
+static void
+out_putc(char c)
+{
+	out_write(&c, 1);
 }
 
+/*
+ * raw fields of the filesystem (such as file names) may not be UTF-8,
+ * so non-ASCII bytes are escaped as U+0080-U+00FF when raw is true.
+ */
 static void
-xdump(const char *data, int len)
+out_json_string(const char *s, size_t len, bool raw)
 {
-	char ascii[17];
-	int i;
+	char buf[8];
+	size_t i;
+	int c;
 
-	ascii[16] = '\0';
+	out_putc('"');
 	for (i = 0; i < len; i++) {
-		char c;
-		if ((i & 15) == 0)
-			printf("%08x:", i);
-		c = *data++;
-		printf(" %02x", c & 0xff);
-		ascii[i & 15] = (0x20 <= c && c < 0x7f) ? c : '.';
-		if ((i & 15) == 15)
-			printf(" <%s>\n", ascii);
-	}
-	ascii[len & 15] = '\0';
-	if (len & 15) {
-		printf("%*s <%s>\n", 48 - (((int)len & 15) * 3), "", ascii);
+		c = s[i] & 0xff;
+		if (c == '"' || c == '\\') {
+			out_putc('\\');
+			out_putc((char)c);
+		} else if (c < 0x20 || c == 0x7f || (raw && c >= 0x80)) {
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out_write(buf, 6);
+		} else {
+			out_putc((char)c);
+		}
 	}
+	out_putc('"');
 }
 
-static int
-vms_nextblock(int blkno)
+static void
+out_csv_string(const char *s, size_t len)
 {
-	int nextblk;
-
-	if (blkno > VMS_MAXBLOCKNO)
-		return -1;
-
-	nextblk = le16toh(vms_fatblk->block[blkno]);
-	if (nextblk == BLOCK_UNALLOCATED)
-		return -1;
-	if (nextblk == BLOCK_LAST)
-		return -1;
+	size_t i;
 
-	return nextblk;
+	for (i = 0; i < len; i++) {
+		if (s[i] == ',' || s[i] == '"' || s[i] == '\r' || s[i] == '\n')
+			break;
+	}
+	if (i == len) {
+		out_write(s, len);
+		return;
+	}
+	out_putc('"');
+	for (i = 0; i < len; i++) {
+		if (s[i] == '"')
+			out_putc('"');
+		out_putc(s[i]);
+	}
+	out_putc('"');
 }
 
-static int
-vms_readwrite_blocks(void *buf, int startblk, int nblk, bool writemode)
+/* write separator and key. returns false if the value is not written */
+static bool
+out_key(const char *key)
 {
-	ssize_t len;
-	off_t rc;
-	int blk, nblkread;
-
-	for (nblkread = 0, blk = startblk; blk <= VMS_MAXBLOCKNO;
-	    blk = le16toh(vms_fatblk->block[blk])) {
-
-		rc = lseek(vms_fd, VMS_BLOCKSIZE * blk, SEEK_SET);
-		if (rc == -1)
-			return -1;
-		if (rc != VMS_BLOCKSIZE * blk) {
-			errno = ESPIPE;
-			return -1;
+	struct out_level *lv = &out_stack[out_depth];
+
+	if (vms_output == VMS_OUTPUT_CSV) {
+		if (out_rowdepth == 0)
+			return false;
+		if (out_depth > out_rowdepth && lv->array) {
+			if (!lv->first)
+				out_putc(' ');
+			lv->first = false;
+			return true;
 		}
-
-		if (writemode)
-			len = write(vms_fd, buf, VMS_BLOCKSIZE);
-		else
-			len = read(vms_fd, buf, VMS_BLOCKSIZE);
-		if (len != VMS_BLOCKSIZE) {
-			errno = ESPIPE;
-			return -1;
+		if (out_csvcol++ != 0) {
+			out_putc(',');
+			if (out_csvheader)
+				putchar(',');
 		}
-
-		buf = (char *)buf + VMS_BLOCKSIZE;
-
-		if (++nblkread >= nblk)
-			break;
+		if (out_csvheader)
+			fputs(key, stdout);
+		return true;
 	}
 
-	if (nblkread != nblk) {
-		errno = ENXIO;
-		return -1;
+	if (!lv->first)
+		out_putc(',');
+	lv->first = false;
+	if (key != NULL && !lv->array) {
+		out_json_string(key, strlen(key), false);
+		out_putc(':');
 	}
-
-	return 0;
+	return true;
 }
 
-static int
-vms_read_blocks(void *buf, int startblk, int nblk)
+static void
+out_push(bool array)
 {
-	return vms_readwrite_blocks(buf, startblk, nblk, false);
+	if (out_depth < OUT_MAXDEPTH - 1)
+		out_depth++;
+	out_stack[out_depth].first = true;
+	out_stack[out_depth].array = array;
 }
 
-static int
-vms_write_blocks(void *buf, int startblk, int nblk)
+static void
+out_strn(const char *key, const char *s, size_t len, bool raw)
 {
-	return vms_readwrite_blocks(buf, startblk, nblk, true);
+	if (!out_key(key))
+		return;
+	if (vms_output == VMS_OUTPUT_CSV)
+		out_csv_string(s, len);
+	else
+		out_json_string(s, len, raw);
 }
 
-static int
-vms_load_root(void)
+static void
+out_str(const char *key, const char *s)
 {
-	int rc;
+	out_strn(key, s, strlen(s), false);
+}
 
-	if (vms_rootblk != NULL)
-		return 0;
+static void
+out_int(const char *key, long long val)
+{
+	char buf[32];
 
-	vms_rootblk = malloc(VMS_BLOCKSIZE);
-	if (vms_rootblk == NULL)
-		return -1;
+	if (!out_key(key))
+		return;
+	snprintf(buf, sizeof(buf), "%lld", val);
+	out_write(buf, strlen(buf));
+}
 
-	rc = vms_read_blocks(vms_rootblk, VMS_ROOTBLOCKNO, 1);
-	if (rc != 0)
-		return rc;
+static void
+out_bool(const char *key, bool val)
+{
+	if (!out_key(key))
+		return;
+	if (val)
+		out_write("true", 4);
+	else
+		out_write("false", 5);
+}
 
-	return 0;
+static void
+out_object_begin(const char *key)
+{
+	if (vms_output != VMS_OUTPUT_CSV && out_key(key))
+		out_putc('{');
+	out_push(false);
 }
 
-static int
-vms_load_fat(void)
+static void
+out_object_end(void)
 {
-	int rc;
+	out_depth--;
+	if (vms_output != VMS_OUTPUT_CSV)
+		out_putc('}');
+}
 
-	rc = vms_load_root();
-	if (rc != 0)
-		return rc;
+static void
+out_array_begin(const char *key)
+{
+	if (out_key(key) && vms_output != VMS_OUTPUT_CSV)
+		out_putc('[');
+	out_push(true);
+}
 
-	if (vms_fatblk != NULL)
-		return 0;
+static void
+out_array_end(void)
+{
+	out_depth--;
+	if (vms_output != VMS_OUTPUT_CSV)
+		out_putc(']');
+}
 
-	vms_fatblk = malloc(VMS_BLOCKSIZE);
-	if (vms_fatblk == NULL)
-		return -1;
+/* a row is an object in JSON, and a line in CSV */
+static void
+out_row_begin(const char *key)
+{
+	out_object_begin(key);
+	if (vms_output != VMS_OUTPUT_CSV)
+		return;
+
+	out_rowdepth = out_depth;
+	out_csvcol = 0;
+	out_csvheader = !out_csvheader_done;
+	out_str("image", vms_filename);
+}
 
-	return vms_read_blocks(vms_fatblk, le16toh(vms_rootblk->fat_blockno), 1);
+static void
+out_row_end(void)
+{
+	if (vms_output == VMS_OUTPUT_CSV) {
+		if (out_csvheader) {
+			putchar('\n');
+			out_csvheader = false;
+			out_csvheader_done = true;
+			fwrite(out_csvbuf, 1, out_csvbuflen, stdout);
+		}
+		putchar('\n');
+		out_rowdepth = 0;
+	}
+	out_object_end();
 }
 
-static int
-vms_save_fat(void)
+static void
+out_record_begin(void)
 {
-	if (vms_fatblk == NULL)
-		return -1;
+	out_depth = 0;
+	out_stack[0].first = true;
+	out_stack[0].array = false;
+	out_object_begin(NULL);
+	out_str("image", vms_filename);
+	if (vms_bank >= 0)
+		out_int("bank", vms_bank);
+	out_str("command", vms_command);
+}
 
-	return vms_write_blocks(vms_fatblk, le16toh(vms_rootblk->fat_blockno), 1);
+static void
+out_record_end(void)
+{
+	out_object_end();
+	if (vms_output != VMS_OUTPUT_CSV)
+		putchar('\n');
 }
 
 static int
-vms_load_dir(void)
+vms_open(const char *file, int flags)
 {
-	int rc, dir_blkno, dir_blksize;
-
-	rc = vms_load_fat();
-	if (rc != 0)
-		return rc;
-
-	if (vms_dirblk != NULL)
-		return 0;
-
-	dir_blkno = le16toh(vms_rootblk->directory_blockno);
-	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
-
-	if (dir_blksize != 13)
-		fprintf(stderr, "WARNING: directory blocksize != 13\n");
+	/* for reopen */
+	vms_rootblk = NULL;
+	vms_fatblk = NULL;
+	vms_dirblk = NULL;
+	vms_arena_reset();
 
-	vms_dirblk = malloc((size_t)dir_blksize * VMS_BLOCKSIZE);
-	if (vms_dirblk == NULL)
+	if (vms_filename != NULL) {
+		free(vms_filename);
+		close(vms_fd);
+	}
+	vms_filename = strdup(file);
+	vms_nblocks = VMS_NUM_BLOCKS;
+	vms_bankoff = (vms_bank < 0) ? 0 : (off_t)vms_bank * VMS_BANKSIZE;
+
+	vms_fd = open(file, flags, 0666);
+	if (vms_fd < 0 && (flags & O_ACCMODE) == O_RDWR &&
+	    (errno == EACCES || errno == EROFS)) {
+		/* read only image. commands that write will fail with EBADF */
+		vms_fd = open(file, (flags & ~O_ACCMODE) | O_RDONLY);
+	}
+	if (vms_fd < 0)
 		return -1;
 
-	return vms_read_blocks(vms_dirblk, dir_blkno, dir_blksize);
+	if (vms_bankoff > 0 && (flags & O_CREAT) == 0) {
+		struct stat st;
+
+		/* the bank must be in the image */
+		if (fstat(vms_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		    st.st_size < vms_bankoff + VMS_BANKSIZE) {
+			close(vms_fd);
+			vms_fd = -1;
+			errno = ENXIO;
+			return -1;
+		}
+	}
+	return 0;
 }
 
+/* an image, or a bank of multi-bank image */
+struct vms_target {
+	const char *filename;
+	int bank;		/* -1 if not specified */
+};
+#define VMS_BANK_ALL	(-2)
+#define VMS_BANK_NJOBS	4	/* default -j for "-b all", as 4X cards have */
+
+/* the number of 128KB banks in the image. a device is one bank */
 static int
-vms_save_dir(void)
+vms_image_nbanks(const char *filename)
 {
-	int dir_blkno, dir_blksize;
+	struct stat st;
 
-	if (vms_dirblk == NULL)
-		return -1;
+	if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= VMS_BANKSIZE || st.st_size / VMS_BANKSIZE > INT_MAX)
+		return 1;
+	return (int)(st.st_size / VMS_BANKSIZE);
+}
 
-	dir_blkno = le16toh(vms_rootblk->directory_blockno);
-	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+/*
+ * hex dump. lines are made from tables of " xx" and of printable
+ * characters into a large buffer, which is written to stdout at once.
+ */
+#define VMS_HEXBUFSIZE	(64 * 1024)
+#define VMS_HEXLINELEN	80	/* longest line, "%08x:" + 16 * " xx" + " <...>\n" */
+static char vms_hextab[256][3];
+static char vms_asciitab[256];
+static char *vms_hexbuf;
+static size_t vms_hexlen;
+
+static void
+vms_hexinit(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
 
-	return vms_write_blocks(vms_dirblk, dir_blkno, dir_blksize);
+	if ((vms_hexbuf = malloc(VMS_HEXBUFSIZE)) == NULL)
+		err(EX_OSERR, "malloc");
+	for (i = 0; i < 256; i++) {
+		vms_hextab[i][0] = ' ';
+		vms_hextab[i][1] = digits[i >> 4];
+		vms_hextab[i][2] = digits[i & 15];
+		vms_asciitab[i] = (0x20 <= i && i < 0x7f) ? (char)i : '.';
+	}
 }
 
-static int
-vms_getfreeblock(void)
+static void
+vms_hexflush(void)
 {
-	int rc, i, nfreeblk;
+	if (vms_hexlen > 0)
+		fwrite(vms_hexbuf, 1, vms_hexlen, stdout);
+	vms_hexlen = 0;
+}
 
-	rc = vms_load_fat();
-	if (rc != 0)
-		return rc;
+static void
+vms_hexputs(const char *s)
+{
+	size_t len = strlen(s);
+
+	if (vms_hexbuf == NULL)
+		vms_hexinit();
+	if (vms_hexlen + len > VMS_HEXBUFSIZE)
+		vms_hexflush();
+	if (len > VMS_HEXBUFSIZE) {
+		fputs(s, stdout);
+		return;
+	}
+	memcpy(vms_hexbuf + vms_hexlen, s, len);
+	vms_hexlen += len;
+}
 
-	nfreeblk = 0;
-	for (i = 0; i <= VMS_MAXBLOCKNO; i++) {
-		if (le16toh(vms_fatblk->block[i]) == BLOCK_UNALLOCATED)
-			nfreeblk++;
+static void
+vms_hexdump(const void *data, size_t len, uint64_t off)
+{
+	static const char digits[] = "0123456789abcdef";
+	const uint8_t *p = data;
+	char *q;
+	size_t i, n;
+	int j;
+
+	if (vms_hexbuf == NULL)
+		vms_hexinit();
+
+	for (; len > 0; p += n, len -= n, off += n) {
+		n = (len < 16) ? len : 16;
+		if (vms_hexlen + VMS_HEXLINELEN > VMS_HEXBUFSIZE)
+			vms_hexflush();
+		q = vms_hexbuf + vms_hexlen;
+
+		for (j = 7; j >= 0; j--)
+			*q++ = digits[(off >> (j * 4)) & 15];
+		*q++ = ':';
+		for (i = 0; i < n; i++, q += 3)
+			memcpy(q, vms_hextab[p[i]], 3);
+		for (; i < 16; i++, q += 3)
+			memcpy(q, "   ", 3);
+		*q++ = ' ';
+		*q++ = '<';
+		for (i = 0; i < n; i++)
+			*q++ = vms_asciitab[p[i]];
+		*q++ = '>';
+		*q++ = '\n';
+		vms_hexlen = (size_t)(q - vms_hexbuf);
 	}
-	return nfreeblk;
+}
+
+static void
+xdump(const char *data, int len)
+{
+	fflush(stdout);
+	vms_hexdump(data, (size_t)len, 0);
+	vms_hexflush();
 }
 
 static int
-vms_allocate_fat(int nblock)
+vms_nextblock(int blkno)
 {
-	int rc, nfreeblk, blk, i;
+	int nextblk;
 
-	rc = vms_load_fat();
-	if (rc != 0)
-		return rc;
+	if (blkno >= vms_nblocks)
+		return -1;
 
-	nfreeblk = vms_getfreeblock();
-	if (nblock > nfreeblk) {
-		errno = ENOSPC;
+	nextblk = le16toh(vms_fatblk->block[blkno]);
+	if (nextblk == BLOCK_UNALLOCATED)
+		return -1;
+	if (nextblk == BLOCK_LAST)
 		return -1;
-	}
 
-	blk = BLOCK_LAST;
-	for (i = 0; nblock > 0 && i <= VMS_MAXBLOCKNO; i++) {
-		if (le16toh(vms_fatblk->block[i]) == BLOCK_UNALLOCATED) {
-			vms_fatblk->block[i] = htole16((uint16_t)blk);
-			blk = i;
-			nblock--;
+	return nextblk;
+}
+
+/*
+ * I/O and timing statistics (-S) and trace export (-T)
+ *
+ * when disabled, the cost is only a test of vms_stats.
+ */
+enum vms_area {
+	VMS_AREA_ROOT,
+	VMS_AREA_FAT,
+	VMS_AREA_DIR,
+	VMS_AREA_DATA,
+	VMS_NAREA
+};
+static const char *vms_areaname[VMS_NAREA] = { "root", "fat", "dir", "data" };
+
+struct vms_iostat {
+	uint64_t nseek;
+	uint64_t nread;
+	uint64_t nwrite;
+	uint64_t rblocks;
+	uint64_t wblocks;
+	uint64_t rbytes;
+	uint64_t wbytes;
+};
+
+struct vms_phasestat {
+	const char *name;
+	uint64_t count;
+	uint64_t wall_ns;
+	uint64_t self_ns;
+	uint64_t cpu_ns;
+};
+
+struct vms_traceevent {
+	const char *name;
+	uint64_t ts_ns;
+	uint64_t dur_ns;
+};
+
+bool vms_stats;
+const char *vms_tracefile;
+pid_t vms_mainpid;
+
+static struct vms_iostat vms_iostat[VMS_NAREA];
+#define VMS_MAXPHASE	32
+static struct vms_phasestat vms_phasestat[VMS_MAXPHASE];
+static struct {
+	const char *name;
+	uint64_t wall0;
+	uint64_t cpu0;
+	uint64_t child_ns;
+} vms_phasestack[8];
+static int vms_phasedepth;
+#define VMS_MAXTRACE	1024
+static struct vms_traceevent vms_trace[VMS_MAXTRACE];
+static int vms_ntrace;
+
+#define VMS_STATS_BEGIN(name)					\
+	do {							\
+		if (__predict_false(vms_stats))			\
+			vms_stats_begin(name);			\
+	} while (0)
+#define VMS_STATS_END()						\
+	do {							\
+		if (__predict_false(vms_stats))			\
+			vms_stats_end();			\
+	} while (0)
+
+static uint64_t
+vms_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void
+vms_stats_begin(const char *name)
+{
+	if (vms_phasedepth >= (int)__arraycount(vms_phasestack))
+		return;
+
+	vms_phasestack[vms_phasedepth].name = name;
+	vms_phasestack[vms_phasedepth].child_ns = 0;
+	vms_phasestack[vms_phasedepth].cpu0 = vms_clock(CLOCK_PROCESS_CPUTIME_ID);
+	vms_phasestack[vms_phasedepth].wall0 = vms_clock(CLOCK_MONOTONIC);
+	vms_phasedepth++;
+}
+
+static void
+vms_stats_end(void)
+{
+	struct vms_phasestat *ps;
+	uint64_t wall, cpu;
+	int i, d;
+
+	if (vms_phasedepth == 0)
+		return;
+
+	d = --vms_phasedepth;
+	wall = vms_clock(CLOCK_MONOTONIC) - vms_phasestack[d].wall0;
+	cpu = vms_clock(CLOCK_PROCESS_CPUTIME_ID) - vms_phasestack[d].cpu0;
+	if (d > 0)
+		vms_phasestack[d - 1].child_ns += wall;
+
+	for (i = 0; i < VMS_MAXPHASE; i++) {
+		ps = &vms_phasestat[i];
+		if (ps->name == NULL)
+			ps->name = vms_phasestack[d].name;
+		if (strcmp(ps->name, vms_phasestack[d].name) == 0) {
+			ps->count++;
+			ps->wall_ns += wall;
+			ps->self_ns += wall - vms_phasestack[d].child_ns;
+			ps->cpu_ns += cpu;
+			break;
 		}
 	}
 
-	return blk;
+	if (vms_tracefile != NULL && vms_ntrace < VMS_MAXTRACE) {
+		vms_trace[vms_ntrace].name = vms_phasestack[d].name;
+		vms_trace[vms_ntrace].ts_ns = vms_phasestack[d].wall0;
+		vms_trace[vms_ntrace].dur_ns = wall;
+		vms_ntrace++;
+	}
 }
 
-static char *
-strbcdtimestamp(const struct timestamp *timestamp)
+static enum vms_area
+vms_blkarea(int blk)
 {
-	snprintf(strxxx_buf, sizeof(strxxx_buf), "%02x%02x-%02x-%02x %02x:%02x:%02x",
-	    timestamp->bcd[0], timestamp->bcd[1], timestamp->bcd[2], timestamp->bcd[3],
-	    timestamp->bcd[4], timestamp->bcd[5], timestamp->bcd[6]);
-	return strxxx_buf;
+	int fat_blkno, dir_blkno;
+
+	if (blk == VMS_ROOTBLOCKNO)
+		return VMS_AREA_ROOT;
+	if (vms_rootblk == NULL)
+		return VMS_AREA_DATA;
+	fat_blkno = le16toh(vms_rootblk->fat_blockno);
+	if (blk <= fat_blkno &&
+	    blk > fat_blkno - le16toh(vms_rootblk->fat_nblocksize))
+		return VMS_AREA_FAT;
+	dir_blkno = le16toh(vms_rootblk->directory_blockno);
+	if (blk <= dir_blkno &&
+	    blk > dir_blkno - le16toh(vms_rootblk->directory_blocksize))
+		return VMS_AREA_DIR;
+	return VMS_AREA_DATA;
 }
 
-static VMSDIR *
-vmsfs_opendir(void)
+static void
+vms_stats_io(int blk, bool writemode, ssize_t len)
 {
-	int rc;
-	VMSDIR *dirp;
+	struct vms_iostat *st = &vms_iostat[vms_blkarea(blk)];
+
+	st->nseek++;
+	if (writemode) {
+		st->nwrite++;
+		if (len > 0) {
+			st->wblocks++;
+			st->wbytes += (uint64_t)len;
+		}
+	} else {
+		st->nread++;
+		if (len > 0) {
+			st->rblocks++;
+			st->rbytes += (uint64_t)len;
+		}
+	}
+}
 
-	rc = vms_load_dir();
-	if (rc != 0)
-		return NULL;
+/* print statistics, and append trace events. called at exit */
+static void
+vms_stats_report(void)
+{
+	struct vms_iostat *st;
+	struct vms_phasestat *ps;
+	FILE *fh;
+	const char *p;
+	int i;
 
-	dirp = malloc(sizeof(VMSDIR));
-	if (dirp == NULL)
-		return NULL;
+	while (vms_phasedepth > 0)
+		vms_stats_end();
+
+	fprintf(stderr, "%s:\n", vms_filename);
+	fprintf(stderr, "%-8s %8s %8s %8s %10s %8s %8s %10s\n", "area",
+	    "seeks", "reads", "rblocks", "rbytes", "writes", "wblocks", "wbytes");
+	for (i = 0; i < VMS_NAREA; i++) {
+		st = &vms_iostat[i];
+		fprintf(stderr, "%-8s %8llu %8llu %8llu %10llu %8llu %8llu %10llu\n",
+		    vms_areaname[i],
+		    (unsigned long long)st->nseek, (unsigned long long)st->nread,
+		    (unsigned long long)st->rblocks, (unsigned long long)st->rbytes,
+		    (unsigned long long)st->nwrite, (unsigned long long)st->wblocks,
+		    (unsigned long long)st->wbytes);
+	}
+	fprintf(stderr, "%-12s %8s %12s %12s %12s\n", "phase",
+	    "calls", "wall(ms)", "self(ms)", "cpu(ms)");
+	for (i = 0; i < VMS_MAXPHASE && vms_phasestat[i].name != NULL; i++) {
+		ps = &vms_phasestat[i];
+		fprintf(stderr, "%-12s %8llu %12.3f %12.3f %12.3f\n", ps->name,
+		    (unsigned long long)ps->count, (double)ps->wall_ns / 1e6,
+		    (double)ps->self_ns / 1e6, (double)ps->cpu_ns / 1e6);
+	}
 
-	memset(dirp, 0, sizeof(*dirp));
-	return dirp;
+	if (vms_tracefile == NULL)
+		return;
+
+	/* Chrome trace event format. the array is opened and closed by main */
+	fh = fopen(vms_tracefile, "a");
+	if (fh == NULL) {
+		warn("%s", vms_tracefile);
+		return;
+	}
+	setvbuf(fh, NULL, _IOFBF, 65536);
+	fprintf(fh, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"args\":{\"name\":\"", (int)getpid());
+	for (p = vms_filename; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			fputc('\\', fh);
+		fputc(*p, fh);
+	}
+	fprintf(fh, "\"}},\n");
+	for (i = 0; i < vms_ntrace; i++) {
+		fprintf(fh, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+		    "\"tid\":0,\"ts\":%.3f,\"dur\":%.3f},\n",
+		    vms_trace[i].name, (int)getpid(),
+		    (double)vms_trace[i].ts_ns / 1e3,
+		    (double)vms_trace[i].dur_ns / 1e3);
+	}
+	fclose(fh);
 }
 
-static struct vmsfs_dirent *
-vmsfs_readdir(VMSDIR *dirp)
+static void
+vms_trace_close(void)
 {
-	int dir_blksize;
+	FILE *fh;
 
-	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+	if (getpid() != vms_mainpid)
+		return;
 
-	while (dirp->loc < VMSFS_DIR_NENTRIES_PER_BLOCK * dir_blksize) {
-		if (vms_dirblk->entries[dirp->loc].type == DIR_TYPE_NONE) {
-			dirp->loc++;
-			continue;
-		}
-		return &vms_dirblk->entries[dirp->loc++];
+	fh = fopen(vms_tracefile, "a");
+	if (fh == NULL) {
+		warn("%s", vms_tracefile);
+		return;
 	}
-	errno = 0;
-	return NULL;
+	fprintf(fh, "{\"name\":\"dcvmstools\",\"ph\":\"i\",\"pid\":%d,"
+	    "\"ts\":%.3f,\"s\":\"g\"}\n]\n",
+	    (int)getpid(), (double)vms_clock(CLOCK_MONOTONIC) / 1e3);
+	fclose(fh);
 }
 
+/*
+ * read back verification (put -V). the contents of the blocks written are
+ * kept by block number (the last write wins), and are compared with the
+ * blocks read from the device after the FAT and directory are written.
+ */
+static char *vms_verify_data;
+static bool *vms_verify_written;
+
 static void
-vmsfs_closedir(VMSDIR *dirp)
+vms_verify_record(int blk, const void *buf)
 {
-	free(dirp);
+	memcpy(vms_verify_data + (size_t)blk * VMS_BLOCKSIZE, buf, VMS_BLOCKSIZE);
+	vms_verify_written[blk] = true;
 }
 
 static int
-vms_dirent_filenamecmp(struct vmsfs_dirent *dp, const char *filename)
+vms_readwrite_blocks(void *buf, int startblk, int nblk, bool writemode)
 {
-	char name[DIR_NAMELEN + 1];
+	ssize_t len;
+	off_t rc;
+	int blk, nblkread;
 
-	memcpy(name, dp->name, sizeof(dp->name));
-	name[DIR_NAMELEN] = '\0';
+	for (nblkread = 0, blk = startblk; blk < vms_nblocks;
+	    blk = le16toh(vms_fatblk->block[blk])) {
 
-	return strcasecmp(name, filename);
-}
+		rc = lseek(vms_fd, vms_bankoff + VMS_BLOCKSIZE * blk, SEEK_SET);
+		if (rc == -1)
+			return -1;
+		if (rc != vms_bankoff + VMS_BLOCKSIZE * blk) {
+			errno = ESPIPE;
+			return -1;
+		}
 
-static struct vmsfs_dirent *
-vms_dirent_alloc(void)
-{
-	int rc, i, dir_blksize;
+		if (writemode) {
+			len = write(vms_fd, buf, VMS_BLOCKSIZE);
+			if (vms_verify_data != NULL && len == VMS_BLOCKSIZE)
+				vms_verify_record(blk, buf);
+		} else {
+			len = read(vms_fd, buf, VMS_BLOCKSIZE);
+		}
+		if (__predict_false(vms_stats))
+			vms_stats_io(blk, writemode, len);
+		if (len != VMS_BLOCKSIZE) {
+			errno = ESPIPE;
+			return -1;
+		}
 
-	rc = vms_load_dir();
-	if (rc != 0)
-		return NULL;
+		buf = (char *)buf + VMS_BLOCKSIZE;
 
-	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+		if (++nblkread >= nblk)
+			break;
+	}
 
-	for (i = 0; i < VMSFS_DIR_NENTRIES_PER_BLOCK * dir_blksize; i++) {
-		if (vms_dirblk->entries[i].type == DIR_TYPE_NONE)
-			return &vms_dirblk->entries[i];
+	if (nblkread != nblk) {
+		errno = ENXIO;
+		return -1;
 	}
 
-	errno = ENOSPC;
-	return NULL;
+	return 0;
 }
 
-static struct vmsfs_dirent *
-vms_dirent_lookup(const char *filename)
+static int
+vms_read_blocks(void *buf, int startblk, int nblk)
 {
-	size_t len;
-	int rc, i, dir_blksize;
+	return vms_readwrite_blocks(buf, startblk, nblk, false);
+}
 
-	rc = vms_load_dir();
-	if (rc != 0)
-		return NULL;
+static int
+vms_write_blocks(void *buf, int startblk, int nblk)
+{
+	return vms_readwrite_blocks(buf, startblk, nblk, true);
+}
 
-	len = strlen(filename);
-	if (len > DIR_NAMELEN) {
-		errno = ENOENT;
-		return NULL;
-	}
+/*
+ * XXH64, a fast non-cryptographic hash, for the contents of files.
+ */
+#define XXH_PRIME64_1	0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2	0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3	0x165667b19e3779f9ULL
+#define XXH_PRIME64_4	0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5	0x27d4eb2f165667c5ULL
+#define XXH_ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t
+xxh64_read64(const uint8_t *p)
+{
+	uint64_t v;
 
-	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
 
-	for (i = 0; i < VMSFS_DIR_NENTRIES_PER_BLOCK * dir_blksize; i++) {
-		if (vms_dirblk->entries[i].type == DIR_TYPE_NONE)
-			continue;
+static inline uint32_t
+xxh64_read32(const uint8_t *p)
+{
+	uint32_t v;
 
-		if (vms_dirent_filenamecmp(&vms_dirblk->entries[i], filename) == 0)
-			return &vms_dirblk->entries[i];
-	}
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
 
-	errno = ENOENT;
-	return NULL;
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH_ROTL64(acc, 31);
+	return acc * XXH_PRIME64_1;
 }
 
-static int
-vms_dirent_print(struct vmsfs_dirent *dp, int verbose)
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
 {
-	printf("%s ", strbcdtimestamp(&dp->timestamp));
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
 
-	switch (dp->attr) {
-	case DIR_ATTR_COPIABLE:
-		printf("         ");
-		break;
-	case DIR_ATTR_PROHIBIT:
-		printf("PROHIBIT ");
-		break;
-	default:
-		printf("0x%02x     ", dp->attr);
-		break;
+static uint64_t
+vms_xxh64(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p = buf, *end = p + len;
+	uint64_t v1, v2, v3, v4, h;
+
+	if (len >= 32) {
+		v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v2 = seed + XXH_PRIME64_2;
+		v3 = seed;
+		v4 = seed - XXH_PRIME64_1;
+		for (; p + 32 <= end; p += 32) {
+			v1 = xxh64_round(v1, xxh64_read64(p));
+			v2 = xxh64_round(v2, xxh64_read64(p + 8));
+			v3 = xxh64_round(v3, xxh64_read64(p + 16));
+			v4 = xxh64_round(v4, xxh64_read64(p + 24));
+		}
+		h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) +
+		    XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
 	}
+	h += len;
 
-	switch (dp->type) {
-	case DIR_TYPE_DATA:
-		printf("DATA ");
-		break;
-	case DIR_TYPE_GAME:
-		printf("GAME ");
-		break;
-	default:
-		printf("0x%02x ", dp->type);
-		break;
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, xxh64_read64(p));
+		h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= xxh64_read32(p) * XXH_PRIME64_1;
+		h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
 	}
 
-	int nblk = le16toh(dp->size);
-	if (nblk <= 1)
-		printf("%3d block  ", nblk);
-	else
-		printf("%3d blocks ", nblk);
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
 
-	printf("%-.12s", dp->name);
+/*
+ * host side cache of the directory of devices (-C cachedir).
+ * a cache file is named by the hash of the path and the bank, and holds
+ * the root block, the FAT and the directory. the root and FAT are always
+ * read from the device, and the directory is taken from the cache only if
+ * they are the same as the cached ones. the cache is removed before the
+ * directory is written, and written again only after the directory has
+ * been written, so it is stale only if the directory has been changed
+ * without the root and FAT by another writer.
+ */
+#define VMS_CACHE_MAGIC		"VMSCACHE"
+#define VMS_CACHE_VERSION	1
+
+struct vms_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint16_t fat_nblocks;		/* in entries */
+	uint16_t dir_nblocks;
+};
 
-	if (dp->header_block_offset != 0)
-		printf("  (+%d)", le16toh(dp->header_block_offset));
+const char *vms_cachedir;
 
-	if (verbose) {
-		printf("\n\tFAT:");
+static void
+vms_cache_path(char *path, size_t pathsize)
+{
+	char realname[PATH_MAX];
+	const char *name;
+	uint64_t hash;
+
+	name = (realpath(vms_filename, realname) != NULL) ?
+	    realname : vms_filename;
+	hash = vms_xxh64(name, strlen(name), (uint64_t)(vms_bank + 1));
+	snprintf(path, pathsize, "%s/%016llx", vms_cachedir,
+	    (unsigned long long)hash);
+}
 
-		int j, blk;
-		for (blk = le16toh(dp->block), j = 0;
+/* returns 0 if the directory is read from the cache */
+static int
+vms_cache_load(void)
+{
+	struct vms_cache_header hdr;
+	char path[PATH_MAX], *buf;
+	size_t fatsize, dirsize;
+	FILE *fh;
+	int rc;
+
+	vms_cache_path(path, sizeof(path));
+	if ((fh = fopen(path, "r")) == NULL)
+		return -1;
+
+	fatsize = (size_t)vms_nblocks * sizeof(vms_fatblk->block[0]);
+	dirsize = le16toh(vms_rootblk->directory_blocksize) * VMS_BLOCKSIZE;
+	buf = malloc(VMS_BLOCKSIZE + fatsize + dirsize);
+	if (buf == NULL) {
+		fclose(fh);
+		return -1;
+	}
+
+	rc = -1;
+	if (fread(&hdr, sizeof(hdr), 1, fh) == 1 &&
+	    memcmp(hdr.magic, VMS_CACHE_MAGIC, sizeof(hdr.magic)) == 0 &&
+	    le32toh(hdr.version) == VMS_CACHE_VERSION &&
+	    le16toh(hdr.fat_nblocks) == vms_nblocks &&
+	    le16toh(hdr.dir_nblocks) == dirsize / VMS_BLOCKSIZE &&
+	    fread(buf, VMS_BLOCKSIZE + fatsize + dirsize, 1, fh) == 1 &&
+	    memcmp(buf, vms_rootblk, VMS_BLOCKSIZE) == 0 &&
+	    memcmp(buf + VMS_BLOCKSIZE, vms_fatblk, fatsize) == 0) {
+		memcpy(vms_dirblk, buf + VMS_BLOCKSIZE + fatsize, dirsize);
+		rc = 0;
+	}
+	free(buf);
+	fclose(fh);
+	return rc;
+}
+
+/* the cache is replaced by rename(2), as other jobs may read it */
+static void
+vms_cache_save(void)
+{
+	struct vms_cache_header hdr;
+	char path[PATH_MAX], tmppath[PATH_MAX + 8];
+	size_t fatsize, dirsize;
+	FILE *fh;
+	int fd;
+
+	if (vms_rootblk == NULL || vms_fatblk == NULL || vms_dirblk == NULL)
+		return;
+
+	fatsize = (size_t)vms_nblocks * sizeof(vms_fatblk->block[0]);
+	dirsize = le16toh(vms_rootblk->directory_blocksize) * VMS_BLOCKSIZE;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, VMS_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(VMS_CACHE_VERSION);
+	hdr.fat_nblocks = htole16((uint16_t)vms_nblocks);
+	hdr.dir_nblocks = htole16((uint16_t)(dirsize / VMS_BLOCKSIZE));
+
+	vms_cache_path(path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmppath)) < 0)
+		return;
+	if ((fh = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fh);
+	fwrite(vms_rootblk, VMS_BLOCKSIZE, 1, fh);
+	fwrite(vms_fatblk, fatsize, 1, fh);
+	fwrite(vms_dirblk, dirsize, 1, fh);
+	if (fclose(fh) != 0 || rename(tmppath, path) != 0)
+		unlink(tmppath);
+}
+
+static void
+vms_cache_remove(void)
+{
+	char path[PATH_MAX];
+
+	vms_cache_path(path, sizeof(path));
+	unlink(path);
+}
+
+static int
+vms_load_root(void)
+{
+	int rc;
+
+	if (vms_rootblk != NULL)
+		return 0;
+
+	vms_rootblk = vms_arena_alloc(VMS_BLOCKSIZE);
+	if (vms_rootblk == NULL)
+		return -1;
+
+	VMS_STATS_BEGIN("load_root");
+	rc = vms_read_blocks(vms_rootblk, VMS_ROOTBLOCKNO, 1);
+	VMS_STATS_END();
+	if (rc != 0)
+		return rc;
+
+	return 0;
+}
+
+static int
+vms_save_root(void)
+{
+	int rc;
+
+	if (vms_rootblk == NULL)
+		return -1;
+
+	VMS_STATS_BEGIN("save_root");
+	rc = vms_write_blocks(vms_rootblk, VMS_ROOTBLOCKNO, 1);
+	VMS_STATS_END();
+	return rc;
+}
+
+/*
+ * FAT is fat_nblocksize blocks, contiguous and descending from fat_blockno
+ * as the directory is. it cannot be read along its own chain.
+ */
+static int
+vms_readwrite_fat(bool writemode)
+{
+	int rc, i, fat_blkno, fat_blksize;
+
+	fat_blkno = le16toh(vms_rootblk->fat_blockno);
+	fat_blksize = le16toh(vms_rootblk->fat_nblocksize);
+
+	for (rc = 0, i = 0; rc == 0 && i < fat_blksize; i++) {
+		rc = vms_readwrite_blocks(
+		    &vms_fatblk->block[i * VMS_FAT_NENTRIES_PER_BLOCK],
+		    fat_blkno - i, 1, writemode);
+	}
+	return rc;
+}
+
+static int
+vms_load_fat(void)
+{
+	int rc, i, fat_blkno, fat_blksize;
+
+	rc = vms_load_root();
+	if (rc != 0)
+		return rc;
+
+	if (vms_fatblk != NULL)
+		return 0;
+
+	fat_blkno = le16toh(vms_rootblk->fat_blockno);
+	fat_blksize = le16toh(vms_rootblk->fat_nblocksize);
+	if (fat_blksize < 1 || fat_blksize > VMS_MAXFATBLOCKS ||
+	    fat_blksize > fat_blkno + 1) {
+		errno = EFTYPE;
+		return -1;
+	}
+	vms_nblocks = fat_blksize * VMS_FAT_NENTRIES_PER_BLOCK;
+
+	vms_fatblk = vms_arena_alloc(sizeof(*vms_fatblk));
+	if (vms_fatblk == NULL)
+		return -1;
+	for (i = vms_nblocks; i < VMS_MAXNUM_BLOCKS; i++)
+		vms_fatblk->block[i] = htole16(BLOCK_UNALLOCATED);
+
+	VMS_STATS_BEGIN("load_fat");
+	rc = vms_readwrite_fat(false);
+	VMS_STATS_END();
+	return rc;
+}
+
+static int
+vms_save_fat(void)
+{
+	int rc;
+
+	if (vms_fatblk == NULL)
+		return -1;
+
+	VMS_STATS_BEGIN("save_fat");
+	rc = vms_readwrite_fat(true);
+	VMS_STATS_END();
+	return rc;
+}
+
+static int
+vms_load_dir(void)
+{
+	int rc, dir_blkno, dir_blksize;
+
+	rc = vms_load_fat();
+	if (rc != 0)
+		return rc;
+
+	if (vms_dirblk != NULL)
+		return 0;
+
+	dir_blkno = le16toh(vms_rootblk->directory_blockno);
+	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+
+	if (dir_blksize != 13)
+		fprintf(stderr, "WARNING: directory blocksize != 13\n");
+
+	vms_dirblk = vms_arena_alloc((size_t)dir_blksize * VMS_BLOCKSIZE);
+	if (vms_dirblk == NULL)
+		return -1;
+
+	/* the root and FAT have just been read, and validate the cache */
+	if (vms_cachedir != NULL && vms_cache_load() == 0)
+		return 0;
+
+	VMS_STATS_BEGIN("load_dir");
+	rc = vms_read_blocks(vms_dirblk, dir_blkno, dir_blksize);
+	VMS_STATS_END();
+	if (rc == 0 && vms_cachedir != NULL)
+		vms_cache_save();
+	return rc;
+}
+
+static int
+vms_save_dir(void)
+{
+	int rc, dir_blkno, dir_blksize;
+
+	if (vms_dirblk == NULL)
+		return -1;
+
+	dir_blkno = le16toh(vms_rootblk->directory_blockno);
+	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+
+	/*
+	 * a cache with the root and FAT of the card must not outlive a
+	 * failed (or partial) write of the directory. a root or FAT written
+	 * after this is validated when the cache is loaded.
+	 */
+	if (vms_cachedir != NULL)
+		vms_cache_remove();
+
+	VMS_STATS_BEGIN("save_dir");
+	rc = vms_write_blocks(vms_dirblk, dir_blkno, dir_blksize);
+	VMS_STATS_END();
+	if (rc == 0 && vms_cachedir != NULL)
+		vms_cache_save();
+	return rc;
+}
+
+static int
+vms_getfreeblock(void)
+{
+	int rc, i, nfreeblk;
+
+	rc = vms_load_fat();
+	if (rc != 0)
+		return rc;
+
+	nfreeblk = 0;
+	for (i = 0; i < vms_nblocks; i++) {
+		if (le16toh(vms_fatblk->block[i]) == BLOCK_UNALLOCATED)
+			nfreeblk++;
+	}
+	return nfreeblk;
+}
+
+static int
+vms_allocate_fat(int nblock)
+{
+	int rc, nfreeblk, blk, i;
+
+	rc = vms_load_fat();
+	if (rc != 0)
+		return rc;
+
+	nfreeblk = vms_getfreeblock();
+	if (nblock > nfreeblk) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	blk = BLOCK_LAST;
+	for (i = 0; nblock > 0 && i < vms_nblocks; i++) {
+		if (le16toh(vms_fatblk->block[i]) == BLOCK_UNALLOCATED) {
+			vms_fatblk->block[i] = htole16((uint16_t)blk);
+			blk = i;
+			nblock--;
+		}
+	}
+
+	return blk;
+}
+
+/*
+ * allocate the chain for the file of dp in user area, as the console does.
+ * a GAME file is contiguous from block 0, and a DATA file is allocated
+ * from the top of user area.
+ */
+static int
+vms_allocate_fat_dirent(const struct vmsfs_dirent *dp)
+{
+	int i, blk, prev, nblk, user_blocks;
+
+	if (vms_load_fat() != 0)
+		return -1;
+	user_blocks = le16toh(vms_rootblk->user_blocks);
+	if (user_blocks > vms_nblocks)
+		user_blocks = vms_nblocks;
+
+	nblk = le16toh(dp->size);
+	if (nblk < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (dp->type == DIR_TYPE_GAME) {
+		if (nblk > user_blocks) {
+			errno = ENOSPC;
+			return -1;
+		}
+		for (i = 0; i < nblk; i++) {
+			if (le16toh(vms_fatblk->block[i]) != BLOCK_UNALLOCATED) {
+				errno = ENOSPC;
+				return -1;
+			}
+		}
+		for (i = 0; i < nblk - 1; i++)
+			vms_fatblk->block[i] = htole16((uint16_t)(i + 1));
+		vms_fatblk->block[i] = htole16(BLOCK_LAST);
+		return 0;
+	}
+
+	prev = blk = -1;
+	for (i = user_blocks - 1; nblk > 0 && i >= 0; i--) {
+		if (le16toh(vms_fatblk->block[i]) != BLOCK_UNALLOCATED)
+			continue;
+		if (prev < 0)
+			blk = i;
+		else
+			vms_fatblk->block[prev] = htole16((uint16_t)i);
+		vms_fatblk->block[i] = htole16(BLOCK_LAST);
+		prev = i;
+		nblk--;
+	}
+	if (nblk > 0) {
+		/* give them back */
+		for (i = blk; i >= 0; i = prev) {
+			prev = vms_nextblock(i);
+			vms_fatblk->block[i] = htole16(BLOCK_UNALLOCATED);
+		}
+		errno = ENOSPC;
+		return -1;
+	}
+	return blk;
+}
+
+static int
+vms_verify_begin(void)
+{
+	vms_verify_data = calloc(VMS_MAXNUM_BLOCKS, VMS_BLOCKSIZE);
+	vms_verify_written = calloc(VMS_MAXNUM_BLOCKS, sizeof(*vms_verify_written));
+	if (vms_verify_data == NULL || vms_verify_written == NULL)
+		return -1;
+	return 0;
+}
+
+static void
+vms_verify_end(void)
+{
+	free(vms_verify_data);
+	free(vms_verify_written);
+	vms_verify_data = NULL;
+	vms_verify_written = NULL;
+}
+
+/*
+ * read the written blocks back, a run of contiguous blocks at once, and
+ * mark the blocks which differ in bad[]. returns the number of them.
+ */
+static int
+vms_verify_blocks(bool *bad, int *nverified)
+{
+	char *buf;
+	ssize_t len;
+	int blk, n, i, nbad;
+
+	buf = malloc((size_t)vms_nblocks * VMS_BLOCKSIZE);
+	if (buf == NULL)
+		return -1;
+
+	*nverified = nbad = 0;
+	for (blk = 0; blk < vms_nblocks; blk += n) {
+		for (n = 0; blk + n < vms_nblocks && vms_verify_written[blk + n]; n++)
+			;
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+		len = pread(vms_fd, buf, (size_t)n * VMS_BLOCKSIZE,
+		    vms_bankoff + (off_t)blk * VMS_BLOCKSIZE);
+		for (i = 0; i < n; i++) {
+			if (__predict_false(vms_stats))
+				vms_stats_io(blk + i, false, (len > 0) ? VMS_BLOCKSIZE : len);
+			if (len != (ssize_t)n * VMS_BLOCKSIZE ||
+			    memcmp(buf + (size_t)i * VMS_BLOCKSIZE, vms_verify_data +
+			    (size_t)(blk + i) * VMS_BLOCKSIZE, VMS_BLOCKSIZE) != 0) {
+				bad[blk + i] = true;
+				nbad++;
+			}
+			(*nverified)++;
+		}
+	}
+	free(buf);
+	return nbad;
+}
+
+/*
+ * write the bad blocks again. a block of a DATA file is moved to a free
+ * block in user area which has not been bad, and the old one is left
+ * free. the others (system area and GAME files) are written in place.
+ */
+static int
+vms_verify_retry(const bool *bad, bool *avoid)
+{
+	struct vmsfs_dirent *dp, *owner;
+	uint16_t *link;
+	int i, j, n, blk, nb, user_blocks, ndirents;
+
+	user_blocks = le16toh(vms_rootblk->user_blocks);
+	if (user_blocks > vms_nblocks)
+		user_blocks = vms_nblocks;
+	ndirents = VMSFS_DIR_NENTRIES_PER_BLOCK *
+	    le16toh(vms_rootblk->directory_blocksize);
+
+	for (blk = 0; blk < vms_nblocks; blk++) {
+		if (!bad[blk])
+			continue;
+		avoid[blk] = true;
+
+		/*
+		 * the link to the block, from the dirent or the previous block.
+		 * a chain is walked at most vms_nblocks steps, as it may loop.
+		 */
+		link = NULL;
+		owner = NULL;
+		for (i = 0; i < ndirents && vms_dirblk != NULL; i++) {
+			dp = &vms_dirblk->entries[i];
+			if (dp->type != DIR_TYPE_NONE)
+				for (j = le16toh(dp->block), n = 0;
+				    j >= 0 && n < vms_nblocks;
+				    j = vms_nextblock(j), n++)
+					if (j == blk) {
+						owner = dp;
+						break;
+					}
+			if (owner != NULL)
+				break;
+		}
+		if (owner != NULL && owner->type == DIR_TYPE_DATA) {
+			if (le16toh(owner->block) == blk)
+				link = &owner->block;
+			for (i = 0; link == NULL && i < vms_nblocks; i++) {
+				if (le16toh(vms_fatblk->block[i]) == blk)
+					link = &vms_fatblk->block[i];
+			}
+		}
+
+		for (nb = user_blocks - 1; link != NULL && nb >= 0; nb--) {
+			if (!avoid[nb] &&
+			    le16toh(vms_fatblk->block[nb]) == BLOCK_UNALLOCATED)
+				break;
+		}
+		if (link == NULL || nb < 0) {
+			/* in place */
+			if (vms_write_blocks(vms_verify_data +
+			    (size_t)blk * VMS_BLOCKSIZE, blk, 1) != 0)
+				return -1;
+			continue;
+		}
+
+		/*
+		 * FAT has no mark for a bad block, and a block allocated but
+		 * not in any chain is an orphan to fsck. the bad block is
+		 * freed, and may be used by a later put again.
+		 */
+		vms_fatblk->block[nb] = vms_fatblk->block[blk];
+		vms_fatblk->block[blk] = htole16(BLOCK_UNALLOCATED);
+		*link = htole16((uint16_t)nb);
+		vms_verify_written[blk] = false;
+		if (vms_write_blocks(vms_verify_data +
+		    (size_t)blk * VMS_BLOCKSIZE, nb, 1) != 0)
+			return -1;
+		printf("block %d: moved to block %d\n", blk, nb);
+	}
+	return 0;
+}
+
+/*
+ * make a blank filesystem on memory: the root block, the FAT which has
+ * only the system area, and an empty directory.
+ */
+static int
+vmsfs_newfs(const struct timestamp *timestamp)
+{
+	int i;
+
+	vms_arena_reset();
+	vms_rootblk = vms_arena_calloc(1, VMS_BLOCKSIZE);
+	vms_fatblk = vms_arena_calloc(1, sizeof(*vms_fatblk));
+	vms_dirblk = vms_arena_calloc(VMS_DIRBLOCKSIZE, VMS_BLOCKSIZE);
+	if (vms_rootblk == NULL || vms_fatblk == NULL || vms_dirblk == NULL)
+		return -1;
+	vms_nblocks = VMS_NUM_BLOCKS;
+
+	memset(vms_rootblk->magic, 0x55, sizeof(vms_rootblk->magic));
+	vms_rootblk->color = 1;
+	vms_rootblk->timestamp = *timestamp;
+	vms_rootblk->fat_blockno = htole16(VMS_FATBLOCKNO);
+	vms_rootblk->fat_nblocksize = htole16(1);
+	vms_rootblk->directory_blockno = htole16(VMS_DIRBLOCKNO);
+	vms_rootblk->directory_blocksize = htole16(VMS_DIRBLOCKSIZE);
+	vms_rootblk->icon_block = htole16(0);
+	vms_rootblk->user_blocks = htole16(VMS_USERBLOCKS);
+
+	for (i = 0; i < VMS_MAXNUM_BLOCKS; i++)
+		vms_fatblk->block[i] = htole16(BLOCK_UNALLOCATED);
+	vms_fatblk->block[VMS_ROOTBLOCKNO] = htole16(BLOCK_LAST);
+	vms_fatblk->block[VMS_FATBLOCKNO] = htole16(BLOCK_LAST);
+	for (i = 0; i < VMS_DIRBLOCKSIZE - 1; i++)
+		vms_fatblk->block[VMS_DIRBLOCKNO - i] = htole16((uint16_t)(VMS_DIRBLOCKNO - i - 1));
+	vms_fatblk->block[VMS_DIRBLOCKNO - i] = htole16(BLOCK_LAST);
+
+	return 0;
+}
+
+/*
+ * make the image file blank (all zero, and sparse if the filesystem can).
+ * with a bank selected, only the bank is cleared and the others are kept.
+ * fails with EFTYPE for a device.
+ */
+static int
+vms_image_create(void)
+{
+	struct stat st;
+	char *zero;
+	ssize_t rc;
+
+	if (fstat(vms_fd, &st) != 0)
+		return -1;
+	if (!S_ISREG(st.st_mode)) {
+		errno = EFTYPE;
+		return -1;
+	}
+	if (vms_bank < 0) {
+		if (ftruncate(vms_fd, 0) != 0)
+			return -1;
+		return ftruncate(vms_fd, VMS_BANKSIZE);
+	}
+
+	if (st.st_size <= vms_bankoff)
+		return ftruncate(vms_fd, vms_bankoff + VMS_BANKSIZE);
+	if ((zero = calloc(1, VMS_BANKSIZE)) == NULL)
+		return -1;
+	rc = pwrite(vms_fd, zero, VMS_BANKSIZE, vms_bankoff);
+	free(zero);
+	return (rc == VMS_BANKSIZE) ? 0 : -1;
+}
+
+/*
+ * BCD timestamp of the directory entries and the root block, in localtime.
+ * bcd[0..7] are century, year, month, day, hour, minute, second, and the
+ * day of week (0=monday). the dates are converted with the arithmetic of
+ * the proleptic gregorian calendar, and the offset from UTC is taken by
+ * localtime_r() once for each day and cached, as it changes at most once
+ * a day. since the fields are in order and BCD keeps the order of
+ * decimal, two valid timestamps compare as the bytes of bcd[0..6] do.
+ */
+#define DEC2BCD(d)	((uint8_t)((((d) / 10) << 4) | ((d) % 10)))
+#define BCD2DEC(b)	((((b) >> 4) * 10) + ((b) & 0x0f))
+#define VMS_TIMESTAMP_CMPLEN	7	/* without the day of week */
+#define VMS_SECSPERDAY		86400
+#define VMS_TZCACHE_SIZE	64
+
+struct vms_tzcache {
+	int64_t day;		/* days from the epoch, in UTC */
+	long offset;		/* seconds east of UTC */
+	bool valid;
+};
+static struct vms_tzcache vms_tzcache[VMS_TZCACHE_SIZE];
+
+static int64_t
+vms_floordiv(int64_t a, int64_t b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static bool
+vms_leapyear(int year)
+{
+	return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static int
+vms_days_in_month(int year, int month)
+{
+	static const int mdays[12] =
+	    { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	return (month == 2 && vms_leapyear(year)) ? 29 : mdays[month - 1];
+}
+
+/* days from 1970-01-01 */
+static int64_t
+vms_days_from_civil(int year, int month, int day)
+{
+	int64_t y, era, yoe, doy, doe;
+
+	y = (month <= 2) ? year - 1 : year;
+	era = vms_floordiv(y, 400);
+	yoe = y - era * 400;
+	doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+static void
+vms_civil_from_days(int64_t days, int *yearp, int *monthp, int *dayp)
+{
+	int64_t era, doe, yoe, doy, mp, y;
+
+	days += 719468;
+	era = vms_floordiv(days, 146097);
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*dayp = (int)(doy - (153 * mp + 2) / 5 + 1);
+	*monthp = (int)((mp < 10) ? mp + 3 : mp - 9);
+	*yearp = (int)((*monthp <= 2) ? y + 1 : y);
+}
+
+/* the offset of localtime from UTC at t */
+static long
+vms_utcoffset(time_t t)
+{
+	struct vms_tzcache *c;
+	struct tm tm0, tm1;
+	time_t t0, t1;
+	int64_t day;
+
+	day = vms_floordiv(t, VMS_SECSPERDAY);
+	c = &vms_tzcache[day & (VMS_TZCACHE_SIZE - 1)];
+	if (c->valid && c->day == day)
+		return c->offset;
+
+	t0 = (time_t)(day * VMS_SECSPERDAY);
+	t1 = t0 + VMS_SECSPERDAY - 1;
+	if (localtime_r(&t0, &tm0) == NULL || localtime_r(&t1, &tm1) == NULL)
+		return 0;
+	if (tm0.tm_gmtoff != tm1.tm_gmtoff) {
+		/* the offset changes in this day */
+		if (localtime_r(&t, &tm0) == NULL)
+			return 0;
+		return tm0.tm_gmtoff;
+	}
+	c->day = day;
+	c->offset = tm0.tm_gmtoff;
+	c->valid = true;
+	return c->offset;
+}
+
+static bool
+vms_bcd_valid(uint8_t b)
+{
+	return (b >> 4) <= 9 && (b & 0x0f) <= 9;
+}
+
+static bool
+vms_timestamp_valid(const struct timestamp *ts)
+{
+	int i, year, month, day;
+
+	for (i = 0; i < 8; i++) {
+		if (!vms_bcd_valid(ts->bcd[i]))
+			return false;
+	}
+	year = BCD2DEC(ts->bcd[0]) * 100 + BCD2DEC(ts->bcd[1]);
+	month = BCD2DEC(ts->bcd[2]);
+	day = BCD2DEC(ts->bcd[3]);
+	return month >= 1 && month <= 12 &&
+	    day >= 1 && day <= vms_days_in_month(year, month) &&
+	    BCD2DEC(ts->bcd[4]) < 24 && BCD2DEC(ts->bcd[5]) < 60 &&
+	    BCD2DEC(ts->bcd[6]) < 60 && BCD2DEC(ts->bcd[7]) < 7;
+}
+
+static int
+vmsfs_unixtime2bcdtimestamp(struct timestamp *timestamp, time_t mtime)
+{
+	int64_t local, days, secs, wday;
+	int year, month, day;
+
+	local = (int64_t)mtime + vms_utcoffset(mtime);
+	days = vms_floordiv(local, VMS_SECSPERDAY);
+	secs = local - days * VMS_SECSPERDAY;
+	vms_civil_from_days(days, &year, &month, &day);
+	if (year < 0 || year > 9999) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	timestamp->bcd[0] = DEC2BCD(year / 100);
+	timestamp->bcd[1] = DEC2BCD(year % 100);
+	timestamp->bcd[2] = DEC2BCD(month);
+	timestamp->bcd[3] = DEC2BCD(day);
+	timestamp->bcd[4] = DEC2BCD((int)(secs / 3600));
+	timestamp->bcd[5] = DEC2BCD((int)(secs / 60 % 60));
+	timestamp->bcd[6] = DEC2BCD((int)(secs % 60));
+	/* 1970-01-01 is thursday */
+	wday = days + 3 - vms_floordiv(days + 3, 7) * 7;
+	timestamp->bcd[7] = DEC2BCD((int)wday);
+	return 0;
+}
+
+/*
+ * bcdtimestamp will be always treated as localtime.
+ * returns -1 with errno=EINVAL if the timestamp is not valid.
+ */
+static time_t
+vmsfs_bcdtimestamp2unixtime(const struct timestamp *timestamp)
+{
+	int64_t local, t;
+
+	if (!vms_timestamp_valid(timestamp)) {
+		errno = EINVAL;
+		return (time_t)-1;
+	}
+	local = vms_days_from_civil(
+	    BCD2DEC(timestamp->bcd[0]) * 100 + BCD2DEC(timestamp->bcd[1]),
+	    BCD2DEC(timestamp->bcd[2]), BCD2DEC(timestamp->bcd[3])) *
+	    VMS_SECSPERDAY + BCD2DEC(timestamp->bcd[4]) * 3600 +
+	    BCD2DEC(timestamp->bcd[5]) * 60 + BCD2DEC(timestamp->bcd[6]);
+
+	/* the offset at the time, which is guessed by the offset at local */
+	t = local - vms_utcoffset((time_t)local);
+	return (time_t)(local - vms_utcoffset((time_t)t));
+}
+
+/*
+ * parse "YYYY-MM-DD[ HH:MM[:SS]]" ('T' can be used for ' ') to a timestamp.
+ * the fields omitted are the start of the day or minute, or the end of it
+ * if end is true, so that a range of days includes the last day.
+ */
+static int
+vms_parse_timestamp(struct timestamp *ts, const char *s, bool end)
+{
+	int year, month, day, hour, min, sec, n, len;
+
+	hour = min = sec = end ? -1 : 0;
+	len = 0;
+	n = sscanf(s, "%4d-%2d-%2d%n", &year, &month, &day, &len);
+	if (n != 3)
+		return -1;
+	s += len;
+	if (*s == ' ' || *s == 'T') {
+		len = 0;
+		n = sscanf(s + 1, "%2d:%2d%n", &hour, &min, &len);
+		if (n != 2)
+			return -1;
+		s += 1 + len;
+		if (*s == ':') {
+			len = 0;
+			if (sscanf(s + 1, "%2d%n", &sec, &len) != 1)
+				return -1;
+			s += 1 + len;
+		}
+	}
+	if (*s != '\0')
+		return -1;
+	if (hour < 0)
+		hour = 23;
+	if (min < 0)
+		min = 59;
+	if (sec < 0)
+		sec = 59;
+
+	if (year < 0 || year > 9999 || month < 1 || month > 12 ||
+	    day < 1 || day > vms_days_in_month(year, month) ||
+	    hour > 23 || min > 59 || sec > 59)
+		return -1;
+	ts->bcd[0] = DEC2BCD(year / 100);
+	ts->bcd[1] = DEC2BCD(year % 100);
+	ts->bcd[2] = DEC2BCD(month);
+	ts->bcd[3] = DEC2BCD(day);
+	ts->bcd[4] = DEC2BCD(hour);
+	ts->bcd[5] = DEC2BCD(min);
+	ts->bcd[6] = DEC2BCD(sec);
+	ts->bcd[7] = 0;
+	return 0;
+}
+
+/*
+ * range of timestamps to select the files (-a since, -b until).
+ * it is compared with the BCD as it is, without any conversion.
+ */
+struct vms_timerange {
+	struct timestamp since;
+	struct timestamp until;
+	bool has_since;
+	bool has_until;
+};
+
+static int
+vms_timerange_getopt(struct vms_timerange *range, int ch, const char *arg)
+{
+	if (ch == 'a') {
+		if (vms_parse_timestamp(&range->since, arg, false) != 0)
+			goto badtime;
+		range->has_since = true;
+	} else {
+		if (vms_parse_timestamp(&range->until, arg, true) != 0)
+			goto badtime;
+		range->has_until = true;
+	}
+	return 0;
+
+ badtime:
+	warnx("%s: invalid time, should be YYYY-MM-DD[ HH:MM[:SS]]", arg);
+	return -1;
+}
+
+static bool
+vms_timerange_match(const struct vms_timerange *range,
+    const struct timestamp *ts)
+{
+	if (!range->has_since && !range->has_until)
+		return true;
+	if (!vms_timestamp_valid(ts))
+		return false;
+	if (range->has_since &&
+	    memcmp(ts->bcd, range->since.bcd, VMS_TIMESTAMP_CMPLEN) < 0)
+		return false;
+	if (range->has_until &&
+	    memcmp(ts->bcd, range->until.bcd, VMS_TIMESTAMP_CMPLEN) > 0)
+		return false;
+	return true;
+}
+
+static char *
+strbcdtimestamp(char *buf, size_t bufsize, const struct timestamp *timestamp)
+{
+	snprintf(buf, bufsize, "%02x%02x-%02x-%02x %02x:%02x:%02x",
+	    timestamp->bcd[0], timestamp->bcd[1], timestamp->bcd[2], timestamp->bcd[3],
+	    timestamp->bcd[4], timestamp->bcd[5], timestamp->bcd[6]);
+	return buf;
+}
+
+static char *
+strisotimestamp(char *buf, size_t bufsize, const struct timestamp *timestamp)
+{
+	snprintf(buf, bufsize, "%02x%02x-%02x-%02xT%02x:%02x:%02x",
+	    timestamp->bcd[0], timestamp->bcd[1], timestamp->bcd[2], timestamp->bcd[3],
+	    timestamp->bcd[4], timestamp->bcd[5], timestamp->bcd[6]);
+	return buf;
+}
+
+static VMSDIR *
+vmsfs_opendir(void)
+{
+	int rc;
+	VMSDIR *dirp;
+
+	rc = vms_load_dir();
+	if (rc != 0)
+		return NULL;
+
+	dirp = vms_arena_calloc(1, sizeof(VMSDIR));
+	if (dirp == NULL)
+		return NULL;
+
+	return dirp;
+}
+
+static struct vmsfs_dirent *
+vmsfs_readdir(VMSDIR *dirp)
+{
+	int dir_blksize;
+
+	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+
+	while (dirp->loc < VMSFS_DIR_NENTRIES_PER_BLOCK * dir_blksize) {
+		if (vms_dirblk->entries[dirp->loc].type == DIR_TYPE_NONE) {
+			dirp->loc++;
+			continue;
+		}
+		return &vms_dirblk->entries[dirp->loc++];
+	}
+	errno = 0;
+	return NULL;
+}
+
+static void
+vmsfs_closedir(VMSDIR *dirp)
+{
+	/* the handle is freed with the arena */
+	dirp->loc = INT_MAX;
+}
+
+static int
+vms_dirent_filenamecmp(struct vmsfs_dirent *dp, const char *filename)
+{
+	char name[DIR_NAMELEN + 1];
+
+	memcpy(name, dp->name, sizeof(dp->name));
+	name[DIR_NAMELEN] = '\0';
+
+	return strcasecmp(name, filename);
+}
+
+static struct vmsfs_dirent *
+vms_dirent_alloc(void)
+{
+	int rc, i, dir_blksize;
+
+	rc = vms_load_dir();
+	if (rc != 0)
+		return NULL;
+
+	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+
+	for (i = 0; i < VMSFS_DIR_NENTRIES_PER_BLOCK * dir_blksize; i++) {
+		if (vms_dirblk->entries[i].type == DIR_TYPE_NONE)
+			return &vms_dirblk->entries[i];
+	}
+
+	errno = ENOSPC;
+	return NULL;
+}
+
+static struct vmsfs_dirent *
+vms_dirent_lookup(const char *filename)
+{
+	size_t len;
+	int rc, i, dir_blksize;
+
+	rc = vms_load_dir();
+	if (rc != 0)
+		return NULL;
+
+	len = strlen(filename);
+	if (len > DIR_NAMELEN) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+
+	for (i = 0; i < VMSFS_DIR_NENTRIES_PER_BLOCK * dir_blksize; i++) {
+		if (vms_dirblk->entries[i].type == DIR_TYPE_NONE)
+			continue;
+
+		if (vms_dirent_filenamecmp(&vms_dirblk->entries[i], filename) == 0)
+			return &vms_dirblk->entries[i];
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
+static int
+vms_dirent_print(struct vmsfs_dirent *dp, int verbose)
+{
+	char buf[VMS_TEXTBUFSIZE];
+
+	printf("%s ", strbcdtimestamp(buf, sizeof(buf), &dp->timestamp));
+
+	switch (dp->attr) {
+	case DIR_ATTR_COPIABLE:
+		printf("         ");
+		break;
+	case DIR_ATTR_PROHIBIT:
+		printf("PROHIBIT ");
+		break;
+	default:
+		printf("0x%02x     ", dp->attr);
+		break;
+	}
+
+	switch (dp->type) {
+	case DIR_TYPE_DATA:
+		printf("DATA ");
+		break;
+	case DIR_TYPE_GAME:
+		printf("GAME ");
+		break;
+	default:
+		printf("0x%02x ", dp->type);
+		break;
+	}
+
+	int nblk = le16toh(dp->size);
+	if (nblk <= 1)
+		printf("%3d block  ", nblk);
+	else
+		printf("%3d blocks ", nblk);
+
+	printf("%-.12s", dp->name);
+
+	if (dp->header_block_offset != 0)
+		printf("  (+%d)", le16toh(dp->header_block_offset));
+
+	if (verbose) {
+		printf("\n\tFAT:");
+
+		int j, blk;
+		for (blk = le16toh(dp->block), j = 0;
 		    blk >= 0; j++) {
 
-			if (j > nblk) {
-				printf(" <ERR:over FAT chain!>");
+			if (j > nblk) {
+				printf(" <ERR:over FAT chain!>");
+				break;
+			}
+
+			printf(" %d", blk);
+			blk = vms_nextblock(blk);
+		}
+	}
+
+	printf("\n");
+
+	return nblk;
+}
+
+static const char *
+vms_dirent_typename(const struct vmsfs_dirent *dp, char *buf, size_t bufsize)
+{
+	switch (dp->type) {
+	case DIR_TYPE_DATA:
+		return "DATA";
+	case DIR_TYPE_GAME:
+		return "GAME";
+	default:
+		snprintf(buf, bufsize, "0x%02x", dp->type);
+		return buf;
+	}
+}
+
+/* output the directory entry as a row */
+static int
+vms_dirent_output(struct vmsfs_dirent *dp)
+{
+	char buf[VMS_TEXTBUFSIZE];
+	int j, blk, nblk;
+
+	nblk = le16toh(dp->size);
+
+	out_row_begin(NULL);
+	out_strn("name", dp->name, strnlen(dp->name, DIR_NAMELEN), true);
+	out_str("type", vms_dirent_typename(dp, buf, sizeof(buf)));
+	out_int("attr", dp->attr);
+	out_bool("prohibit", dp->attr == DIR_ATTR_PROHIBIT);
+	out_str("timestamp", strisotimestamp(buf, sizeof(buf), &dp->timestamp));
+	out_int("block", le16toh(dp->block));
+	out_int("size", nblk);
+	out_int("header_block_offset", le16toh(dp->header_block_offset));
+	out_array_begin("fat");
+	for (blk = le16toh(dp->block), j = 0; blk >= 0 && j <= nblk; j++) {
+		out_int(NULL, blk);
+		blk = vms_nextblock(blk);
+	}
+	out_array_end();
+	out_row_end();
+
+	return nblk;
+}
+
+/* free the chain from blk, only in memory */
+static int
+vms_free_chain(int blk)
+{
+	int nextblk, n;
+
+	for (n = 0; blk >= 0 && n < vms_nblocks; blk = nextblk, n++) {
+		nextblk = vms_nextblock(blk);
+
+		if (blk >= vms_nblocks) {
+			errno = ENXIO;
+			fprintf(stderr, "illegal block number: %d\n", blk);
+			return -1;
+		}
+		vms_fatblk->block[blk] = htole16(BLOCK_UNALLOCATED);
+	}
+	return 0;
+}
+
+/* free the blocks and the entry of dp, only in memory */
+static int
+vmsfs_unlink_dirent(struct vmsfs_dirent *dp)
+{
+	/* free fat */
+	if (vms_free_chain(le16toh(dp->block)) != 0)
+		return -1;
+
+	/* erase the directory entry */
+	dp->type = DIR_TYPE_NONE;
+#if 0
+	dp->attr = 0;
+	dp->block = 0;
+	memset(dp->name, 0, sizeof(dp->name));
+	dp->size = 0;
+	dp->header_block_offset = 0;
+	memset(dp->reserved, 0, sizeof(dp->reserved));
+#endif
+
+	return 0;
+}
+
+static int
+vmsfs_unlink(const char *file)
+{
+	struct vmsfs_dirent *dp;
+
+	dp = vms_dirent_lookup(file);
+	if (dp == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (vmsfs_unlink_dirent(dp) != 0)
+		return -1;
+
+	vms_save_dir();
+	vms_save_fat();
+
+	return 0;
+}
+
+static char *
+vms_loadfile_dirent(struct vmsfs_dirent *dp, size_t *sizep)
+{
+	size_t size;
+	int rc, startblk, nblk;
+	char *buf0, *buf;
+
+	startblk = le16toh(dp->block);
+	nblk = le16toh(dp->size);
+	size = (size_t)nblk * VMS_BLOCKSIZE;
+	buf = buf0 = malloc(size);
+	if (buf == NULL)
+		return NULL;
+
+	VMS_STATS_BEGIN("load_file");
+	rc = vms_read_blocks(buf, startblk, nblk);
+	VMS_STATS_END();
+	if (rc != 0) {
+		free(buf);
+		return NULL;
+	}
+
+	if (sizep != NULL)
+		*sizep = size;
+
+	return buf0;
+}
+
+static char *
+vms_loadfile(const char *filename, size_t *sizep)
+{
+	struct vmsfs_dirent *dp;
+
+	dp = vms_dirent_lookup(filename);
+	if (dp == NULL)
+		return NULL;
+
+	return vms_loadfile_dirent(dp, sizep);
+}
+
+/* read nblk blocks from the blkoff-th block of the file */
+static int
+vms_read_fileblocks(struct vmsfs_dirent *dp, int blkoff, void *buf, int nblk)
+{
+	int blk, i;
+
+	if (blkoff + nblk > le16toh(dp->size)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (blk = le16toh(dp->block), i = 0; i < blkoff; i++) {
+		blk = vms_nextblock(blk);
+		if (blk < 0) {
+			errno = ENXIO;
+			return -1;
+		}
+	}
+
+	return vms_read_blocks(buf, blk, nblk);
+}
+
+/* read the block which has a vmsfile_header */
+static int
+vms_read_header(struct vmsfs_dirent *dp, void *buf)
+{
+	int blkoff;
+
+	blkoff = (dp->type == DIR_TYPE_GAME) ?
+	    le16toh(dp->header_block_offset) : 0;
+	return vms_read_fileblocks(dp, blkoff, buf, 1);
+}
+
+/*
+ * CRC of VMS file. CRC-16/XMODEM (poly 0x1021, init 0) over the header,
+ * icons, eyecatch and data, calculated as if the crc field is 0.
+ * 8 bytes are processed per iteration using the slice-by-8 tables.
+ */
+#define VMS_CRC_POLY	0x1021
+static uint16_t vms_crctab[8][256];
+
+static void
+vms_crc_init(void)
+{
+	int i, j;
+	uint16_t crc;
+
+	if (vms_crctab[0][1] != 0)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		crc = (uint16_t)(i << 8);
+		for (j = 0; j < 8; j++)
+			crc = (uint16_t)((crc & 0x8000) ?
+			    (crc << 1) ^ VMS_CRC_POLY : (crc << 1));
+		vms_crctab[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc = vms_crctab[j - 1][i];
+			vms_crctab[j][i] =
+			    (uint16_t)((crc << 8) ^ vms_crctab[0][crc >> 8]);
+		}
+	}
+}
+
+static uint16_t
+vms_crc16(uint16_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	vms_crc_init();
+
+	for (; len >= 8; p += 8, len -= 8) {
+		crc ^= (uint16_t)((p[0] << 8) | p[1]);
+		crc = vms_crctab[7][crc >> 8] ^ vms_crctab[6][crc & 0xff] ^
+		    vms_crctab[5][p[2]] ^ vms_crctab[4][p[3]] ^
+		    vms_crctab[3][p[4]] ^ vms_crctab[2][p[5]] ^
+		    vms_crctab[1][p[6]] ^ vms_crctab[0][p[7]];
+	}
+	for (; len > 0; p++, len--)
+		crc = (uint16_t)((crc << 8) ^ vms_crctab[0][(crc >> 8) ^ *p]);
+
+	return crc;
+}
+
+/* size of eyecatch image for vmsfile_header.type */
+static size_t
+vmsfile_eyecatch_size(int type)
+{
+	switch (type) {
+	case 0:
+		return 0;
+	case 1:		/* 72x56 ARGB4444 */
+		return 72 * 56 * 2;
+	case 2:		/* 256 colors palette + 72x56 8bpp */
+		return 256 * 2 + 72 * 56;
+	case 3:		/* 16 colors palette + 72x56 4bpp */
+		return 16 * 2 + 72 * 56 / 2;
+	default:
+		return (size_t)-1;
+	}
+}
+
+/*
+ * returns the length of header+icons+eyecatch+data, which is covered by CRC.
+ * returns 0 if the header is inconsistent with the size of file.
+ */
+static size_t
+vmsfile_length(const struct vmsfile_header *header, size_t size)
+{
+	size_t len, eyecatch;
+
+	eyecatch = vmsfile_eyecatch_size(le16toh(header->type));
+	if (eyecatch == (size_t)-1)
+		return 0;
+
+	len = sizeof(*header) +
+	    le16toh(header->icon_num) * sizeof(struct vmsfile_icon) +
+	    eyecatch + le32toh(header->datasize);
+	if (len > size || le32toh(header->datasize) > size)
+		return 0;
+	return len;
+}
+
+static uint16_t
+vmsfile_crc(const char *buf, size_t len)
+{
+	static const uint8_t zero[2];
+	const size_t crcoff = offsetof(struct vmsfile_header, crc);
+	uint16_t crc;
+
+	crc = vms_crc16(0, buf, crcoff);
+	crc = vms_crc16(crc, zero, sizeof(zero));
+	return vms_crc16(crc, buf + crcoff + 2, len - crcoff - 2);
+}
+
+/*
+ * verify the crc of DATA file on memory.
+ * returns 0 if ok, -1 with errno=EFTYPE if header is broken.
+ */
+static int
+vmsfile_verify(const char *buf, size_t size, uint16_t *crcp)
+{
+	const struct vmsfile_header *header;
+	size_t len;
+
+	header = (const struct vmsfile_header *)buf;
+	len = vmsfile_length(header, size);
+	if (len == 0) {
+		errno = EFTYPE;
+		return -1;
+	}
+
+	*crcp = vmsfile_crc(buf, len);
+	return 0;
+}
+
+/*
+ * fsck
+ *
+ * every chain (system area, and then each file) is walked only once,
+ * and the visited blocks are recorded in a bitmap. a block which is
+ * already recorded is a loop (if it is in the same chain) or a cross-link.
+ * any block which is allocated in FAT but not recorded is an orphan.
+ */
+struct vmsfs_fsck {
+	struct vms_blkmap inuse;
+	bool repair;
+	bool root_modified;
+	int nerror;
+	int nfixed;
+	int nfiles;
+	int nblocks;
+};
+
+static void __printflike(3, 4)
+vmsfs_fsck_error(struct vmsfs_fsck *fsck, bool fixable, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+	bool fixed;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	fixed = fixable && fsck->repair;
+	fsck->nerror++;
+	if (fixed)
+		fsck->nfixed++;
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_row_begin(NULL);
+		out_str("message", msg);
+		out_bool("fixed", fixed);
+		out_row_end();
+		return;
+	}
+	printf("%s%s\n", msg, fixed ? " (FIXED)" : "");
+}
+
+static void
+vmsfs_fsck_setlast(struct vmsfs_fsck *fsck, int blk)
+{
+	if (fsck->repair)
+		vms_fatblk->block[blk] = htole16(BLOCK_LAST);
+}
+
+/*
+ * walk the chain, and cut it before a block which is out of range, looped,
+ * or cross-linked. when dp is not NULL, the directory entry is also fixed.
+ * returns the number of valid blocks in the chain.
+ */
+static int
+vmsfs_fsck_chain(struct vmsfs_fsck *fsck, const char *name, int startblk,
+    int nblk, struct vmsfs_dirent *dp)
+{
+	struct vms_blkmap chain;
+	const char *why;
+	int blk, prev, next, n;
+
+	__BITMAP_ZERO(&chain);
+	for (n = 0, prev = -1, blk = startblk;; prev = blk, blk = next) {
+		if (blk >= vms_nblocks)
+			why = "out of range";
+		else if (__BITMAP_ISSET((unsigned int)blk, &chain))
+			why = "loop";
+		else if (__BITMAP_ISSET((unsigned int)blk, &fsck->inuse))
+			why = "cross-linked";
+		else
+			why = NULL;
+
+		if (why != NULL) {
+			if (prev < 0) {
+				if (dp != NULL && fsck->repair)
+					dp->type = DIR_TYPE_NONE;
+				vmsfs_fsck_error(fsck, dp != NULL,
+				    "%s: first block %d: %s%s", name, blk, why,
+				    (dp != NULL) ? ", clear entry" : "");
+			} else {
+				vmsfs_fsck_setlast(fsck, prev);
+				vmsfs_fsck_error(fsck, true,
+				    "%s: block %d -> %d: %s", name, prev, blk, why);
+			}
+			break;
+		}
+
+		__BITMAP_SET((unsigned int)blk, &chain);
+		__BITMAP_SET((unsigned int)blk, &fsck->inuse);
+		n++;
+
+		next = le16toh(vms_fatblk->block[blk]);
+		if (next == BLOCK_LAST)
+			break;
+		if (next == BLOCK_UNALLOCATED) {
+			vmsfs_fsck_setlast(fsck, blk);
+			vmsfs_fsck_error(fsck, true,
+			    "%s: block %d: unallocated in the chain", name, blk);
+			break;
+		}
+		if (n == nblk && fsck->repair) {
+			vmsfs_fsck_setlast(fsck, blk);
+			vmsfs_fsck_error(fsck, true,
+			    "%s: chain is longer than %d blocks", name, nblk);
+			break;
+		}
+	}
+
+	if (n != nblk && n != 0) {
+		if (dp != NULL && fsck->repair)
+			dp->size = htole16((uint16_t)n);
+		vmsfs_fsck_error(fsck, dp != NULL,
+		    "%s: size is %d blocks, but chain has %d blocks",
+		    name, nblk, n);
+	}
+
+	return n;
+}
+
+/* check the system area, and the chains of root, FAT and directory */
+static int
+vmsfs_fsck_root(struct vmsfs_fsck *fsck)
+{
+	int i, fat_blkno, fat_blksize, dir_blkno, dir_blksize, user_blocks, n;
+	int sys_lowblk;
+
+	for (i = 0; i < (int)sizeof(vms_rootblk->magic); i++) {
+		if (vms_rootblk->magic[i] != 0x55)
+			break;
+	}
+	if (i != (int)sizeof(vms_rootblk->magic)) {
+		if (fsck->repair) {
+			memset(vms_rootblk->magic, 0x55, sizeof(vms_rootblk->magic));
+			fsck->root_modified = true;
+		}
+		vmsfs_fsck_error(fsck, true, "ROOT: bad magic");
+	}
+
+	fat_blkno = le16toh(vms_rootblk->fat_blockno);
+	fat_blksize = le16toh(vms_rootblk->fat_nblocksize);
+	dir_blkno = le16toh(vms_rootblk->directory_blockno);
+	dir_blksize = le16toh(vms_rootblk->directory_blocksize);
+	user_blocks = le16toh(vms_rootblk->user_blocks);
+
+	if (fat_blkno >= VMS_ROOTBLOCKNO || fat_blksize < 1 ||
+	    fat_blksize > VMS_MAXFATBLOCKS || fat_blksize > fat_blkno + 1) {
+		vmsfs_fsck_error(fsck, false,
+		    "ROOT: bad FAT layout: block %d, %d blocks",
+		    fat_blkno, fat_blksize);
+		return -1;
+	}
+	if (dir_blkno >= VMS_ROOTBLOCKNO || dir_blksize <= 0 ||
+	    dir_blksize > dir_blkno + 1 ||
+	    (fat_blkno - fat_blksize < dir_blkno &&
+	    dir_blkno - dir_blksize < fat_blkno)) {
+		vmsfs_fsck_error(fsck, false,
+		    "ROOT: bad directory layout: block %d, %d blocks",
+		    dir_blkno, dir_blksize);
+		return -1;
+	}
+	/* the user area of a larger card may be above the system area */
+	sys_lowblk = dir_blkno - dir_blksize + 1;
+	if (fat_blkno - fat_blksize + 1 < sys_lowblk)
+		sys_lowblk = fat_blkno - fat_blksize + 1;
+	if (vms_nblocks == VMS_NUM_BLOCKS && user_blocks > sys_lowblk) {
+		vmsfs_fsck_error(fsck, false,
+		    "ROOT: user_blocks %d overlaps with system area", user_blocks);
+	}
+
+	vmsfs_fsck_chain(fsck, "ROOT", VMS_ROOTBLOCKNO, 1, NULL);
+	vmsfs_fsck_chain(fsck, "FAT", fat_blkno, fat_blksize, NULL);
+	n = vmsfs_fsck_chain(fsck, "DIR", dir_blkno, dir_blksize, NULL);
+	if (n != dir_blksize && fsck->repair) {
+		/* directory is always contiguous and descending */
+		for (i = 0; i < dir_blksize; i++) {
+			vms_fatblk->block[dir_blkno - i] = htole16((i == dir_blksize - 1) ?
+			    BLOCK_LAST : (uint16_t)(dir_blkno - i - 1));
+			__BITMAP_SET((unsigned int)(dir_blkno - i), &fsck->inuse);
+		}
+	}
+
+	return 0;
+}
+
+static void
+vmsfs_fsck_orphan(struct vmsfs_fsck *fsck)
+{
+	struct vms_blkmap orphan, linked;
+	int blk, next, n, norphan;
+
+	/* blocks that are allocated in FAT, but not in any chain */
+	__BITMAP_ZERO(&orphan);
+	__BITMAP_ZERO(&linked);
+	for (norphan = 0, blk = 0; blk < vms_nblocks; blk++) {
+		next = le16toh(vms_fatblk->block[blk]);
+		if (next == BLOCK_UNALLOCATED ||
+		    __BITMAP_ISSET((unsigned int)blk, &fsck->inuse))
+			continue;
+		__BITMAP_SET((unsigned int)blk, &orphan);
+		if (next < vms_nblocks)
+			__BITMAP_SET((unsigned int)next, &linked);
+		norphan++;
+	}
+	if (norphan == 0)
+		return;
+
+	/* report each orphaned chain by its head */
+	for (blk = 0; blk < vms_nblocks; blk++) {
+		if (!__BITMAP_ISSET((unsigned int)blk, &orphan) ||
+		    __BITMAP_ISSET((unsigned int)blk, &linked))
+			continue;
+		for (n = 0, next = blk; next < vms_nblocks &&
+		    __BITMAP_ISSET((unsigned int)next, &orphan) && n < norphan; n++)
+			next = le16toh(vms_fatblk->block[next]);
+		vmsfs_fsck_error(fsck, true,
+		    "orphaned chain at block %d (%d block%s)", blk, n,
+		    (n <= 1) ? "" : "s");
+	}
+	for (blk = 0; blk < vms_nblocks; blk++) {
+		if (!__BITMAP_ISSET((unsigned int)blk, &orphan))
+			continue;
+		if (fsck->repair)
+			vms_fatblk->block[blk] = htole16(BLOCK_UNALLOCATED);
+	}
+}
+
+static int
+vmsfs_fsck(struct vmsfs_fsck *fsck)
+{
+	struct vmsfs_dirent *dp, *dp2;
+	char name[DIR_NAMELEN + 1];
+	int rc, i, j, ndirent;
+
+	rc = vms_load_fat();
+	if (rc != 0) {
+		vmsfs_fsck_error(fsck, false, "FAT: cannot read FAT: %s",
+		    strerror(errno));
+		return -1;
+	}
+	if (vmsfs_fsck_root(fsck) != 0)
+		return -1;
+
+	rc = vms_load_dir();
+	if (rc != 0) {
+		vmsfs_fsck_error(fsck, false, "DIR: cannot read directory: %s",
+		    strerror(errno));
+		return -1;
+	}
+
+	ndirent = VMSFS_DIR_NENTRIES_PER_BLOCK *
+	    le16toh(vms_rootblk->directory_blocksize);
+	for (i = 0; i < ndirent; i++) {
+		dp = &vms_dirblk->entries[i];
+		if (dp->type == DIR_TYPE_NONE)
+			continue;
+
+		memcpy(name, dp->name, DIR_NAMELEN);
+		name[DIR_NAMELEN] = '\0';
+
+		if (dp->type != DIR_TYPE_DATA && dp->type != DIR_TYPE_GAME) {
+			vmsfs_fsck_error(fsck, true,
+			    "%s: bad file type 0x%02x, clear entry", name, dp->type);
+			if (fsck->repair)
+				dp->type = DIR_TYPE_NONE;
+			continue;
+		}
+
+		for (j = 0; j < i; j++) {
+			dp2 = &vms_dirblk->entries[j];
+			if (dp2->type != DIR_TYPE_NONE &&
+			    memcmp(dp->name, dp2->name, DIR_NAMELEN) == 0) {
+				vmsfs_fsck_error(fsck, false,
+				    "%s: duplicate file name", name);
+				break;
+			}
+		}
+
+		/* the header offset is used only by GAME files */
+		if (dp->type == DIR_TYPE_GAME &&
+		    le16toh(dp->header_block_offset) >= le16toh(dp->size)) {
+			vmsfs_fsck_error(fsck, false,
+			    "%s: header_block_offset %d is out of file", name,
+			    le16toh(dp->header_block_offset));
+		}
+
+		vmsfs_fsck_chain(fsck, name, le16toh(dp->block),
+		    le16toh(dp->size), dp);
+		if (dp->type != DIR_TYPE_NONE) {
+			fsck->nfiles++;
+			fsck->nblocks += le16toh(dp->size);
+		}
+	}
+
+	vmsfs_fsck_orphan(fsck);
+
+	if (fsck->repair && fsck->nfixed != 0) {
+		if (fsck->root_modified && vms_save_root() != 0)
+			return -1;
+		if (vms_save_fat() != 0 || vms_save_dir() != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * icon and eyecatch images
+ *
+ * pixels are converted to RGBA8888. 4bpp pixels are expanded 2 pixels
+ * (1 byte) at a time, using a table of 256 pixel pairs made from the palette.
+ */
+#define VMS_ICON_WIDTH		32
+#define VMS_ICON_HEIGHT		32
+#define VMS_EYECATCH_WIDTH	72
+#define VMS_EYECATCH_HEIGHT	56
+
+struct rgba_image {
+	int width;
+	int height;		/* height of a frame */
+	int nframes;		/* frames are stored vertically */
+	uint8_t *pixels;
+};
+
+static void
+argb4444_to_rgba(uint16_t argb, uint8_t rgba[4])
+{
+	rgba[0] = (uint8_t)(((argb >> 8) & 0x0f) * 0x11);
+	rgba[1] = (uint8_t)(((argb >> 4) & 0x0f) * 0x11);
+	rgba[2] = (uint8_t)((argb & 0x0f) * 0x11);
+	rgba[3] = (uint8_t)(((argb >> 12) & 0x0f) * 0x11);
+}
+
+static void
+vms_palette_pairtab(const uint16_t *palette, uint8_t pairtab[256][8])
+{
+	uint8_t rgba[16][4];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		argb4444_to_rgba(le16toh(palette[i]), rgba[i]);
+	for (i = 0; i < 256; i++) {
+		memcpy(&pairtab[i][0], rgba[i >> 4], 4);
+		memcpy(&pairtab[i][4], rgba[i & 15], 4);
+	}
+}
+
+static void
+vms_expand_4bpp(uint8_t *dst, const uint8_t *src, size_t npixels,
+    const uint8_t pairtab[256][8])
+{
+	size_t i;
+
+	for (i = 0; i < npixels / 2; i++, dst += 8)
+		memcpy(dst, pairtab[src[i]], 8);
+}
+
+static int
+rgba_image_alloc(struct rgba_image *img, int width, int height, int nframes)
+{
+	img->width = width;
+	img->height = height;
+	img->nframes = nframes;
+	img->pixels = calloc((size_t)width * (size_t)height * (size_t)nframes, 4);
+	if (img->pixels == NULL)
+		return -1;
+	return 0;
+}
+
+/*
+ * decode icons. when strip is true, frames are placed side by side in
+ * one frame, otherwise each icon is a frame.
+ */
+static int
+vmsfile_icon_decode(const struct vmsfile_header *header, struct rgba_image *img,
+    bool strip)
+{
+	uint8_t pairtab[256][8];
+	uint8_t row[VMS_ICON_WIDTH * 4];
+	const uint8_t *src;
+	uint8_t *dst;
+	int i, y, nicon;
+
+	nicon = le16toh(header->icon_num);
+	if (strip) {
+		if (rgba_image_alloc(img, VMS_ICON_WIDTH * nicon,
+		    VMS_ICON_HEIGHT, 1) != 0)
+			return -1;
+	} else {
+		if (rgba_image_alloc(img, VMS_ICON_WIDTH,
+		    VMS_ICON_HEIGHT, nicon) != 0)
+			return -1;
+	}
+
+	vms_palette_pairtab(header->palette, pairtab);
+	for (i = 0; i < nicon; i++) {
+		src = header->icondata[i].data;
+		for (y = 0; y < VMS_ICON_HEIGHT; y++) {
+			if (strip) {
+				dst = img->pixels + ((size_t)y * (size_t)img->width +
+				    (size_t)i * VMS_ICON_WIDTH) * 4;
+			} else {
+				dst = img->pixels + ((size_t)i * VMS_ICON_HEIGHT +
+				    (size_t)y) * VMS_ICON_WIDTH * 4;
+			}
+			vms_expand_4bpp(row, src, VMS_ICON_WIDTH, pairtab);
+			memcpy(dst, row, sizeof(row));
+			src += VMS_ICON_WIDTH / 2;
+		}
+	}
+	return 0;
+}
+
+static int
+vmsfile_eyecatch_decode(const struct vmsfile_header *header,
+    struct rgba_image *img)
+{
+	uint8_t pairtab[256][8];
+	uint8_t palette[256][4];
+	const uint8_t *src;
+	uint8_t *dst;
+	size_t i, npixels;
+	int type;
+
+	type = le16toh(header->type);
+	if (type == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (rgba_image_alloc(img, VMS_EYECATCH_WIDTH, VMS_EYECATCH_HEIGHT, 1) != 0)
+		return -1;
+
+	src = (const uint8_t *)&header->icondata[le16toh(header->icon_num)];
+	dst = img->pixels;
+	npixels = VMS_EYECATCH_WIDTH * VMS_EYECATCH_HEIGHT;
+	switch (type) {
+	case 1:
+		for (i = 0; i < npixels; i++, src += 2, dst += 4)
+			argb4444_to_rgba((uint16_t)(src[0] | (src[1] << 8)), dst);
+		break;
+	case 2:
+		for (i = 0; i < 256; i++, src += 2)
+			argb4444_to_rgba((uint16_t)(src[0] | (src[1] << 8)), palette[i]);
+		for (i = 0; i < npixels; i++, dst += 4)
+			memcpy(dst, palette[src[i]], 4);
+		break;
+	case 3:
+		vms_palette_pairtab((const uint16_t *)src, pairtab);
+		vms_expand_4bpp(dst, src + 16 * 2, npixels, pairtab);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * read the header, icons and eyecatch of the file.
+ * returns a malloc'ed buffer.
+ */
+static struct vmsfile_header *
+vms_load_header(struct vmsfs_dirent *dp)
+{
+	struct vmsfile_header *header;
+	uint32_t hdrbuf[VMS_BLOCKSIZE / sizeof(uint32_t)];
+	size_t len, eyecatch;
+	int blkoff, nblk;
+	char *buf;
+
+	if (vms_read_header(dp, hdrbuf) != 0)
+		return NULL;
+
+	header = (struct vmsfile_header *)hdrbuf;
+	eyecatch = vmsfile_eyecatch_size(le16toh(header->type));
+	if (eyecatch == (size_t)-1) {
+		errno = EFTYPE;
+		return NULL;
+	}
+	len = sizeof(*header) +
+	    le16toh(header->icon_num) * sizeof(struct vmsfile_icon) + eyecatch;
+	nblk = (int)((len + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE);
+	blkoff = (dp->type == DIR_TYPE_GAME) ?
+	    le16toh(dp->header_block_offset) : 0;
+	if (blkoff + nblk > le16toh(dp->size)) {
+		errno = EFTYPE;
+		return NULL;
+	}
+
+	buf = malloc((size_t)nblk * VMS_BLOCKSIZE);
+	if (buf == NULL)
+		return NULL;
+	memcpy(buf, hdrbuf, VMS_BLOCKSIZE);
+	if (nblk > 1 &&
+	    vms_read_fileblocks(dp, blkoff + 1, buf + VMS_BLOCKSIZE, nblk - 1) != 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return (struct vmsfile_header *)buf;
+}
+
+static int
+ppm_write(FILE *fh, const struct rgba_image *img)
+{
+	const uint8_t *p;
+	size_t i, npixels;
+
+	npixels = (size_t)img->width * (size_t)img->height;
+	fprintf(fh, "P6\n%d %d\n255\n", img->width, img->height);
+	for (p = img->pixels, i = 0; i < npixels; i++, p += 4) {
+		if (fwrite(p, 3, 1, fh) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+png_write_chunk(FILE *fh, const char *type, const void *data, size_t len)
+{
+	uint8_t buf[8];
+	uLong crc;
+
+	be32enc(&buf[0], (uint32_t)len);
+	memcpy(&buf[4], type, 4);
+	crc = crc32(0, &buf[4], 4);
+	if (len != 0)
+		crc = crc32(crc, data, (uInt)len);
+
+	if (fwrite(buf, 8, 1, fh) != 1)
+		return -1;
+	if (len != 0 && fwrite(data, len, 1, fh) != 1)
+		return -1;
+	be32enc(&buf[0], (uint32_t)crc);
+	if (fwrite(buf, 4, 1, fh) != 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * write RGBA image as PNG. if the image has two or more frames, it is
+ * written as APNG, and each frame is shown for delay_num/delay_den seconds.
+ */
+static int
+png_write(FILE *fh, const struct rgba_image *img, int delay_num, int delay_den)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	uint8_t hdr[26], *raw, *zbuf;
+	size_t rowlen, rawlen;
+	uLongf zlen;
+	uint32_t seq;
+	int frame, y, rc;
+
+	rowlen = (size_t)img->width * 4;
+	rawlen = (rowlen + 1) * (size_t)img->height;
+	raw = malloc(rawlen);
+	zbuf = malloc(4 + compressBound((uLong)rawlen));
+	if (raw == NULL || zbuf == NULL) {
+		free(raw);
+		free(zbuf);
+		return -1;
+	}
+
+	rc = -1;
+	if (fwrite(signature, sizeof(signature), 1, fh) != 1)
+		goto done;
+
+	be32enc(&hdr[0], (uint32_t)img->width);
+	be32enc(&hdr[4], (uint32_t)img->height);
+	hdr[8] = 8;	/* bit depth */
+	hdr[9] = 6;	/* color type: RGBA */
+	hdr[10] = hdr[11] = hdr[12] = 0;
+	if (png_write_chunk(fh, "IHDR", hdr, 13) != 0)
+		goto done;
+
+	if (img->nframes > 1) {
+		be32enc(&hdr[0], (uint32_t)img->nframes);
+		be32enc(&hdr[4], 0);	/* loop forever */
+		if (png_write_chunk(fh, "acTL", hdr, 8) != 0)
+			goto done;
+	}
+
+	for (seq = 0, frame = 0; frame < img->nframes; frame++) {
+		if (img->nframes > 1) {
+			be32enc(&hdr[0], seq++);
+			be32enc(&hdr[4], (uint32_t)img->width);
+			be32enc(&hdr[8], (uint32_t)img->height);
+			be32enc(&hdr[12], 0);	/* x offset */
+			be32enc(&hdr[16], 0);	/* y offset */
+			hdr[20] = (uint8_t)(delay_num >> 8);
+			hdr[21] = (uint8_t)delay_num;
+			hdr[22] = (uint8_t)(delay_den >> 8);
+			hdr[23] = (uint8_t)delay_den;
+			hdr[24] = 0;		/* dispose: none */
+			hdr[25] = 0;		/* blend: source */
+			if (png_write_chunk(fh, "fcTL", hdr, 26) != 0)
+				goto done;
+		}
+
+		for (y = 0; y < img->height; y++) {
+			raw[(rowlen + 1) * (size_t)y] = 0;	/* filter: none */
+			memcpy(&raw[(rowlen + 1) * (size_t)y + 1],
+			    img->pixels + rowlen * ((size_t)frame *
+			    (size_t)img->height + (size_t)y), rowlen);
+		}
+		zlen = compressBound((uLong)rawlen);
+		if (compress2(zbuf + 4, &zlen, raw, (uLong)rawlen,
+		    Z_BEST_COMPRESSION) != Z_OK) {
+			errno = ENOMEM;
+			goto done;
+		}
+
+		if (frame == 0) {
+			if (png_write_chunk(fh, "IDAT", zbuf + 4, zlen) != 0)
+				goto done;
+		} else {
+			be32enc(zbuf, seq++);
+			if (png_write_chunk(fh, "fdAT", zbuf, zlen + 4) != 0)
+				goto done;
+		}
+	}
+
+	rc = png_write_chunk(fh, "IEND", NULL, 0);
+ done:
+	free(raw);
+	free(zbuf);
+	return rc;
+}
+
+static void
+vms_root_output(void)
+{
+	char buf[VMS_TEXTBUFSIZE];
+	int i;
+
+	for (i = 0; i < (int)sizeof(vms_rootblk->magic); i++) {
+		if (vms_rootblk->magic[i] != 0x55)
+			break;
+	}
+	out_bool("formatted", i == (int)sizeof(vms_rootblk->magic));
+	out_int("color", vms_rootblk->color);
+	out_int("color_blue", vms_rootblk->color_blue);
+	out_int("color_green", vms_rootblk->color_green);
+	out_int("color_red", vms_rootblk->color_red);
+	out_int("color_alpha", vms_rootblk->color_alpha);
+	out_str("timestamp",
+	    strisotimestamp(buf, sizeof(buf), &vms_rootblk->timestamp));
+	out_int("fat_blockno", le16toh(vms_rootblk->fat_blockno));
+	out_int("fat_nblocksize", le16toh(vms_rootblk->fat_nblocksize));
+	out_int("directory_blockno", le16toh(vms_rootblk->directory_blockno));
+	out_int("directory_blocksize", le16toh(vms_rootblk->directory_blocksize));
+	out_int("icon_block", le16toh(vms_rootblk->icon_block));
+	out_int("user_blocks", le16toh(vms_rootblk->user_blocks));
+}
+
+static int
+dcvmtool_cmd_dump(int argc, char *argv[])
+{
+	char buf[VMS_TEXTBUFSIZE];
+	int rc, ch, opt_x;
+
+	opt_x = 0;
+	while ((ch = getopt(argc, argv, "x")) != -1) {
+		switch (ch) {
+		case 'x':
+			opt_x++;
+			break;
+		default:
+			fprintf(stderr, "usage: dcvmtools dump [options]\n");
+			return EX_USAGE;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	rc = vms_load_dir();
+	if (rc != 0)
+		return EX_DATAERR;
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_row_begin("root");
+		vms_root_output();
+		out_row_end();
+		out_record_end();
+		return 0;
+	}
+
+	if (opt_x)
+		xdump((const char *)vms_rootblk, VMS_BLOCKSIZE);
+
+	printf("color               = %d(%s), #%02X%02X%02X * %.1f%%\n",
+	    vms_rootblk->color,
+	    (vms_rootblk->color == 0) ? "Standard" : "Custom",
+	    vms_rootblk->color_blue,
+	    vms_rootblk->color_green,
+	    vms_rootblk->color_red,
+	    100.0 * vms_rootblk->color_alpha / 255);
+
+	printf("timestamp           = %s\n",
+	    strbcdtimestamp(buf, sizeof(buf), &vms_rootblk->timestamp));
+
+	printf("fat_blockno         = %d\n", le16toh(vms_rootblk->fat_blockno));
+	printf("fat_nblocksize      = %d\n", le16toh(vms_rootblk->fat_nblocksize));
+	printf("directory_blockno   = %d\n", le16toh(vms_rootblk->directory_blockno));
+	printf("directory_blocksize = %d\n", le16toh(vms_rootblk->directory_blocksize));
+	printf("icon_block          = %d\n", le16toh(vms_rootblk->icon_block));
+	printf("user_blocks         = %d\n", le16toh(vms_rootblk->user_blocks));
+
+	return 0;
+}
+
+static int
+dcvmtool_cmd_hexdump_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools hexdump [-a root|fat|dir|sys] [-b block[-block]] [file ...]\n");
+	fprintf(stderr, "\t-a area	blocks of the area (sys is root, FAT and directory)\n");
+	fprintf(stderr, "\t-b range	blocks of the range\n");
+	fprintf(stderr, "\tfile	blocks of the chain of the file\n");
+	fprintf(stderr, "\twithout any, all the blocks of the card\n");
+	return EX_USAGE;
+}
+
+/* dump the blocks, each of which is annotated as "# block N (label)" */
+static int
+vms_hexdump_blocks(const int *blocks, int nblk, const char *name, bool fileoff)
+{
+	char buf[VMS_BLOCKSIZE], label[64];
+	ssize_t len;
+	int i, blk;
+
+	for (i = 0; i < nblk; i++) {
+		blk = blocks[i];
+		len = pread(vms_fd, buf, VMS_BLOCKSIZE,
+		    vms_bankoff + (off_t)blk * VMS_BLOCKSIZE);
+		if (__predict_false(vms_stats))
+			vms_stats_io(blk, false, len);
+		if (len != VMS_BLOCKSIZE) {
+			vms_hexflush();
+			if (len >= 0)
+				errno = EIO;
+			return -1;
+		}
+
+		if (name != NULL)
+			snprintf(label, sizeof(label), "# block %d (%.12s %d/%d)\n",
+			    blk, name, i + 1, nblk);
+		else
+			snprintf(label, sizeof(label), "# block %d (%s)\n",
+			    blk, vms_areaname[vms_blkarea(blk)]);
+		vms_hexputs(label);
+		vms_hexdump(buf, VMS_BLOCKSIZE, fileoff ?
+		    (uint64_t)i * VMS_BLOCKSIZE : (uint64_t)blk * VMS_BLOCKSIZE);
+	}
+	vms_hexflush();
+	return 0;
+}
+
+static int
+dcvmtool_cmd_hexdump(int argc, char *argv[])
+{
+	struct vmsfs_dirent *dp;
+	const char *area;
+	char *ep;
+	int *blocks, i, ch, nblk, blk, start, end, rc, anyerror;
+
+	area = NULL;
+	start = end = -1;
+	while ((ch = getopt(argc, argv, "a:b:")) != -1) {
+		switch (ch) {
+		case 'a':
+			area = optarg;
+			break;
+		case 'b':
+			start = (int)strtol(optarg, &ep, 10);
+			end = start;
+			if (*ep == '-')
+				end = (int)strtol(ep + 1, &ep, 10);
+			if (*ep != '\0' || start < 0 || end < start)
+				return dcvmtool_cmd_hexdump_usage();
+			break;
+		default:
+			return dcvmtool_cmd_hexdump_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* the geometry, if the FAT can be read. a broken card can be dumped */
+	rc = vms_load_fat();
+	if ((area != NULL || argc > 0) && rc != 0)
+		err(EX_DATAERR, "%s", vms_filename);
+
+	blocks = malloc((size_t)vms_nblocks * 2 * sizeof(*blocks));
+	if (blocks == NULL)
+		err(EX_OSERR, "malloc");
+	fflush(stdout);
+
+	nblk = 0;
+	if (area != NULL) {
+		if (strcmp(area, "root") == 0 || strcmp(area, "sys") == 0)
+			blocks[nblk++] = VMS_ROOTBLOCKNO;
+		if (strcmp(area, "fat") == 0 || strcmp(area, "sys") == 0) {
+			blk = le16toh(vms_rootblk->fat_blockno);
+			for (i = 0; i < le16toh(vms_rootblk->fat_nblocksize); i++)
+				blocks[nblk++] = blk - i;
+		}
+		if (strcmp(area, "dir") == 0 || strcmp(area, "sys") == 0) {
+			for (blk = le16toh(vms_rootblk->directory_blockno);
+			    blk >= 0 && nblk < vms_nblocks; blk = vms_nextblock(blk))
+				blocks[nblk++] = blk;
+		}
+		if (nblk == 0) {
+			free(blocks);
+			return dcvmtool_cmd_hexdump_usage();
+		}
+	}
+	if (start >= 0) {
+		if (end >= vms_nblocks) {
+			free(blocks);
+			errx(EX_USAGE, "block %d is out of range (%d blocks)",
+			    end, vms_nblocks);
+		}
+		for (blk = start; blk <= end; blk++)
+			blocks[nblk++] = blk;
+	}
+	if (nblk == 0 && argc == 0) {
+		for (blk = 0; blk < vms_nblocks; blk++)
+			blocks[nblk++] = blk;
+	}
+
+	anyerror = 0;
+	if (nblk > 0 && vms_hexdump_blocks(blocks, nblk, NULL, false) != 0) {
+		warn("%s", vms_filename);
+		anyerror = 1;
+	}
+
+	/* a file, along the chain */
+	for (i = 0; i < argc; i++) {
+		dp = vms_dirent_lookup(argv[i]);
+		if (dp == NULL) {
+			warn("%s", argv[i]);
+			anyerror = 1;
+			continue;
+		}
+		for (nblk = 0, blk = le16toh(dp->block);
+		    blk >= 0 && nblk < le16toh(dp->size) && nblk < vms_nblocks;
+		    blk = vms_nextblock(blk))
+			blocks[nblk++] = blk;
+		if (vms_hexdump_blocks(blocks, nblk, dp->name, true) != 0) {
+			warn("%s", argv[i]);
+			anyerror = 1;
+		}
+	}
+
+	free(blocks);
+	return anyerror ? EX_DATAERR : 0;
+}
+
+static int
+dcvmtool_cmd_fat(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	int rc;
+	uint16_t fatno;
+	__BITMAP_TYPE(, uint32_t, VMS_MAXNUM_BLOCKS) startfat;
+
+	rc = vms_load_fat();
+	if (rc != 0)
+		return EX_DATAERR;
+
+	__BITMAP_ZERO(&startfat);
+
+	__BITMAP_SET(le16toh(vms_rootblk->fat_blockno), &startfat);
+	__BITMAP_SET(le16toh(vms_rootblk->directory_blockno), &startfat);
+	__BITMAP_SET(VMS_ROOTBLOCKNO, &startfat);
+
+	if ((dirp = vmsfs_opendir()) != NULL) {
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			fatno = le16toh(dp->block);
+			if (fatno < vms_nblocks)
+				__BITMAP_SET(fatno, &startfat);
+		}
+		vmsfs_closedir(dirp);
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_int("root_block", VMS_ROOTBLOCKNO);
+		out_int("fat_block", le16toh(vms_rootblk->fat_blockno));
+		out_int("directory_block", le16toh(vms_rootblk->directory_blockno));
+		out_array_begin("blocks");
+		for (int i = 0; i < vms_nblocks; i++) {
+			fatno = le16toh(vms_fatblk->block[i]);
+			out_row_begin(NULL);
+			out_int("block", i);
+			out_int("value", fatno);
+			out_str("state", (fatno == BLOCK_UNALLOCATED) ? "free" :
+			    (fatno == BLOCK_LAST) ? "end" : "next");
+			out_bool("start", __BITMAP_ISSET((unsigned int)i, &startfat));
+			out_row_end();
+		}
+		out_array_end();
+		out_record_end();
+		return 0;
+	}
+
+	printf("SYS block: %d\n", VMS_ROOTBLOCKNO);
+	printf("FAT block: %d\n", le16toh(vms_rootblk->fat_blockno));
+	printf("DIR block: %d...\n", le16toh(vms_rootblk->directory_blockno));
+	printf("#\n");
+	printf("# '*' = beginning of chain\n");
+	printf("#\n");
+	printf(" FAT|   +0   +1   +2   +3   +4   +5   +6   +7   +8   +9\n");
+	printf("----+--------------------------------------------------\n");
+	for (int i = 0; i < vms_nblocks; i++) {
+		char mark = __BITMAP_ISSET((unsigned int)i, &startfat) ? '*' : ' ';
+
+		if ((i % 10) == 0)
+			printf("+%03d|", i);
+
+		fatno = le16toh(vms_fatblk->block[i]);
+		switch (fatno) {
+		case BLOCK_UNALLOCATED:
+			printf(" %c   ", mark);
+			break;
+		case BLOCK_LAST:
+			printf(" %cEND", mark);
+			break;
+		default:
+			printf(" %c%03d", mark, fatno);
+			break;
+		}
+
+		if ((i % 10) == 9)
+			printf("\n");
+	}
+	printf("\n");
+	printf("----+--------------------------------------------------\n");
+	printf("    |   +0   +1   +2   +3   +4   +5   +6   +7   +8   +9\n");
+
+	return 0;
+}
+
+static int
+dcvmtool_cmd_dir(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	struct vms_timerange range;
+	int ch, nfiles, total_blksize, user_freeblks, opt_v, other_blksize;
+
+	memset(&range, 0, sizeof(range));
+	opt_v = 0;
+	while ((ch = getopt(argc, argv, "a:b:v")) != -1) {
+		switch (ch) {
+		case 'a':
+		case 'b':
+			if (vms_timerange_getopt(&range, ch, optarg) != 0)
+				return EX_USAGE;
+			break;
+		case 'v':
+			opt_v++;
+			break;
+		default:
+			fprintf(stderr, "usage: dcvmtools dir [-v] [-a since] [-b until]\n");
+			return EX_USAGE;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	dirp = vmsfs_opendir();
+	if (dirp == NULL)
+		return EX_DATAERR;;
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_object_begin("root");
+		vms_root_output();
+		out_object_end();
+		out_array_begin("files");
+	}
+
+	nfiles = total_blksize = other_blksize = 0;
+	while ((dp = vmsfs_readdir(dirp)) != NULL) {
+		if (!vms_timerange_match(&range, &dp->timestamp)) {
+			other_blksize += le16toh(dp->size);
+			continue;
+		}
+		if (vms_output != VMS_OUTPUT_TEXT)
+			total_blksize += vms_dirent_output(dp);
+		else
+			total_blksize += vms_dirent_print(dp, opt_v);
+		nfiles++;
+	}
+	vmsfs_closedir(dirp);
+
+
+	user_freeblks = le16toh(vms_rootblk->user_blocks) - total_blksize -
+	    other_blksize;
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_array_end();
+		out_int("nfiles", nfiles);
+		out_int("used_blocks", total_blksize);
+		out_int("user_blocks", le16toh(vms_rootblk->user_blocks));
+		out_int("user_free_blocks", user_freeblks);
+		out_int("system_free_blocks", vms_getfreeblock() - user_freeblks);
+		out_record_end();
+		return 0;
+	}
+	printf("                       %3d file%s %3d/%3d user blocks used\n",
+	    nfiles, (nfiles <= 1) ? ", " : "s,",
+	    total_blksize, le16toh(vms_rootblk->user_blocks));
+	printf("                  %3d user blocks + %3d system blocks free\n",
+	    user_freeblks,
+	    vms_getfreeblock() - user_freeblks);
+
+	return 0;
+}
+
+static int
+dcvmtool_cmd_cat(int argc, char *argv[])
+{
+	size_t size;
+	int i, anyerror;
+	char *buf;
+
+	anyerror = 0;
+	for (i = 0; i < argc; i++) {
+		buf = vms_loadfile(argv[i], &size);
+		if (buf == NULL) {
+			warn("%s", argv[i]);
+			anyerror = 1;
+			continue;
+		}
+		fwrite(buf, size, 1, stdout);
+		free(buf);
+	}
+
+	return anyerror;
+}
+
+static int
+dcvmtool_cmd_show_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools show [-v] -a | file\n");
+	fprintf(stderr, "\t-a	show all files\n");
+	fprintf(stderr, "\t-v	read whole file, and verify CRC\n");
+	return EX_USAGE;
+}
+
+/*
+ * show the header of the file. only the block which has the header is read,
+ * unless verbose is specified to verify CRC.
+ */
+static int
+vmsfs_show_dirent(struct vmsfs_dirent *dp, int verbose)
+{
+	struct vmsfile_header *header;
+	uint32_t hdrbuf[VMS_BLOCKSIZE / sizeof(uint32_t)];
+	size_t size;
+	uint16_t crc;
+	char strbuf[VMS_TEXTBUFSIZE], *buf;
+	int nblk;
+
+	nblk = le16toh(dp->size);
+	size = (size_t)nblk * VMS_BLOCKSIZE;
+	buf = NULL;
+	if (verbose) {
+		buf = vms_loadfile_dirent(dp, &size);
+		if (buf == NULL) {
+			warn("%.12s", dp->name);
+			return -1;
+		}
+		header = (struct vmsfile_header *)(buf + ((dp->type == DIR_TYPE_GAME) ?
+		    le16toh(dp->header_block_offset) * VMS_BLOCKSIZE : 0));
+		if ((char *)header + VMS_BLOCKSIZE > buf + size) {
+			/* as vms_read_header() does */
+			errno = EINVAL;
+			warn("%.12s", dp->name);
+			free(buf);
+			return -1;
+		}
+	} else {
+		if (vms_read_header(dp, hdrbuf) != 0) {
+			warn("%.12s", dp->name);
+			return -1;
+		}
+		header = (struct vmsfile_header *)hdrbuf;
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_row_begin(NULL);
+		out_strn("name", dp->name, strnlen(dp->name, DIR_NAMELEN), true);
+		out_int("size", nblk);
+		out_str("vms_name",
+		    strjpstr(strbuf, sizeof(strbuf), header->vms_name, 16));
+		out_str("rom_name",
+		    strjpstr(strbuf, sizeof(strbuf), header->rom_name, 32));
+		out_str("game_name",
+		    strgamestr(strbuf, sizeof(strbuf), header->game_name, 16));
+		out_int("icon_num", le16toh(header->icon_num));
+		out_int("icon_speed", le16toh(header->icon_speed));
+		out_int("eyecatch_type", le16toh(header->type));
+		out_int("crc", le16toh(header->crc));
+		out_int("datasize", le32toh(header->datasize));
+		if (buf != NULL && dp->type == DIR_TYPE_DATA) {
+			out_bool("crc_ok", vmsfile_verify(buf, size, &crc) == 0 &&
+			    crc == le16toh(header->crc));
+		}
+		out_row_end();
+		free(buf);
+		return 0;
+	}
+
+	printf("size         = %d bytes (%d blocks)\n", (int)size, nblk);
+
+	printf("vms_name     = <%s>\n",
+	    strjpstr(strbuf, sizeof(strbuf), header->vms_name, 16));
+	printf("rom_name     = <%s>\n",
+	    strjpstr(strbuf, sizeof(strbuf), header->rom_name, 32));
+	printf("game_name    = <%s>\n",
+	    strgamestr(strbuf, sizeof(strbuf), header->game_name, 16));
+
+	printf("icon num    = %d\n", le16toh(header->icon_num));
+	printf("icon speed  = %d\n", le16toh(header->icon_speed));
+	printf("type        = %d\n", le16toh(header->type));
+	printf("crc         = 0x%04x", le16toh(header->crc));
+	if (buf != NULL && dp->type == DIR_TYPE_DATA) {
+		if (vmsfile_verify(buf, size, &crc) != 0)
+			printf(" (bad header)");
+		else if (crc != le16toh(header->crc))
+			printf(" (NG, should be 0x%04x)", crc);
+		else
+			printf(" (OK)");
+	}
+	printf("\n");
+	printf("datasize    = %d\n", le32toh(header->datasize));
+
+	free(buf);
+	return 0;
+}
+
+static int
+dcvmtool_cmd_show(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	int ch, opt_a, opt_v, n, anyerror;
+
+	opt_a = opt_v = 0;
+	while ((ch = getopt(argc, argv, "av")) != -1) {
+		switch (ch) {
+		case 'a':
+			opt_a++;
+			break;
+		case 'v':
+			opt_v++;
+			break;
+		default:
+			return dcvmtool_cmd_show_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (opt_a ? (argc != 0) : (argc != 1))
+		return dcvmtool_cmd_show_usage();
+
+	if (opt_a) {
+		dirp = vmsfs_opendir();
+		if (dirp == NULL)
+			return EX_DATAERR;
+	} else {
+		dp = vms_dirent_lookup(argv[0]);
+		if (dp == NULL)
+			errx(1, "%s", argv[0]);
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_array_begin("files");
+	}
+
+	anyerror = 0;
+	if (opt_a) {
+		for (n = 0; (dp = vmsfs_readdir(dirp)) != NULL; n++) {
+			if (vms_output == VMS_OUTPUT_TEXT)
+				printf("%s%.12s:\n", (n == 0) ? "" : "\n", dp->name);
+			if (vmsfs_show_dirent(dp, opt_v) != 0)
+				anyerror = 1;
+		}
+		vmsfs_closedir(dirp);
+	} else {
+		if (vmsfs_show_dirent(dp, opt_v) != 0)
+			anyerror = 1;
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_array_end();
+		out_record_end();
+	}
+
+	return anyerror;
+}
+
+/*
+ * write the file with the directory entry as it is, but the first block.
+ * a file of the same name is replaced, only after the new one is written.
+ * the FAT and directory are not written, and are left as they were if
+ * the file cannot be written.
+ */
+static struct vmsfs_dirent *
+vmsfs_writefile_dirent(const struct vmsfs_dirent *dirent, char *buf)
+{
+	struct vmsfs_dirent *dp, *olddp;
+	struct vmsfs_fat oldfat;
+	char name[DIR_NAMELEN + 1];
+	int rc, startblk;
+	bool freed;
+
+	memcpy(name, dirent->name, DIR_NAMELEN);
+	name[DIR_NAMELEN] = '\0';
+	olddp = vms_dirent_lookup(name);
+
+	dp = vms_dirent_alloc();
+	if (dp == NULL)
+		return NULL;
+
+	/* a GAME file is always from block 0, where the old one may be */
+	freed = false;
+	if (olddp != NULL && dirent->type == DIR_TYPE_GAME) {
+		memcpy(&oldfat, vms_fatblk, sizeof(oldfat));
+		if (vms_free_chain(le16toh(olddp->block)) != 0) {
+			memcpy(vms_fatblk, &oldfat, sizeof(oldfat));
+			return NULL;
+		}
+		freed = true;
+	}
+
+	startblk = vms_allocate_fat_dirent(dirent);
+	if (startblk >= 0) {
+		VMS_STATS_BEGIN("save_file");
+		rc = vms_write_blocks(buf, startblk, le16toh(dirent->size));
+		VMS_STATS_END();
+		if (rc != 0) {
+			vms_free_chain(startblk);
+			startblk = -1;
+		}
+	}
+	if (startblk < 0) {
+		if (freed)
+			memcpy(vms_fatblk, &oldfat, sizeof(oldfat));
+		return NULL;
+	}
+
+	if (olddp != NULL) {
+		if (freed)
+			olddp->type = DIR_TYPE_NONE;
+		else
+			vmsfs_unlink_dirent(olddp);
+	}
+	*dp = *dirent;
+	dp->block = htole16((uint16_t)startblk);
+	return dp;
+}
+
+/*
+ * DCI (Nexus) file: the directory entry, and the blocks of the file of
+ * which every 32bit word is byte swapped.
+ */
+#define VMS_DCI_SUFFIX	".DCI"
+
+/* a simple loop over aligned words, which compilers can vectorize */
+static void
+vms_wordswap(void *buf, size_t len)
+{
+	uint32_t *p = buf;
+	size_t i, n = len / sizeof(uint32_t);
+
+	for (i = 0; i < n; i++)
+		p[i] = bswap32(p[i]);
+}
+
+static bool
+vms_suffix_filename(const char *filename, const char *suffix)
+{
+	size_t len = strlen(filename);
+
+	return len > strlen(suffix) &&
+	    strcasecmp(filename + len - strlen(suffix), suffix) == 0;
+}
+
+static bool
+vms_dci_filename(const char *filename)
+{
+	return vms_suffix_filename(filename, VMS_DCI_SUFFIX);
+}
+
+static int
+vmsfs_savedci(struct vmsfs_dirent *dp, const char *path)
+{
+	FILE *fh;
+	size_t size;
+	char *buf;
+	int rc;
+
+	buf = vms_loadfile_dirent(dp, &size);
+	if (buf == NULL)
+		return -1;
+	vms_wordswap(buf, size);
+
+	if ((fh = fopen(path, "wb")) == NULL) {
+		free(buf);
+		return -1;
+	}
+	rc = 0;
+	if (fwrite(dp, sizeof(*dp), 1, fh) != 1 || fwrite(buf, size, 1, fh) != 1)
+		rc = -1;
+	if (fclose(fh) != 0)
+		rc = -1;
+	free(buf);
+	return rc;
+}
+
+/*
+ * put the file in DCI. the file is placed as the console does, and the
+ * name, type, attribute, timestamp and header offset are kept.
+ * buf is swapped in place.
+ */
+static struct vmsfs_dirent *
+vmsfs_writedci(char *buf, size_t size)
+{
+	struct vmsfs_dirent dirent;
+	size_t nblk;
+
+	if (size < sizeof(dirent)) {
+		errno = EFTYPE;
+		return NULL;
+	}
+	memcpy(&dirent, buf, sizeof(dirent));
+	nblk = le16toh(dirent.size);
+	if ((dirent.type != DIR_TYPE_DATA && dirent.type != DIR_TYPE_GAME) ||
+	    nblk == 0 || size - sizeof(dirent) != nblk * VMS_BLOCKSIZE) {
+		errno = EFTYPE;
+		return NULL;
+	}
+	buf += sizeof(dirent);
+	vms_wordswap(buf, nblk * VMS_BLOCKSIZE);
+
+	return vmsfs_writefile_dirent(&dirent, buf);
+}
+
+/*
+ * .VMS/.VMI pair. the .VMS is the contents of the file, and the .VMI has
+ * the fields of the directory entry and the description in the header.
+ * the resource name (the name of .VMS and .VMI) is at most 8 characters,
+ * and a longer name is shortened with a hash to keep it unique.
+ */
+#define VMS_VMI_SUFFIX	".VMI"
+#define VMS_VMS_SUFFIX	".VMS"
+
+static bool
+vms_vmi_filename(const char *filename)
+{
+	return vms_suffix_filename(filename, VMS_VMI_SUFFIX);
+}
+
+static void
+vms_vmi_resource_name(char resource[9], const struct vmsfs_dirent *dp)
+{
+	size_t i, len;
+
+	/* the checksum of .VMI is taken from the first 4 bytes, NUL padded */
+	memset(resource, 0, 9);
+	for (len = DIR_NAMELEN; len > 0 &&
+	    (dp->name[len - 1] == '\0' || dp->name[len - 1] == ' '); len--)
+		;
+	if (len <= 8) {
+		memcpy(resource, dp->name, len);
+	} else {
+		snprintf(resource, 9, "%.4s%04X", dp->name,
+		    vms_crc16(0, dp->name, DIR_NAMELEN));
+	}
+	for (i = 0; resource[i] != '\0'; i++) {
+		if (!isalnum(resource[i] & 0xff) && resource[i] != '_')
+			resource[i] = '_';
+	}
+}
+
+static int
+vmsfs_savevmi(struct vmsfs_dirent *dp, const char *resource)
+{
+	struct vmsfile_vmi vmi;
+	struct vmsfile_header *header;
+	const struct timestamp *ts;
+	char path[16];
+	size_t size;
+	FILE *fh;
+	char *buf;
+	int i, rc;
+
+	buf = vms_loadfile_dirent(dp, &size);
+	if (buf == NULL)
+		return -1;
+
+	memset(&vmi, 0, sizeof(vmi));
+	for (i = 0; i < 4; i++)
+		vmi.checksum[i] = (uint8_t)(resource[i] & "SEGA"[i]);
+	memset(vmi.description, ' ', sizeof(vmi.description));
+	memset(vmi.copyright, ' ', sizeof(vmi.copyright));
+	header = (struct vmsfile_header *)(buf + ((dp->type == DIR_TYPE_GAME) ?
+	    le16toh(dp->header_block_offset) * VMS_BLOCKSIZE : 0));
+	if ((char *)header + VMS_BLOCKSIZE <= buf + size) {
+		memcpy(vmi.description, header->vms_name,
+		    strnlen(header->vms_name, sizeof(header->vms_name)));
+	}
+	ts = &dp->timestamp;
+	vmi.year = htole16((uint16_t)(BCD2DEC(ts->bcd[0]) * 100 + BCD2DEC(ts->bcd[1])));
+	vmi.month = (uint8_t)BCD2DEC(ts->bcd[2]);
+	vmi.day = (uint8_t)BCD2DEC(ts->bcd[3]);
+	vmi.hour = (uint8_t)BCD2DEC(ts->bcd[4]);
+	vmi.minute = (uint8_t)BCD2DEC(ts->bcd[5]);
+	vmi.second = (uint8_t)BCD2DEC(ts->bcd[6]);
+	vmi.weekday = (uint8_t)((BCD2DEC(ts->bcd[7]) + 1) % 7);	/* bcd 0=monday */
+	vmi.filenum = htole16(1);
+	memcpy(vmi.resource_name, resource, strnlen(resource, sizeof(vmi.resource_name)));
+	memcpy(vmi.filename, dp->name, DIR_NAMELEN);
+	vmi.mode = htole16((uint16_t)(((dp->type == DIR_TYPE_GAME) ? VMI_MODE_GAME : 0) |
+	    ((dp->attr == DIR_ATTR_PROHIBIT) ? VMI_MODE_PROHIBIT : 0)));
+	vmi.filesize = htole32((uint32_t)size);
+
+	rc = -1;
+	snprintf(path, sizeof(path), "%s%s", resource, VMS_VMS_SUFFIX);
+	if ((fh = fopen(path, "wb")) != NULL) {
+		rc = (fwrite(buf, size, 1, fh) == 1) ? 0 : -1;
+		if (fclose(fh) != 0)
+			rc = -1;
+	}
+	snprintf(path, sizeof(path), "%s%s", resource, VMS_VMI_SUFFIX);
+	if (rc == 0 && (fh = fopen(path, "wb")) != NULL) {
+		rc = (fwrite(&vmi, sizeof(vmi), 1, fh) == 1) ? 0 : -1;
+		if (fclose(fh) != 0)
+			rc = -1;
+	} else {
+		rc = -1;
+	}
+	free(buf);
+	return rc;
+}
+
+static int
+dcvmtool_cmd_get_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools get [-dmv] [-a since] [-b until] file [...]\n");
+	fprintf(stderr, "\t-a since	only the files saved at or after since\n");
+	fprintf(stderr, "\t-b until	only the files saved at or before until\n");
+	fprintf(stderr, "\t-d	save as DCI (NAME.DCI)\n");
+	fprintf(stderr, "\t-m	save as .VMS/.VMI pair\n");
+	fprintf(stderr, "\t-v	print the name of each file saved\n");
+	return EX_USAGE;
+}
+
+/* extract the file of dp to path, with the timestamp */
+static int
+vmsfs_savefile(struct vmsfs_dirent *dp, const char *path)
+{
+	struct timeval tv[2];
+	char tsbuf[VMS_TEXTBUFSIZE];
+	size_t size;
+	FILE *fh;
+	char *buf;
+
+	buf = vms_loadfile_dirent(dp, &size);
+	if (buf == NULL) {
+		warn("%.12s", dp->name);
+		return -1;
+	}
+
+	fh = fopen(path, "wb");
+	if (fh == NULL) {
+		warn("%s", path);
+		free(buf);
+		return -1;
+	}
+	fwrite(buf, size, 1, fh);
+	fclose(fh);
+	free(buf);
+
+	/* keep timestamp */
+	memset(tv, 0, sizeof(tv));
+	tv[0].tv_sec = vmsfs_bcdtimestamp2unixtime(&dp->timestamp);
+	tv[1] = tv[0];
+	if (tv[0].tv_sec == (time_t)-1)
+		warnx("%s: invalid timestamp %s", path,
+		    strbcdtimestamp(tsbuf, sizeof(tsbuf), &dp->timestamp));
+	else
+		utimes(path, tv);
+	return 0;
+}
+
+static int
+dcvmtool_cmd_get(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	struct vms_timerange range;
+	int i, ch, opt_v;
+	const char *pattern;
+	bool opt_d, opt_m;
+	int anyerror = 0;
+
+	memset(&range, 0, sizeof(range));
+	opt_d = opt_m = false;
+	opt_v = 0;
+	while ((ch = getopt(argc, argv, "a:b:dmv")) != -1) {
+		switch (ch) {
+		case 'a':
+		case 'b':
+			if (vms_timerange_getopt(&range, ch, optarg) != 0)
+				return EX_USAGE;
+			break;
+		case 'd':
+			opt_d = true;
+			break;
+		case 'm':
+			opt_m = true;
+			break;
+		case 'v':
+			opt_v++;
+			break;
+		default:
+			return dcvmtool_cmd_get_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (opt_d && opt_m)
+		return dcvmtool_cmd_get_usage();
+
+	for (i = 0; i < argc; i++) {
+		pattern = argv[i];
+
+		dirp = vmsfs_opendir();
+		if (dirp == NULL)
+			return EX_DATAERR;;
+
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			char name[DIR_NAMELEN + 1];
+			memcpy(name, dp->name, DIR_NAMELEN);
+			name[DIR_NAMELEN] = '\0';
+
+			if (!vms_timerange_match(&range, &dp->timestamp))
+				continue;
+			if (fnmatch(pattern, name, FNM_CASEFOLD) != 0)
+				continue;
+
+			if (opt_d) {
+				char path[DIR_NAMELEN + sizeof(VMS_DCI_SUFFIX)];
+
+				snprintf(path, sizeof(path), "%s%s", name,
+				    VMS_DCI_SUFFIX);
+				if (opt_v)
+					printf("%s\n", path);
+				if (vmsfs_savedci(dp, path) != 0) {
+					warn("%s", path);
+					anyerror = 1;
+				}
+			} else if (opt_m) {
+				char resource[9];
+
+				vms_vmi_resource_name(resource, dp);
+				if (opt_v)
+					printf("%s: %s%s\n", name, resource, VMS_VMI_SUFFIX);
+				if (vmsfs_savevmi(dp, resource) != 0) {
+					warn("%s", resource);
+					anyerror = 1;
+				}
+			} else {
+				if (opt_v)
+					printf("%s\n", name);
+				if (vmsfs_savefile(dp, name) != 0)
+					anyerror = 1;
+			}
+		}
+		vmsfs_closedir(dirp);
+	}
+
+	return anyerror;
+}
+
+static int
+dcvmtool_cmd_del_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools del [options] file\n");
+	return EX_USAGE;
+}
+
+static int
+dcvmtool_cmd_del(int argc, char *argv[])
+{
+	char *filename;
+	int rc, ch, opt_v;
+
+	opt_v = 0;
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			opt_v++;
+			break;
+		default:
+			return dcvmtool_cmd_del_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		return dcvmtool_cmd_del_usage();
+
+	filename = argv[0];
+	rc = vmsfs_unlink(filename);
+	if (rc != 0)
+		err(1, "del: %s", filename);
+
+	return 0;
+}
+
+static int
+dcvmtool_cmd_put_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools put [-cRVv] file ...\n");
+	fprintf(stderr, "\t-c	fix CRC in the header of file\n");
+	fprintf(stderr, "\t-R	with -V, write the bad blocks again to other blocks\n");
+	fprintf(stderr, "\t-V	read back and compare the written blocks\n");
+	fprintf(stderr, "\tfile.DCI is put as DCI, with the name and attributes in it\n");
+	fprintf(stderr, "\tfile.VMI puts the .VMS of it, with the name and attributes in it\n");
+	return EX_USAGE;
+}
+
+static int
+vmsfs_regular_name(char vmsname[DIR_NAMELEN], const char *filename)
+{
+	/* const char valid_character[] = ".0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_"; */
+	int i, ch;
+
+	for (i = 0; i < DIR_NAMELEN; i++) {
+		ch = toupper(filename[i] & 0xff);
+		if (ch == '\0') {
+			memset(&vmsname[i], '_', (size_t)(DIR_NAMELEN - i));
+			break;
+		}
+
+		if (!isalnum(ch) && ch != '_' && ch != '.')
+			ch = '_';
+		vmsname[i] = (char)ch;
+	}
+
+	return 0;
+}
+
+static struct vmsfs_dirent *
+vmsfs_writefile(const char *filename, char *buf, size_t size, time_t mtime)
+{
+	struct vmsfs_dirent *dp;
+	size_t len, nblk;
+	int rc, startblk;
+
+	len = strlen(filename);
+	if (len > DIR_NAMELEN) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	nblk = (size + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE;
+	if (nblk >= (size_t)vms_nblocks) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	dp = vms_dirent_alloc();
+	if (dp == NULL)
+		return NULL;
+
+	startblk = vms_allocate_fat((int)nblk);
+	if (startblk < 0)
+		return NULL;
+
+	VMS_STATS_BEGIN("save_file");
+	rc = vms_write_blocks(buf, startblk, (int)nblk);
+	VMS_STATS_END();
+	if (rc != 0) {
+		vms_free_chain(startblk);
+		return NULL;
+	}
+
+	/* the entry is made only after the file is written */
+	memset(dp, 0, sizeof(*dp));
+
+	//XXX: NOTYET: AUTO DETECT?
+	dp->type = DIR_TYPE_DATA;
+
+	dp->attr = DIR_ATTR_COPIABLE;
+	vmsfs_regular_name(dp->name, filename);
+	vmsfs_unixtime2bcdtimestamp(&dp->timestamp, mtime);
+	dp->size = htole16((uint16_t)nblk);
+
+	//XXX: NOTYET: AUTO DETECT?
+	dp->header_block_offset = 0;
+
+	dp->block = htole16((uint16_t)startblk);
+
+	return dp;
+}
+
+
+static char *
+readfile(const char *filename, size_t size)
+{
+	FILE *fh;
+	size_t rc, padsize;
+	char *buf;
+
+	padsize = (size + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE * VMS_BLOCKSIZE;
+	fh = fopen(filename, "rb");
+	if (fh == NULL)
+		return NULL;
+
+	buf = calloc(1, padsize);
+	if (buf == NULL) {
+		fclose(fh);
+		return NULL;
+	}
+	rc = fread(buf, size, 1, fh);
+	fclose(fh);
+
+	if (rc != 1) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * put the .VMS of the .VMI, which is in the same directory as the .VMI,
+ * with the directory entry made of the .VMI.
+ */
+static struct vmsfs_dirent *
+vmsfs_writevmi(const char *vmipath)
+{
+	struct vmsfile_vmi vmi;
+	struct vmsfs_dirent dirent, *dp;
+	struct stat st;
+	char path[PATH_MAX], *p;
+	size_t size, dirlen;
+	FILE *fh;
+	char *buf;
+	int i;
+
+	if ((fh = fopen(vmipath, "rb")) == NULL)
+		return NULL;
+	i = (fread(&vmi, sizeof(vmi), 1, fh) == 1 && fgetc(fh) == EOF);
+	fclose(fh);
+	if (!i) {
+		errno = EFTYPE;
+		return NULL;
+	}
+	for (i = 0; i < 4; i++) {
+		if (vmi.checksum[i] != (vmi.resource_name[i] & "SEGA"[i])) {
+			errno = EFTYPE;
+			return NULL;
+		}
+	}
+
+	memset(&dirent, 0, sizeof(dirent));
+	dirent.type = (le16toh(vmi.mode) & VMI_MODE_GAME) ?
+	    DIR_TYPE_GAME : DIR_TYPE_DATA;
+	dirent.attr = (le16toh(vmi.mode) & VMI_MODE_PROHIBIT) ?
+	    DIR_ATTR_PROHIBIT : DIR_ATTR_COPIABLE;
+	memcpy(dirent.name, vmi.filename, DIR_NAMELEN);
+	dirent.timestamp.bcd[0] = DEC2BCD(le16toh(vmi.year) / 100 % 100);
+	dirent.timestamp.bcd[1] = DEC2BCD(le16toh(vmi.year) % 100);
+	dirent.timestamp.bcd[2] = DEC2BCD(vmi.month % 100);
+	dirent.timestamp.bcd[3] = DEC2BCD(vmi.day % 100);
+	dirent.timestamp.bcd[4] = DEC2BCD(vmi.hour % 100);
+	dirent.timestamp.bcd[5] = DEC2BCD(vmi.minute % 100);
+	dirent.timestamp.bcd[6] = DEC2BCD(vmi.second % 100);
+	dirent.timestamp.bcd[7] = DEC2BCD((vmi.weekday + 6) % 7);
+	size = le32toh(vmi.filesize);
+	dirent.size = htole16((uint16_t)((size + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE));
+	dirent.header_block_offset = htole16((dirent.type == DIR_TYPE_GAME) ? 1 : 0);
+	if (size == 0 || size > (size_t)vms_nblocks * VMS_BLOCKSIZE) {
+		errno = EFTYPE;
+		return NULL;
+	}
+
+	/* the resource name, in the directory of the .VMI */
+	p = strrchr(vmipath, '/');
+	dirlen = (p == NULL) ? 0 : (size_t)(p - vmipath) + 1;
+	snprintf(path, sizeof(path), "%.*s%.*s%s", (int)dirlen, vmipath,
+	    (int)strnlen(vmi.resource_name, sizeof(vmi.resource_name)),
+	    vmi.resource_name, VMS_VMS_SUFFIX);
+	if (stat(path, &st) != 0) {
+		/* try lower case suffix */
+		for (p = path + strlen(path) - 3; *p != '\0'; p++)
+			*p = (char)tolower(*p & 0xff);
+		if (stat(path, &st) != 0)
+			return NULL;
+	}
+	if ((size_t)st.st_size < size) {
+		errno = EFTYPE;
+		return NULL;
+	}
+	if ((buf = readfile(path, size)) == NULL)
+		return NULL;
+
+	dp = vmsfs_writefile_dirent(&dirent, buf);
+	free(buf);
+	return dp;
+}
+
+#define VMS_VERIFY_RETRY	3
+
+/* verify the blocks written by put, and retry the bad ones with -R */
+static int
+vmsfs_put_verify(bool retry, int verbose)
+{
+	bool *bad, *avoid;
+	int blk, nbad, nverified, ntry;
+
+	bad = calloc((size_t)vms_nblocks, sizeof(*bad));
+	avoid = calloc((size_t)vms_nblocks, sizeof(*avoid));
+	if (bad == NULL || avoid == NULL)
+		err(EX_OSERR, "calloc");
+
+	for (ntry = 0; ; ntry++) {
+		memset(bad, 0, (size_t)vms_nblocks * sizeof(*bad));
+		nbad = vms_verify_blocks(bad, &nverified);
+		if (nbad < 0) {
+			warn("%s", vms_filename);
+			break;
+		}
+		for (blk = 0; blk < vms_nblocks; blk++) {
+			if (bad[blk])
+				printf("block %d: verify failed\n", blk);
+		}
+		if (verbose || nbad > 0)
+			printf("%d blocks verified, %d bad\n", nverified, nbad);
+		if (nbad == 0 || !retry || ntry >= VMS_VERIFY_RETRY)
+			break;
+
+		if (vms_verify_retry(bad, avoid) != 0 ||
+		    vms_save_fat() != 0 || vms_save_dir() != 0) {
+			warn("%s", vms_filename);
+			nbad = -1;
+			break;
+		}
+	}
+
+	free(bad);
+	free(avoid);
+	return (nbad == 0) ? 0 : -1;
+}
+
+static int
+dcvmtool_cmd_put(int argc, char *argv[])
+{
+	struct stat statbuf;
+	struct vmsfs_dirent *dp, *olddp;
+	char vmsname[DIR_NAMELEN + 1];
+	char *filename;
+	size_t size;
+	int i, rc, ch, opt_c, opt_v, anyerror;
+	bool opt_R, opt_V;
+	char *buf;
+
+	opt_c = opt_v = 0;
+	opt_R = opt_V = false;
+	while ((ch = getopt(argc, argv, "cRVv")) != -1) {
+		switch (ch) {
+		case 'c':
+			opt_c++;
+			break;
+		case 'R':
+			opt_R = true;
+			break;
+		case 'V':
+			opt_V = true;
+			break;
+		case 'v':
+			opt_v++;
+			break;
+		default:
+			return dcvmtool_cmd_put_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		return dcvmtool_cmd_put_usage();
+
+	if (opt_V && vms_verify_begin() != 0)
+		err(EX_OSERR, "calloc");
+
+	/* the FAT and directory are written once after all the files */
+	anyerror = 0;
+	for (i = 0; i < argc; i++) {
+		filename = argv[i];
+
+		if (vms_vmi_filename(filename)) {
+			if (opt_c) {
+				warnx("%s: cannot fix CRC of VMI", filename);
+				anyerror = 1;
+				continue;
+			}
+			if (vmsfs_writevmi(filename) == NULL) {
+				warn("%s", filename);
+				anyerror = 1;
+			}
+			continue;
+		}
+
+		rc = stat(filename, &statbuf);
+		if (rc != 0) {
+			warn("%s", filename);
+			anyerror = 1;
+			continue;
+		}
+
+		size = (size_t)statbuf.st_size;
+		buf = readfile(filename, size);
+		if (buf == NULL) {
+			warn("%s", filename);
+			anyerror = 1;
+			continue;
+		}
+
+		if (vms_dci_filename(filename)) {
+			if (opt_c) {
+				warnx("%s: cannot fix CRC of DCI", filename);
+				anyerror = 1;
+				free(buf);
+				continue;
+			}
+			if (vmsfs_writedci(buf, size) == NULL) {
+				warn("%s", filename);
+				anyerror = 1;
+			}
+			free(buf);
+			continue;
+		}
+
+		if (opt_c) {
+			struct vmsfile_header *header = (struct vmsfile_header *)buf;
+			uint16_t crc;
+
+			if (size < sizeof(*header) ||
+			    vmsfile_verify(buf, size, &crc) != 0) {
+				warnx("%s: bad VMS file header, cannot fix CRC",
+				    filename);
+				anyerror = 1;
+				free(buf);
+				continue;
+			}
+			if (opt_v && le16toh(header->crc) != crc) {
+				printf("%s: crc 0x%04x -> 0x%04x\n", filename,
+				    le16toh(header->crc), crc);
+			}
+			header->crc = htole16(crc);
+		}
+
+		vmsfs_regular_name(vmsname, filename);
+		vmsname[DIR_NAMELEN] = '\0';
+		olddp = vms_dirent_lookup(vmsname);
+
+		/* allocate fat and dirent, and write data */
+		dp = vmsfs_writefile(filename, buf, size, statbuf.st_mtime);
+		if (dp == NULL) {
+			warn("%s", filename);
+			anyerror = 1;
+		} else if (olddp != NULL && vmsfs_unlink_dirent(olddp) != 0) {
+			/* the file of the same name is replaced, in memory */
+			warn("%s", vmsname);
+			anyerror = 1;
+		}
+
+		free(buf);
+	}
+
+	if (vms_save_fat() != 0 || vms_save_dir() != 0)
+		err(EX_IOERR, "%s", vms_filename);
+
+	if (opt_V) {
+		if (vmsfs_put_verify(opt_R, opt_v) != 0)
+			anyerror = EX_IOERR;
+		vms_verify_end();
+	}
+
+	return anyerror;
+}
+
+static int
+dcvmtool_cmd_attr_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools attr <attr> <file>\n");
+	fprintf(stderr, "\tattr:\n");
+	fprintf(stderr, "\t\tgame		change file type to GAME\n");
+	fprintf(stderr, "\t\tdata		change file type to DATA\n");
+	fprintf(stderr, "\t\t+prohibit	set prohibit flag\n");
+	fprintf(stderr, "\t\t-prohibit	unset prohibit flag\n");
+	return EX_USAGE;
+}
+
+static int
+dcvmtool_cmd_attr(int argc, char *argv[])
+{
+	struct vmsfs_dirent *dp;
+	char *attr, *filename;
+
+	if (argc != 2)
+		return dcvmtool_cmd_attr_usage();
+
+	attr = argv[0];
+	filename = argv[1];
+	dp = vms_dirent_lookup(filename);
+	if (dp == NULL)
+		err(1, "attr: %s", filename);
+
+	if (strcasecmp(attr, "game") == 0) {
+		dp->type = DIR_TYPE_GAME;
+	} else if (strcasecmp(attr, "data") == 0) {
+		dp->type = DIR_TYPE_DATA;
+	} else if (strcasecmp(attr, "-prohibit") == 0) {
+		dp->attr = DIR_ATTR_COPIABLE;
+	} else if (strcasecmp(attr, "+prohibit") == 0) {
+		dp->attr = DIR_ATTR_PROHIBIT;
+	} else {
+		return dcvmtool_cmd_attr_usage();
+	}
+
+	vms_save_dir();
+
+	return 0;
+}
+
+static int
+dcvmtool_cmd_icon_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools icon [-AePv] [-d dir] [-t png|ppm] -a | file ...\n");
+	fprintf(stderr, "\t-A	write an animated PNG instead of a strip of icons\n");
+	fprintf(stderr, "\t-a	all files\n");
+	fprintf(stderr, "\t-d dir	output directory\n");
+	fprintf(stderr, "\t-e	also write eyecatch\n");
+	fprintf(stderr, "\t-P	prefix output file names with the image name\n");
+	fprintf(stderr, "\t-t fmt	output format (png or ppm)\n");
+	return EX_USAGE;
+}
+
+struct icon_option {
+	const char *dir;
+	const char *format;
+	bool animate;
+	bool eyecatch;
+	bool prefix;
+	int verbose;
+};
+
+/* XXX: unit of icon_speed is not documented. assume 1/30 sec */
+#define VMS_ICON_SPEED_HZ	30
+
+static int
+vmsfs_icon_save(struct vmsfs_dirent *dp, const struct icon_option *opt,
+    const char *what, const struct rgba_image *img, int speed)
+{
+	FILE *fh;
+	char path[PATH_MAX], name[DIR_NAMELEN + 1], *imgname;
+	int rc;
+
+	memcpy(name, dp->name, DIR_NAMELEN);
+	name[DIR_NAMELEN] = '\0';
+	vmsfs_regular_name(name, name);
+
+	imgname = strrchr(vms_filename, '/');
+	imgname = (imgname == NULL) ? vms_filename : imgname + 1;
+
+	snprintf(path, sizeof(path), "%s%s%s%s%s.%s.%s",
+	    (opt->dir == NULL) ? "" : opt->dir,
+	    (opt->dir == NULL) ? "" : "/",
+	    opt->prefix ? imgname : "",
+	    opt->prefix ? "-" : "",
+	    name, what, opt->format);
+
+	fh = fopen(path, "wb");
+	if (fh == NULL) {
+		warn("%s", path);
+		return -1;
+	}
+	if (strcmp(opt->format, "ppm") == 0)
+		rc = ppm_write(fh, img);
+	else
+		rc = png_write(fh, img, (speed == 0) ? 1 : speed,
+		    VMS_ICON_SPEED_HZ);
+	if (fclose(fh) != 0)
+		rc = -1;
+	if (rc != 0) {
+		warn("%s", path);
+		return -1;
+	}
+
+	if (opt->verbose)
+		printf("%s\n", path);
+	return 0;
+}
+
+static int
+vmsfs_icon_dirent(struct vmsfs_dirent *dp, const struct icon_option *opt)
+{
+	struct vmsfile_header *header;
+	struct rgba_image img;
+	int rc;
+
+	header = vms_load_header(dp);
+	if (header == NULL) {
+		warn("%.12s", dp->name);
+		return -1;
+	}
+
+	rc = 0;
+	if (le16toh(header->icon_num) != 0) {
+		if (vmsfile_icon_decode(header, &img, !opt->animate) != 0) {
+			rc = -1;
+		} else {
+			rc = vmsfs_icon_save(dp, opt, "icon", &img,
+			    le16toh(header->icon_speed));
+			free(img.pixels);
+		}
+	}
+
+	if (opt->eyecatch && le16toh(header->type) != 0) {
+		if (vmsfile_eyecatch_decode(header, &img) != 0) {
+			rc = -1;
+		} else {
+			if (vmsfs_icon_save(dp, opt, "eyecatch", &img, 0) != 0)
+				rc = -1;
+			free(img.pixels);
+		}
+	}
+
+	free(header);
+	return rc;
+}
+
+static int
+dcvmtool_cmd_icon(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	struct icon_option opt;
+	int i, ch, opt_a, anyerror;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.format = "png";
+	opt_a = 0;
+	while ((ch = getopt(argc, argv, "Aad:ePt:v")) != -1) {
+		switch (ch) {
+		case 'A':
+			opt.animate = true;
+			break;
+		case 'a':
+			opt_a++;
+			break;
+		case 'd':
+			opt.dir = optarg;
+			break;
+		case 'e':
+			opt.eyecatch = true;
+			break;
+		case 'P':
+			opt.prefix = true;
+			break;
+		case 't':
+			opt.format = optarg;
+			break;
+		case 'v':
+			opt.verbose++;
+			break;
+		default:
+			return dcvmtool_cmd_icon_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (strcmp(opt.format, "png") != 0 && strcmp(opt.format, "ppm") != 0)
+		return dcvmtool_cmd_icon_usage();
+	if (opt.animate && strcmp(opt.format, "png") != 0)
+		return dcvmtool_cmd_icon_usage();
+	if (opt_a ? (argc != 0) : (argc == 0))
+		return dcvmtool_cmd_icon_usage();
+
+	anyerror = 0;
+	if (opt_a) {
+		dirp = vmsfs_opendir();
+		if (dirp == NULL)
+			return EX_DATAERR;
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			if (vmsfs_icon_dirent(dp, &opt) != 0)
+				anyerror = 1;
+		}
+		vmsfs_closedir(dirp);
+		return anyerror;
+	}
+
+	for (i = 0; i < argc; i++) {
+		dp = vms_dirent_lookup(argv[i]);
+		if (dp == NULL) {
+			warn("%s", argv[i]);
+			anyerror = 1;
+			continue;
+		}
+		if (vmsfs_icon_dirent(dp, &opt) != 0)
+			anyerror = 1;
+	}
+	return anyerror;
+}
+
+static int
+dcvmtool_cmd_verify_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools verify [-v] [file ...]\n");
+	return EX_USAGE;
+}
+
+static int
+vmsfs_verify_dirent(struct vmsfs_dirent *dp, int verbose)
+{
+	struct vmsfile_header *header;
+	size_t size, offset;
+	uint16_t crc;
+	char *buf;
+	int rc;
+
+	buf = vms_loadfile_dirent(dp, &size);
+	if (buf == NULL) {
+		warn("%.12s", dp->name);
+		return -1;
+	}
+
+	/* header of GAME file is at header_block_offset */
+	offset = (dp->type == DIR_TYPE_GAME) ?
+	    le16toh(dp->header_block_offset) * VMS_BLOCKSIZE : 0;
+	header = (struct vmsfile_header *)(buf + offset);
+	rc = (offset + VMS_BLOCKSIZE <= size) ?
+	    vmsfile_verify((char *)header, size - offset, &crc) : -1;
+	if (rc != 0) {
+		printf("%.12s: bad header\n", dp->name);
+	} else if (le16toh(header->crc) != crc) {
+		printf("%.12s: CRC mismatch: 0x%04x, should be 0x%04x\n",
+		    dp->name, le16toh(header->crc), crc);
+		rc = -1;
+	} else if (verbose) {
+		printf("%.12s: OK\n", dp->name);
+	}
+
+	free(buf);
+	return rc;
+}
+
+static int
+dcvmtool_cmd_verify(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	int i, ch, opt_v, anyerror;
+
+	opt_v = 0;
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			opt_v++;
+			break;
+		default:
+			return dcvmtool_cmd_verify_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	anyerror = 0;
+	if (argc > 0) {
+		for (i = 0; i < argc; i++) {
+			dp = vms_dirent_lookup(argv[i]);
+			if (dp == NULL) {
+				warn("%s", argv[i]);
+				anyerror = 1;
+				continue;
+			}
+			if (vmsfs_verify_dirent(dp, opt_v) != 0)
+				anyerror = 1;
+		}
+		return anyerror ? EX_DATAERR : 0;
+	}
+
+	/* only DATA files have valid CRC */
+	dirp = vmsfs_opendir();
+	if (dirp == NULL)
+		return EX_DATAERR;
+	while ((dp = vmsfs_readdir(dirp)) != NULL) {
+		if (dp->type != DIR_TYPE_DATA)
+			continue;
+		if (vmsfs_verify_dirent(dp, opt_v) != 0)
+			anyerror = 1;
+	}
+	vmsfs_closedir(dirp);
+
+	return anyerror ? EX_DATAERR : 0;
+}
+
+static int
+dcvmtool_cmd_fsck_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools fsck [-y]\n");
+	return EX_USAGE;
+}
+
+static int
+dcvmtool_cmd_fsck(int argc, char *argv[])
+{
+	struct vmsfs_fsck fsck;
+	int ch, rc;
+
+	memset(&fsck, 0, sizeof(fsck));
+	while ((ch = getopt(argc, argv, "ny")) != -1) {
+		switch (ch) {
+		case 'n':
+			fsck.repair = false;
+			break;
+		case 'y':
+			fsck.repair = true;
+			break;
+		default:
+			return dcvmtool_cmd_fsck_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		return dcvmtool_cmd_fsck_usage();
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_array_begin("errors");
+	}
+
+	rc = vmsfs_fsck(&fsck);
+	if (rc != 0 && fsck.nerror == 0)
+		warn("fsck");
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_array_end();
+		out_bool("checked", rc == 0);
+		if (rc == 0) {
+			out_int("nfiles", fsck.nfiles);
+			out_int("used_blocks", fsck.nblocks);
+			out_int("free_blocks", vms_getfreeblock());
+		}
+		out_int("nerrors", fsck.nerror);
+		out_int("nfixed", fsck.nfixed);
+		out_bool("modified", fsck.nfixed != 0);
+		out_record_end();
+		return (rc != 0 || fsck.nerror != fsck.nfixed) ? EX_DATAERR : 0;
+	}
+	if (rc != 0)
+		return EX_DATAERR;
+
+	printf("%d files, %d blocks, %d free\n",
+	    fsck.nfiles, fsck.nblocks, vms_getfreeblock());
+	if (fsck.nfixed != 0)
+		printf("***** FILE SYSTEM WAS MODIFIED *****\n");
+
+	if (fsck.nerror != fsck.nfixed)
+		return EX_DATAERR;
+	return 0;
+}
+
+/*
+ * recover
+ *
+ * vmsfs_unlink() only clears the type of the directory entry and frees
+ * the chain, so the name, size, timestamp and the first block of a
+ * deleted file remain. the chain is guessed as the console allocates it:
+ * a DATA file goes downward through the free blocks from its first block,
+ * and a GAME file is contiguous from block 0. the guess is accepted only
+ * if the header (and the CRC of a DATA file) read along it is good.
+ */
+enum vms_recover_state {
+	VMS_RECOVER_INTACT,		/* header and CRC are good */
+	VMS_RECOVER_DAMAGED,		/* header is good, CRC mismatch */
+	VMS_RECOVER_OVERWRITTEN		/* blocks are in use, or no header */
+};
+
+static const char *vms_recover_statename[] = {
+	[VMS_RECOVER_INTACT] = "intact",
+	[VMS_RECOVER_DAMAGED] = "damaged",
+	[VMS_RECOVER_OVERWRITTEN] = "overwritten"
+};
+
+struct vms_recover {
+	int type;
+	enum vms_recover_state state;
+	int chain[VMS_MAXNUM_BLOCKS];
+};
+
+static int
+dcvmtool_cmd_recover_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools recover [-adn] [file ...]\n");
+	fprintf(stderr, "\t-a	recover all the intact files\n");
+	fprintf(stderr, "\t-d	also recover the damaged files\n");
+	fprintf(stderr, "\t-n	only show what would be recovered\n");
+	return EX_USAGE;
+}
+
+/* a directory entry which was used by a file deleted */
+static bool
+vms_dirent_deleted(const struct vmsfs_dirent *dp)
+{
+	return dp->type == DIR_TYPE_NONE && dp->name[0] != '\0' &&
+	    le16toh(dp->size) > 0 && le16toh(dp->block) < vms_nblocks;
+}
+
+/*
+ * guess the chain of nblk free blocks from start. returns -1 if any of
+ * them is in use now.
+ */
+static int
+vms_recover_chain(int *chain, int start, int nblk, bool game)
+{
+	int i, blk;
+
+	for (i = 0, blk = start; i < nblk; i++) {
+		if (game) {
+			blk = start + i;
+			if (blk >= vms_nblocks ||
+			    le16toh(vms_fatblk->block[blk]) != BLOCK_UNALLOCATED)
+				return -1;
+		} else {
+			for (; blk >= 0; blk--) {
+				if (le16toh(vms_fatblk->block[blk]) ==
+				    BLOCK_UNALLOCATED)
+					break;
+			}
+			if (blk < 0 || (i == 0 && blk != start))
+				return -1;
+		}
+		chain[i] = blk--;
+	}
+	return 0;
+}
+
+/* read the blocks of the chain, and check the header and CRC */
+static enum vms_recover_state
+vms_recover_check(const int *chain, int nblk, int hdroff, bool game)
+{
+	const struct vmsfile_header *header;
+	enum vms_recover_state state;
+	size_t size, len;
+	uint16_t crc;
+	char *buf;
+	int i;
+
+	if (hdroff >= nblk)
+		return VMS_RECOVER_OVERWRITTEN;
+
+	size = (size_t)nblk * VMS_BLOCKSIZE;
+	buf = malloc(size);
+	if (buf == NULL)
+		return VMS_RECOVER_OVERWRITTEN;
+	for (i = 0; i < nblk; i++) {
+		if (vms_read_blocks(buf + (size_t)i * VMS_BLOCKSIZE,
+		    chain[i], 1) != 0) {
+			free(buf);
+			return VMS_RECOVER_OVERWRITTEN;
+		}
+	}
+
+	header = (const struct vmsfile_header *)
+	    (buf + (size_t)hdroff * VMS_BLOCKSIZE);
+	len = vmsfile_length(header, size - (size_t)hdroff * VMS_BLOCKSIZE);
+	if (len == 0 || le16toh(header->icon_num) == 0) {
+		state = VMS_RECOVER_OVERWRITTEN;
+	} else if (game) {
+		/* GAME files have no CRC */
+		state = VMS_RECOVER_INTACT;
+	} else {
+		/* the file must fill its blocks, but the last one */
+		if ((len + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE != (size_t)nblk)
+			state = VMS_RECOVER_OVERWRITTEN;
+		else if (vmsfile_verify(buf, size, &crc) == 0 &&
+		    crc == le16toh(header->crc))
+			state = VMS_RECOVER_INTACT;
+		else
+			state = VMS_RECOVER_DAMAGED;
+	}
+
+	free(buf);
+	return state;
+}
+
+/* guess the type and chain of the deleted file of dp */
+static void
+vmsfs_recover_guess(const struct vmsfs_dirent *dp, struct vms_recover *r)
+{
+	enum vms_recover_state state;
+	int start, nblk;
+
+	start = le16toh(dp->block);
+	nblk = le16toh(dp->size);
+	if (nblk > vms_nblocks)
+		nblk = vms_nblocks;
+
+	r->type = DIR_TYPE_DATA;
+	r->state = VMS_RECOVER_OVERWRITTEN;
+	if (dp->header_block_offset == 0 &&
+	    vms_recover_chain(r->chain, start, nblk, false) == 0)
+		r->state = vms_recover_check(r->chain, nblk, 0, false);
+
+	/* a GAME file is at block 0, and its header may not be */
+	if (r->state != VMS_RECOVER_INTACT && start == 0 &&
+	    vms_recover_chain(r->chain, start, nblk, true) == 0) {
+		state = vms_recover_check(r->chain, nblk,
+		    le16toh(dp->header_block_offset), true);
+		if (state < r->state) {
+			r->type = DIR_TYPE_GAME;
+			r->state = state;
+		}
+		if (r->type == DIR_TYPE_DATA && r->state != VMS_RECOVER_OVERWRITTEN)
+			vms_recover_chain(r->chain, start, nblk, false);
+	}
+}
+
+/* link the guessed chain, and make the directory entry alive again */
+static void
+vmsfs_recover_link(struct vmsfs_dirent *dp, const struct vms_recover *r)
+{
+	int i, nblk;
+
+	nblk = le16toh(dp->size);
+	for (i = 0; i < nblk - 1; i++)
+		vms_fatblk->block[r->chain[i]] = htole16((uint16_t)r->chain[i + 1]);
+	vms_fatblk->block[r->chain[i]] = htole16(BLOCK_LAST);
+	dp->type = (uint8_t)r->type;
+}
+
+static int
+dcvmtool_cmd_recover(int argc, char *argv[])
+{
+	struct vms_recover *r;
+	struct vmsfs_dirent *dp;
+	char name[DIR_NAMELEN + 1], buf[VMS_TEXTBUFSIZE];
+	int i, j, ch, ndirents, ndeleted, nrecovered;
+	bool opt_a, opt_d, opt_n, recover, selected;
+
+	opt_a = opt_d = opt_n = false;
+	while ((ch = getopt(argc, argv, "adn")) != -1) {
+		switch (ch) {
+		case 'a':
+			opt_a = true;
+			break;
+		case 'd':
+			opt_d = true;
+			break;
+		case 'n':
+			opt_n = true;
+			break;
+		default:
+			return dcvmtool_cmd_recover_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (opt_a && argc > 0)
+		return dcvmtool_cmd_recover_usage();
+	if (vms_load_fat() != 0 || vms_load_dir() != 0) {
+		warn("%s", vms_filename);
+		return EX_DATAERR;
+	}
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		err(EX_OSERR, "malloc");
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_array_begin("deleted");
+	}
+
+	ndirents = VMSFS_DIR_NENTRIES_PER_BLOCK *
+	    le16toh(vms_rootblk->directory_blocksize);
+	ndeleted = nrecovered = 0;
+	for (i = 0; i < ndirents; i++) {
+		dp = &vms_dirblk->entries[i];
+		if (!vms_dirent_deleted(dp))
+			continue;
+
+		selected = opt_a;
+		for (j = 0; j < argc; j++) {
+			if (vms_dirent_filenamecmp(dp, argv[j]) == 0)
+				selected = true;
+		}
+		if (argc > 0 && !selected)
+			continue;
+		ndeleted++;
+
+		/* the files recovered before take their blocks */
+		vmsfs_recover_guess(dp, r);
+		recover = selected && (r->state == VMS_RECOVER_INTACT ||
+		    (opt_d && r->state == VMS_RECOVER_DAMAGED));
+		memcpy(name, dp->name, DIR_NAMELEN);
+		name[DIR_NAMELEN] = '\0';
+		if (recover && vms_dirent_lookup(name) != NULL) {
+			warnx("%.12s: a file of the same name exists", dp->name);
+			recover = false;
+		}
+		if (recover) {
+			if (!opt_n)
+				vmsfs_recover_link(dp, r);
+			nrecovered++;
+		}
+
+		if (vms_output != VMS_OUTPUT_TEXT) {
+			out_row_begin(NULL);
+			out_strn("name", dp->name, strnlen(dp->name, DIR_NAMELEN),
+			    true);
+			out_str("type", (r->type == DIR_TYPE_GAME) ? "GAME" : "DATA");
+			out_str("timestamp",
+			    strisotimestamp(buf, sizeof(buf), &dp->timestamp));
+			out_int("block", le16toh(dp->block));
+			out_int("size", le16toh(dp->size));
+			out_str("state", vms_recover_statename[r->state]);
+			out_bool("recovered", recover);
+			out_row_end();
+			continue;
+		}
+		printf("%s %s %3d block%s %-12.12s  %s%s\n",
+		    strbcdtimestamp(buf, sizeof(buf), &dp->timestamp),
+		    (r->type == DIR_TYPE_GAME) ? "GAME" : "DATA",
+		    le16toh(dp->size), (le16toh(dp->size) <= 1) ? " " : "s",
+		    dp->name, vms_recover_statename[r->state],
+		    recover ? (opt_n ? ", would be recovered" : ", recovered") :
+		    "");
+	}
+	free(r);
+
+	if (nrecovered > 0 && !opt_n) {
+		if (vms_save_fat() != 0 || vms_save_dir() != 0)
+			err(EX_IOERR, "%s", vms_filename);
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_array_end();
+		out_int("ndeleted", ndeleted);
+		out_int("nrecovered", nrecovered);
+		out_record_end();
+	} else if (argc > 0 || opt_a) {
+		printf("%d of %d deleted file%s recovered\n", nrecovered,
+		    ndeleted, (ndeleted <= 1) ? "" : "s");
+	}
+	return (argc > 0 && nrecovered < argc) ? EX_DATAERR : 0;
+}
+
+static int
+dcvmtool_cmd_format_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools format [-y] [-m manifest]\n");
+	fprintf(stderr, "\t-m manifest	also make the images listed in manifest\n");
+	fprintf(stderr, "\t-y		allow to format a device, not only an image file\n");
+	return EX_USAGE;
+}
+
+/*
+ * bulk provisioning. every image of manifest is made from the same
+ * template (the blank filesystem on memory) with the files put, and only
+ * the blocks which differ from the blank image are written. the files
+ * are read from the host only once.
+ */
+struct vms_template {
+	struct vmsfs_root root;
+	struct vmsfs_fat fat;
+	struct vmsfs_dir dir[VMS_DIRBLOCKSIZE];
+};
+
+struct vms_provfile {
+	char *path;
+	char *buf;
+	size_t size;
+	time_t mtime;
+};
+
+static struct vms_provfile *
+vms_provfile_get(struct vms_provfile **filesp, int *nfilesp, const char *path)
+{
+	struct vms_provfile *files, *file;
+	struct stat st;
+	int i;
+
+	for (i = 0; i < *nfilesp; i++) {
+		if (strcmp((*filesp)[i].path, path) == 0)
+			return &(*filesp)[i];
+	}
+
+	if (stat(path, &st) != 0)
+		return NULL;
+	files = realloc(*filesp, (size_t)(*nfilesp + 1) * sizeof(*files));
+	if (files == NULL)
+		return NULL;
+	*filesp = files;
+
+	file = &files[*nfilesp];
+	file->size = (size_t)st.st_size;
+	file->mtime = st.st_mtime;
+	file->buf = readfile(path, file->size);
+	file->path = strdup(path);
+	if (file->buf == NULL || file->path == NULL) {
+		free(file->buf);
+		free(file->path);
+		return NULL;
+	}
+	(*nfilesp)++;
+	return file;
+}
+
+/* returns 1 if an image is made, 0 for an empty line, or -1 */
+static int
+vmsfs_provision(const struct vms_template *tmpl, char *line,
+    struct vms_provfile **filesp, int *nfilesp)
+{
+	struct vms_provfile *file;
+	char vmsname[DIR_NAMELEN + 1], *image, *path, *name;
+	int rc, i, blk;
+
+	image = strtok(line, " \t\n");
+	if (image == NULL || *image == '#')
+		return 0;	/* empty line or comment */
+
+	if (vms_open(image, O_RDWR | O_CREAT) != 0 || vms_image_create() != 0) {
+		warn("%s", image);
+		return -1;
+	}
+
+	vms_rootblk = vms_arena_alloc(sizeof(tmpl->root));
+	vms_fatblk = vms_arena_alloc(sizeof(tmpl->fat));
+	vms_dirblk = vms_arena_alloc(sizeof(tmpl->dir));
+	if (vms_rootblk == NULL || vms_fatblk == NULL || vms_dirblk == NULL)
+		err(EX_OSERR, "malloc");
+	memcpy(vms_rootblk, &tmpl->root, sizeof(tmpl->root));
+	memcpy(vms_fatblk, &tmpl->fat, sizeof(tmpl->fat));
+	memcpy(vms_dirblk, tmpl->dir, sizeof(tmpl->dir));
+
+	while ((path = strtok(NULL, " \t\n")) != NULL) {
+		file = vms_provfile_get(filesp, nfilesp, path);
+		if (file == NULL) {
+			warn("%s: %s", image, path);
+			goto fail;
+		}
+		name = strrchr(path, '/');
+		name = (name == NULL) ? path : name + 1;
+		vmsfs_regular_name(vmsname, name);
+		vmsname[DIR_NAMELEN] = '\0';
+		if (vms_dirent_lookup(vmsname) != NULL) {
+			warnx("%s: %s: %s", image, path, strerror(EEXIST));
+			goto fail;
+		}
+		if (vmsfs_writefile(name, file->buf, file->size, file->mtime) == NULL) {
+			warn("%s: %s", image, path);
+			goto fail;
+		}
+	}
+
+	rc = vms_save_root();
+	if (rc == 0)
+		rc = vms_save_fat();
+	/* the directory blocks which are still empty are holes already */
+	for (i = 0, blk = VMS_DIRBLOCKNO; rc == 0 && blk >= 0;
+	    i++, blk = vms_nextblock(blk)) {
+		if (memcmp(&vms_dirblk[i], &tmpl->dir[i], sizeof(tmpl->dir[i])) != 0)
+			rc = vms_write_blocks(&vms_dirblk[i], blk, 1);
+	}
+	if (rc != 0) {
+		warn("%s", image);
+		goto fail;
+	}
+	return 1;
+
+ fail:
+	/* do not leave a broken image */
+	unlink(image);
+	return -1;
+}
+
+static int
+dcvmtool_cmd_format(int argc, char *argv[])
+{
+	struct vms_template *tmpl;
+	struct vms_provfile *files;
+	struct timestamp timestamp;
+	const char *manifest;
+	char *line;
+	size_t linesize;
+	FILE *fh;
+	int ch, opt_y, i, nfiles, nimage, nerror, rc;
+
+	manifest = NULL;
+	opt_y = 0;
+	while ((ch = getopt(argc, argv, "m:y")) != -1) {
+		switch (ch) {
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'y':
+			opt_y++;
+			break;
+		default:
+			return dcvmtool_cmd_format_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		return dcvmtool_cmd_format_usage();
+
+	vmsfs_unixtime2bcdtimestamp(&timestamp, time(NULL));
+	if (vmsfs_newfs(&timestamp) != 0)
+		err(EX_OSERR, "malloc");
+
+	/* blank image file, or the system area of a device */
+	if (vms_image_create() != 0) {
+		if (errno != EFTYPE)
+			err(1, "%s", vms_filename);
+		if (!opt_y)
+			errx(EX_USAGE, "%s: not an image file, -y is required to format",
+			    vms_filename);
+	}
+	if (vms_save_root() != 0 || vms_save_fat() != 0 || vms_save_dir() != 0)
+		err(1, "%s", vms_filename);
+
+	if (manifest == NULL)
+		return 0;
+
+	tmpl = malloc(sizeof(*tmpl));
+	if (tmpl == NULL)
+		err(EX_OSERR, "malloc");
+	memcpy(&tmpl->root, vms_rootblk, sizeof(tmpl->root));
+	memcpy(&tmpl->fat, vms_fatblk, sizeof(tmpl->fat));
+	memcpy(tmpl->dir, vms_dirblk, sizeof(tmpl->dir));
+
+	if (strcmp(manifest, "-") == 0)
+		fh = stdin;
+	else if ((fh = fopen(manifest, "r")) == NULL)
+		err(EX_NOINPUT, "%s", manifest);
+
+	files = NULL;
+	line = NULL;
+	linesize = 0;
+	nfiles = nimage = nerror = 0;
+	while (getline(&line, &linesize, fh) != -1) {
+		rc = vmsfs_provision(tmpl, line, &files, &nfiles);
+		if (rc < 0)
+			nerror++;
+		else
+			nimage += rc;
+	}
+	if (fh != stdin)
+		fclose(fh);
+
+	if (vms_output == VMS_OUTPUT_TEXT)
+		printf("%d images made, %d errors\n", nimage, nerror);
+
+	for (i = 0; i < nfiles; i++) {
+		free(files[i].path);
+		free(files[i].buf);
+	}
+	free(files);
+	free(line);
+	free(tmpl);
+	return (nerror == 0) ? 0 : 1;
+}
+
+static int
+dcvmtool_cmd_backup_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools backup file\n");
+	fprintf(stderr, "       dcvmtools restore [-y] file\n");
+	fprintf(stderr, "\t-y		allow to restore a backup of another card size or layout\n");
+	return EX_USAGE;
+}
+
+/*
+ * the blocks in use: the system area, and the blocks allocated in FAT.
+ * only they are read by backup and written by restore, and the others are
+ * holes of the backup image.
+ */
+static int
+vms_used_blocks(bool *used)
+{
+	int i, blk, n, nused;
+
+	memset(used, 0, (size_t)vms_nblocks * sizeof(*used));
+	for (i = 0; i < vms_nblocks; i++) {
+		if (le16toh(vms_fatblk->block[i]) != BLOCK_UNALLOCATED)
+			used[i] = true;
+	}
+	used[VMS_ROOTBLOCKNO] = true;
+	blk = le16toh(vms_rootblk->fat_blockno);
+	for (n = le16toh(vms_rootblk->fat_nblocksize); n > 0 && blk >= 0; n--)
+		used[blk--] = true;
+	blk = le16toh(vms_rootblk->directory_blockno);
+	for (n = le16toh(vms_rootblk->directory_blocksize); n > 0 && blk >= 0 &&
+	    blk < vms_nblocks; n--)
+		used[blk--] = true;
+
+	for (nused = 0, i = 0; i < vms_nblocks; i++)
+		nused += used[i];
+	return nused;
+}
+
+/*
+ * copy the data blocks in use, a run of contiguous blocks at once.
+ * the root, FAT and directory are not copied, as they are on memory.
+ */
+static int
+vms_copy_used_blocks(int fromfd, off_t fromoff, int tofd, off_t tooff,
+    const bool *used, bool todevice)
+{
+	char *buf;
+	ssize_t len;
+	size_t size;
+	enum vms_area area;
+	int blk, n, i;
+
+	buf = malloc((size_t)vms_nblocks * VMS_BLOCKSIZE);
+	if (buf == NULL)
+		return -1;
+
+	for (blk = 0; blk < vms_nblocks; blk += n) {
+		area = vms_blkarea(blk);
+		for (n = 0; blk + n < vms_nblocks && used[blk + n] &&
+		    vms_blkarea(blk + n) == area; n++)
+			;
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+		if (area != VMS_AREA_DATA)
+			continue;
+
+		size = (size_t)n * VMS_BLOCKSIZE;
+		len = pread(fromfd, buf, size, fromoff + (off_t)blk * VMS_BLOCKSIZE);
+		if (__predict_false(vms_stats) && !todevice) {
+			for (i = 0; i < n; i++)
+				vms_stats_io(blk + i, false, (len == (ssize_t)size) ? VMS_BLOCKSIZE : -1);
+		}
+		if (len == (ssize_t)size) {
+			len = pwrite(tofd, buf, size, tooff + (off_t)blk * VMS_BLOCKSIZE);
+			if (__predict_false(vms_stats) && todevice) {
+				for (i = 0; i < n; i++)
+					vms_stats_io(blk + i, true, (len == (ssize_t)size) ? VMS_BLOCKSIZE : -1);
+			}
+		}
+		if (len != (ssize_t)size) {
+			if (len >= 0)
+				errno = EIO;
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+/* a sparse image of the blocks in use */
+static int
+dcvmtool_cmd_backup(int argc, char *argv[])
+{
+	const char *file;
+	bool *used;
+	int fd, nused, rc;
+
+	if (argc != 1)
+		return dcvmtool_cmd_backup_usage();
+	file = argv[0];
+
+	if (vms_load_dir() != 0)
+		err(EX_DATAERR, "%s", vms_filename);
+	used = calloc((size_t)vms_nblocks, sizeof(*used));
+	if (used == NULL)
+		err(EX_OSERR, "calloc");
+	nused = vms_used_blocks(used);
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		err(EX_CANTCREAT, "%s", file);
+	/* the root, FAT and directory on memory, and the data from the device */
+	rc = ftruncate(fd, (off_t)vms_nblocks * VMS_BLOCKSIZE);
+	if (rc == 0)
+		rc = vms_copy_used_blocks(vms_fd, vms_bankoff, fd, 0, used, false);
+	if (rc == 0 && pwrite(fd, vms_rootblk, VMS_BLOCKSIZE,
+	    (off_t)VMS_ROOTBLOCKNO * VMS_BLOCKSIZE) != VMS_BLOCKSIZE)
+		rc = -1;
+	if (rc == 0) {
+		int i, blk = le16toh(vms_rootblk->fat_blockno);
+
+		for (i = 0; rc == 0 && i < le16toh(vms_rootblk->fat_nblocksize); i++) {
+			if (pwrite(fd, &vms_fatblk->block[i * VMS_FAT_NENTRIES_PER_BLOCK],
+			    VMS_BLOCKSIZE, (off_t)(blk - i) * VMS_BLOCKSIZE) != VMS_BLOCKSIZE)
+				rc = -1;
+		}
+		blk = le16toh(vms_rootblk->directory_blockno);
+		for (i = 0; rc == 0 && blk >= 0; i++, blk = vms_nextblock(blk)) {
+			if (pwrite(fd, &vms_dirblk[i], VMS_BLOCKSIZE,
+			    (off_t)blk * VMS_BLOCKSIZE) != VMS_BLOCKSIZE)
+				rc = -1;
+		}
+	}
+	if (close(fd) != 0)
+		rc = -1;
+	if (rc != 0) {
+		warn("%s", file);
+		unlink(file);
+		free(used);
+		return 1;
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_str("file", file);
+		out_int("used_blocks", nused);
+		out_int("blocks", vms_nblocks);
+		out_record_end();
+	} else {
+		printf("%s: %d of %d blocks\n", file, nused, vms_nblocks);
+	}
+	free(used);
+	return 0;
+}
+
+/* the card size and the places of the system area are the same */
+static bool
+vms_root_samelayout(const struct vmsfs_root *a, const struct vmsfs_root *b)
+{
+	return a->fat_blockno == b->fat_blockno &&
+	    a->fat_nblocksize == b->fat_nblocksize &&
+	    a->directory_blockno == b->directory_blockno &&
+	    a->directory_blocksize == b->directory_blocksize &&
+	    a->user_blocks == b->user_blocks;
+}
+
+/*
+ * write the blocks in use of the backup image. the data blocks are written
+ * first, and the directory, FAT and root at last.
+ */
+static int
+dcvmtool_cmd_restore(int argc, char *argv[])
+{
+	struct vmsfs_root devroot;
+	const char *file;
+	bool *used, opt_y, devok;
+	off_t devoff;
+	int ch, fd, devfd, nused, rc;
+
+	opt_y = false;
+	while ((ch = getopt(argc, argv, "y")) != -1) {
+		switch (ch) {
+		case 'y':
+			opt_y = true;
+			break;
+		default:
+			return dcvmtool_cmd_backup_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		return dcvmtool_cmd_backup_usage();
+	file = argv[0];
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		err(EX_NOINPUT, "%s", file);
+
+	/* the layout of the card, which the backup must have */
+	devok = (vms_load_fat() == 0);
+	if (devok)
+		memcpy(&devroot, vms_rootblk, sizeof(devroot));
+
+	/* load the root, FAT and directory of the backup instead of the device */
+	vms_rootblk = NULL;
+	vms_fatblk = NULL;
+	vms_dirblk = NULL;
+	vms_arena_reset();
+	devfd = vms_fd;
+	devoff = vms_bankoff;
+	vms_fd = fd;
+	vms_bankoff = 0;
+	rc = vms_load_dir();
+	vms_fd = devfd;
+	vms_bankoff = devoff;
+	if (rc != 0)
+		err(EX_DATAERR, "%s", file);
+
+	/* a bank is followed by the next one, and cannot be larger */
+	if (vms_bank >= 0 && vms_nblocks > VMS_NUM_BLOCKS)
+		errx(EX_DATAERR, "%s: %d blocks, larger than a bank", file,
+		    vms_nblocks);
+	if (!opt_y && !devok)
+		errx(EX_DATAERR, "%s: cannot read the layout, "
+		    "-y is required to restore", vms_filename);
+	if (!opt_y && !vms_root_samelayout(&devroot, vms_rootblk))
+		errx(EX_DATAERR, "%s: card size or layout differs from %s, "
+		    "-y is required to restore", file, vms_filename);
+
+	used = calloc((size_t)vms_nblocks, sizeof(*used));
+	if (used == NULL)
+		err(EX_OSERR, "calloc");
+	nused = vms_used_blocks(used);
+
+	rc = vms_copy_used_blocks(fd, 0, vms_fd, vms_bankoff, used, true);
+	if (rc == 0)
+		rc = vms_save_dir();
+	if (rc == 0)
+		rc = vms_save_fat();
+	if (rc == 0)
+		rc = vms_save_root();
+	close(fd);
+	free(used);
+	if (rc != 0)
+		err(1, "%s", vms_filename);
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_str("file", file);
+		out_int("used_blocks", nused);
+		out_int("blocks", vms_nblocks);
+		out_record_end();
+	} else {
+		printf("%s: %d of %d blocks\n", file, nused, vms_nblocks);
+	}
+	return 0;
+}
+
+static int
+dcvmtool_cmd_hash_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools hash [-s] [file ...]\n");
+	return EX_USAGE;
+}
+
+/* fingerprint of the whole chain of the file, as the size in blocks */
+static int
+vmsfs_hash_dirent(struct vmsfs_dirent *dp, bool sha256)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	char sha256hex[SHA256_DIGEST_LENGTH * 2 + 1];
+	SHA256_CTX ctx;
+	uint64_t hash;
+	size_t size;
+	char *buf;
+	int i;
+
+	buf = vms_loadfile_dirent(dp, &size);
+	if (buf == NULL) {
+		warn("%.12s", dp->name);
+		return -1;
+	}
+
+	hash = vms_xxh64(buf, size, 0);
+	if (sha256) {
+		SHA256_Init(&ctx);
+		SHA256_Update(&ctx, (const uint8_t *)buf, size);
+		SHA256_Final(digest, &ctx);
+		for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+			snprintf(&sha256hex[i * 2], 3, "%02x", digest[i]);
+	}
+	free(buf);
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		char hex[17];
+
+		snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+		out_row_begin(NULL);
+		out_strn("name", dp->name, strnlen(dp->name, DIR_NAMELEN), true);
+		out_int("size", le16toh(dp->size));
+		out_str("xxh64", hex);
+		if (sha256)
+			out_str("sha256", sha256hex);
+		out_row_end();
+	} else if (sha256) {
+		printf("%s  %.12s\n", sha256hex, dp->name);
+	} else {
+		printf("%016llx  %.12s\n", (unsigned long long)hash, dp->name);
+	}
+	return 0;
+}
+
+static int
+dcvmtool_cmd_hash(int argc, char *argv[])
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	bool opt_s;
+	int i, ch, anyerror;
+
+	opt_s = false;
+	while ((ch = getopt(argc, argv, "s")) != -1) {
+		switch (ch) {
+		case 's':
+			opt_s = true;
+			break;
+		default:
+			return dcvmtool_cmd_hash_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_array_begin("files");
+	}
+
+	anyerror = 0;
+	if (argc > 0) {
+		for (i = 0; i < argc; i++) {
+			dp = vms_dirent_lookup(argv[i]);
+			if (dp == NULL) {
+				warn("%s", argv[i]);
+				anyerror = 1;
+				continue;
+			}
+			if (vmsfs_hash_dirent(dp, opt_s) != 0)
+				anyerror = 1;
+		}
+	} else if ((dirp = vmsfs_opendir()) != NULL) {
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			if (vmsfs_hash_dirent(dp, opt_s) != 0)
+				anyerror = 1;
+		}
+		vmsfs_closedir(dirp);
+	} else {
+		anyerror = 1;
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_array_end();
+		out_record_end();
+	}
+	return anyerror ? EX_DATAERR : 0;
+}
+
+/*
+ * find
+ *
+ * the expression is compiled once to a program of instructions on one
+ * boolean register. "A -a B" is "A; if false jump to end; B", and "A -o B"
+ * is "A; if true jump to end; B", so it is short-circuited without a stack.
+ * the header of the file is read only when a header predicate is evaluated.
+ */
+enum vms_find_op {
+	VMS_FIND_TYPE,
+	VMS_FIND_ATTR,
+	VMS_FIND_SIZE,
+	VMS_FIND_NAME,
+	VMS_FIND_SINCE,
+	VMS_FIND_UNTIL,
+	VMS_FIND_HOFF,
+	VMS_FIND_BROKEN,
+	VMS_FIND_VMSNAME,	/* header predicates */
+	VMS_FIND_ROMNAME,
+	VMS_FIND_GAMENAME,
+	VMS_FIND_ICONS,
+	VMS_FIND_EYECATCH,
+	VMS_FIND_DATASIZE,
+	VMS_FIND_CRCOK,
+	VMS_FIND_NOT,		/* operators */
+	VMS_FIND_JF,
+	VMS_FIND_JT
+};
+
+enum vms_find_action {
+	VMS_FIND_PRINT,
+	VMS_FIND_GET,
+	VMS_FIND_DEL,
+	VMS_FIND_HASH
+};
+
+#define VMS_FIND_MAXACTIONS	8
+
+struct vms_find_insn {
+	enum vms_find_op op;
+	int cmp;		/* <0, 0 or >0 for "-n", "n" or "+n" */
+	long val;		/* or the target of jump */
+	const char *str;
+	struct timestamp ts;
+};
+
+struct vms_find {
+	struct vms_find_insn *insns;
+	int ninsns;
+	enum vms_find_action actions[VMS_FIND_MAXACTIONS];
+	int nactions;
+
+	/* parser */
+	char **argv;
+	int argc;
+	int pos;
+};
+
+/* the header of the file, read on demand */
+struct vms_find_file {
+	struct vmsfs_dirent *dp;
+	bool loaded;
+	bool valid;
+	uint32_t block[VMS_BLOCKSIZE / sizeof(uint32_t)];
+};
+
+static int
+dcvmtool_cmd_find_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools find [expression] [action ...]\n");
+	fprintf(stderr, "\tprimaries: -type data|game, -attr prohibit|copiable, -size [+-]n,\n"
+	    "\t    -name pattern, -since time, -until time, -hoff [+-]n, -broken,\n"
+	    "\t    -vmsname string, -romname string, -gamename string,\n"
+	    "\t    -icons [+-]n, -eyecatch n, -datasize [+-]n, -crcok\n");
+	fprintf(stderr, "\toperators: ( expr ), ! expr, -not, expr -a expr, -and,\n"
+	    "\t    expr -o expr, -or\n");
+	fprintf(stderr, "\tactions: -print (default), -get, -del, -hash\n");
+	return EX_USAGE;
+}
+
+static struct vms_find_insn *
+vms_find_emit(struct vms_find *f, enum vms_find_op op)
+{
+	struct vms_find_insn *insn;
+
+	/* at most 2 instructions for each word */
+	insn = &f->insns[f->ninsns++];
+	memset(insn, 0, sizeof(*insn));
+	insn->op = op;
+	return insn;
+}
+
+static const char *
+vms_find_arg(struct vms_find *f, const char *primary)
+{
+	if (f->pos >= f->argc) {
+		warnx("find: %s: missing argument", primary);
+		return NULL;
+	}
+	return f->argv[f->pos++];
+}
+
+/* "[+-]n" */
+static int
+vms_find_number(struct vms_find_insn *insn, const char *arg, bool sign)
+{
+	char *ep;
+
+	insn->cmp = 0;
+	if (sign && (*arg == '+' || *arg == '-'))
+		insn->cmp = (*arg++ == '+') ? 1 : -1;
+	if (!isdigit((unsigned char)*arg))
+		return -1;
+	insn->val = strtol(arg, &ep, 0);
+	return (*ep == '\0') ? 0 : -1;
+}
+
+static int vms_find_parse_or(struct vms_find *);
+
+static int
+vms_find_parse_primary(struct vms_find *f)
+{
+	static const struct {
+		const char *name;
+		enum vms_find_op op;
+	} primaries[] = {
+		{ "-type",	VMS_FIND_TYPE },
+		{ "-attr",	VMS_FIND_ATTR },
+		{ "-size",	VMS_FIND_SIZE },
+		{ "-name",	VMS_FIND_NAME },
+		{ "-since",	VMS_FIND_SINCE },
+		{ "-until",	VMS_FIND_UNTIL },
+		{ "-hoff",	VMS_FIND_HOFF },
+		{ "-broken",	VMS_FIND_BROKEN },
+		{ "-vmsname",	VMS_FIND_VMSNAME },
+		{ "-romname",	VMS_FIND_ROMNAME },
+		{ "-gamename",	VMS_FIND_GAMENAME },
+		{ "-icons",	VMS_FIND_ICONS },
+		{ "-eyecatch",	VMS_FIND_EYECATCH },
+		{ "-datasize",	VMS_FIND_DATASIZE },
+		{ "-crcok",	VMS_FIND_CRCOK }
+	};
+	struct vms_find_insn *insn;
+	const char *word, *arg;
+	size_t i;
+
+	if (f->pos >= f->argc) {
+		warnx("find: expression expected");
+		return -1;
+	}
+	word = f->argv[f->pos++];
+
+	if (strcmp(word, "!") == 0 || strcmp(word, "-not") == 0) {
+		if (vms_find_parse_primary(f) != 0)
+			return -1;
+		vms_find_emit(f, VMS_FIND_NOT);
+		return 0;
+	}
+	if (strcmp(word, "(") == 0) {
+		if (vms_find_parse_or(f) != 0)
+			return -1;
+		if (f->pos >= f->argc || strcmp(f->argv[f->pos], ")") != 0) {
+			warnx("find: ) expected");
+			return -1;
+		}
+		f->pos++;
+		return 0;
+	}
+
+	for (i = 0; i < __arraycount(primaries); i++) {
+		if (strcmp(word, primaries[i].name) == 0)
+			break;
+	}
+	if (i == __arraycount(primaries)) {
+		warnx("find: %s: unknown primary", word);
+		return -1;
+	}
+	insn = vms_find_emit(f, primaries[i].op);
+	if (insn->op == VMS_FIND_BROKEN || insn->op == VMS_FIND_CRCOK)
+		return 0;
+
+	if ((arg = vms_find_arg(f, word)) == NULL)
+		return -1;
+	insn->str = arg;
+	switch (insn->op) {
+	case VMS_FIND_TYPE:
+		if (strcasecmp(arg, "data") == 0)
+			insn->val = DIR_TYPE_DATA;
+		else if (strcasecmp(arg, "game") == 0)
+			insn->val = DIR_TYPE_GAME;
+		else
+			goto badarg;
+		break;
+	case VMS_FIND_ATTR:
+		if (strcasecmp(arg, "prohibit") == 0)
+			insn->val = DIR_ATTR_PROHIBIT;
+		else if (strcasecmp(arg, "copiable") == 0)
+			insn->val = DIR_ATTR_COPIABLE;
+		else
+			goto badarg;
+		break;
+	case VMS_FIND_SINCE:
+	case VMS_FIND_UNTIL:
+		if (vms_parse_timestamp(&insn->ts, arg,
+		    insn->op == VMS_FIND_UNTIL) != 0)
+			goto badarg;
+		break;
+	case VMS_FIND_SIZE:
+	case VMS_FIND_HOFF:
+	case VMS_FIND_ICONS:
+	case VMS_FIND_DATASIZE:
+		if (vms_find_number(insn, arg, true) != 0)
+			goto badarg;
+		break;
+	case VMS_FIND_EYECATCH:
+		if (vms_find_number(insn, arg, false) != 0)
+			goto badarg;
+		break;
+	default:
+		break;
+	}
+	return 0;
+
+ badarg:
+	warnx("find: %s: invalid argument: %s", word, arg);
+	return -1;
+}
+
+static bool
+vms_find_endofand(const struct vms_find *f)
+{
+	const char *word;
+
+	if (f->pos >= f->argc)
+		return true;
+	word = f->argv[f->pos];
+	return strcmp(word, ")") == 0 || strcmp(word, "-o") == 0 ||
+	    strcmp(word, "-or") == 0;
+}
+
+static int
+vms_find_parse_and(struct vms_find *f)
+{
+	struct vms_find_insn *jump;
+
+	if (vms_find_parse_primary(f) != 0)
+		return -1;
+	while (!vms_find_endofand(f)) {
+		if (strcmp(f->argv[f->pos], "-a") == 0 ||
+		    strcmp(f->argv[f->pos], "-and") == 0)
+			f->pos++;
+		jump = vms_find_emit(f, VMS_FIND_JF);
+		if (vms_find_parse_primary(f) != 0)
+			return -1;
+		jump->val = f->ninsns;
+	}
+	return 0;
+}
+
+static int
+vms_find_parse_or(struct vms_find *f)
+{
+	struct vms_find_insn *jump;
+
+	if (vms_find_parse_and(f) != 0)
+		return -1;
+	while (f->pos < f->argc && (strcmp(f->argv[f->pos], "-o") == 0 ||
+	    strcmp(f->argv[f->pos], "-or") == 0)) {
+		f->pos++;
+		jump = vms_find_emit(f, VMS_FIND_JT);
+		if (vms_find_parse_and(f) != 0)
+			return -1;
+		jump->val = f->ninsns;
+	}
+	return 0;
+}
+
+/* take the actions out of argv, and compile the rest */
+static int
+vms_find_compile(struct vms_find *f, int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		enum vms_find_action action;
+	} actions[] = {
+		{ "-print",	VMS_FIND_PRINT },
+		{ "-get",	VMS_FIND_GET },
+		{ "-del",	VMS_FIND_DEL },
+		{ "-hash",	VMS_FIND_HASH }
+	};
+	size_t j;
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	f->argv = malloc(sizeof(*f->argv) * (size_t)(argc + 1));
+	f->insns = malloc(sizeof(*f->insns) * (size_t)(argc * 2 + 1));
+	if (f->argv == NULL || f->insns == NULL)
+		err(EX_OSERR, "malloc");
+
+	for (i = 0; i < argc; i++) {
+		for (j = 0; j < __arraycount(actions); j++) {
+			if (strcmp(argv[i], actions[j].name) == 0)
+				break;
+		}
+		if (j == __arraycount(actions)) {
+			f->argv[f->argc++] = argv[i];
+			continue;
+		}
+		if (f->nactions >= VMS_FIND_MAXACTIONS) {
+			warnx("find: too many actions");
+			return -1;
+		}
+		f->actions[f->nactions++] = actions[j].action;
+	}
+	if (f->nactions == 0)
+		f->actions[f->nactions++] = VMS_FIND_PRINT;
+
+	if (f->argc == 0)
+		return 0;
+	if (vms_find_parse_or(f) != 0)
+		return -1;
+	if (f->pos < f->argc) {
+		warnx("find: %s: unexpected", f->argv[f->pos]);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+vms_find_free(struct vms_find *f)
+{
+	free(f->argv);
+	free(f->insns);
+}
+
+static bool
+vms_find_cmp(const struct vms_find_insn *insn, long val)
+{
+	if (insn->cmp > 0)
+		return val > insn->val;
+	if (insn->cmp < 0)
+		return val < insn->val;
+	return val == insn->val;
+}
+
+/* the chain is not as long as the size of file */
+static bool
+vms_dirent_broken(const struct vmsfs_dirent *dp)
+{
+	int n, nblk, blk, next;
+
+	nblk = le16toh(dp->size);
+	blk = le16toh(dp->block);
+	for (n = 0; n < nblk; n++) {
+		if (blk >= vms_nblocks)
+			return true;
+		next = le16toh(vms_fatblk->block[blk]);
+		if (next == BLOCK_UNALLOCATED)
+			return true;
+		if (next == BLOCK_LAST)
+			return n != nblk - 1;
+		blk = next;
+	}
+	return true;
+}
+
+static const struct vmsfile_header *
+vms_find_header(struct vms_find_file *file)
+{
+	if (!file->loaded) {
+		file->loaded = true;
+		file->valid = vms_read_header(file->dp, file->block) == 0;
+	}
+	return file->valid ? (const struct vmsfile_header *)file->block : NULL;
+}
+
+static bool
+vms_find_strfield(const char *field, size_t fieldlen, const char *str)
+{
+	char buf[VMS_TEXTBUFSIZE];
+
+	return memmem(field, strnlen(field, fieldlen), str, strlen(str)) != NULL ||
+	    strstr(strjpstr(buf, sizeof(buf), field, fieldlen), str) != NULL;
+}
+
+static bool
+vms_find_crcok(struct vms_find_file *file)
+{
+	const struct vmsfile_header *header;
+	size_t size;
+	uint16_t crc;
+	char *buf;
+	bool ok;
+
+	if (file->dp->type != DIR_TYPE_DATA)
+		return false;
+	buf = vms_loadfile_dirent(file->dp, &size);
+	if (buf == NULL)
+		return false;
+	header = (const struct vmsfile_header *)buf;
+	ok = vmsfile_verify(buf, size, &crc) == 0 && crc == le16toh(header->crc);
+	free(buf);
+	return ok;
+}
+
+static bool
+vms_find_exec(const struct vms_find *f, struct vmsfs_dirent *dp)
+{
+	const struct vms_find_insn *insn;
+	const struct vmsfile_header *header;
+	struct vms_find_file file;
+	char name[DIR_NAMELEN + 1];
+	bool r;
+	int pc;
+
+	file.dp = dp;
+	file.loaded = false;
+	r = true;
+	for (pc = 0; pc < f->ninsns; pc++) {
+		insn = &f->insns[pc];
+		switch (insn->op) {
+		case VMS_FIND_TYPE:
+			r = dp->type == insn->val;
+			break;
+		case VMS_FIND_ATTR:
+			r = dp->attr == insn->val;
+			break;
+		case VMS_FIND_SIZE:
+			r = vms_find_cmp(insn, le16toh(dp->size));
+			break;
+		case VMS_FIND_NAME:
+			memcpy(name, dp->name, DIR_NAMELEN);
+			name[DIR_NAMELEN] = '\0';
+			r = fnmatch(insn->str, name, FNM_CASEFOLD) == 0;
+			break;
+		case VMS_FIND_SINCE:
+			r = vms_timestamp_valid(&dp->timestamp) &&
+			    memcmp(dp->timestamp.bcd, insn->ts.bcd,
+			    VMS_TIMESTAMP_CMPLEN) >= 0;
+			break;
+		case VMS_FIND_UNTIL:
+			r = vms_timestamp_valid(&dp->timestamp) &&
+			    memcmp(dp->timestamp.bcd, insn->ts.bcd,
+			    VMS_TIMESTAMP_CMPLEN) <= 0;
+			break;
+		case VMS_FIND_HOFF:
+			r = vms_find_cmp(insn, le16toh(dp->header_block_offset));
+			break;
+		case VMS_FIND_BROKEN:
+			r = vms_dirent_broken(dp);
+			break;
+		case VMS_FIND_VMSNAME:
+		case VMS_FIND_ROMNAME:
+		case VMS_FIND_GAMENAME:
+		case VMS_FIND_ICONS:
+		case VMS_FIND_EYECATCH:
+		case VMS_FIND_DATASIZE:
+			if ((header = vms_find_header(&file)) == NULL) {
+				r = false;
+				break;
+			}
+			if (insn->op == VMS_FIND_VMSNAME)
+				r = vms_find_strfield(header->vms_name,
+				    sizeof(header->vms_name), insn->str);
+			else if (insn->op == VMS_FIND_ROMNAME)
+				r = vms_find_strfield(header->rom_name,
+				    sizeof(header->rom_name), insn->str);
+			else if (insn->op == VMS_FIND_GAMENAME)
+				r = vms_find_strfield((const char *)header->game_name,
+				    sizeof(header->game_name), insn->str);
+			else if (insn->op == VMS_FIND_ICONS)
+				r = vms_find_cmp(insn, le16toh(header->icon_num));
+			else if (insn->op == VMS_FIND_EYECATCH)
+				r = vms_find_cmp(insn, le16toh(header->type));
+			else
+				r = vms_find_cmp(insn, (long)le32toh(header->datasize));
+			break;
+		case VMS_FIND_CRCOK:
+			r = vms_find_crcok(&file);
+			break;
+		case VMS_FIND_NOT:
+			r = !r;
+			break;
+		case VMS_FIND_JF:
+			if (!r)
+				pc = (int)insn->val - 1;
+			break;
+		case VMS_FIND_JT:
+			if (r)
+				pc = (int)insn->val - 1;
+			break;
+		}
+	}
+	return r;
+}
+
+static int
+dcvmtool_cmd_find(int argc, char *argv[])
+{
+	struct vms_find f;
+	struct vmsfs_dirent *dp;
+	char name[DIR_NAMELEN + 1];
+	int i, j, ndirents, nfound, anyerror;
+	bool deleted;
+
+	if (vms_find_compile(&f, argc, argv) != 0) {
+		vms_find_free(&f);
+		return dcvmtool_cmd_find_usage();
+	}
+	if (vms_load_fat() != 0 || vms_load_dir() != 0) {
+		warn("%s", vms_filename);
+		vms_find_free(&f);
+		return EX_DATAERR;
+	}
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_array_begin("files");
+	}
+
+	ndirents = VMSFS_DIR_NENTRIES_PER_BLOCK *
+	    le16toh(vms_rootblk->directory_blocksize);
+	nfound = anyerror = 0;
+	deleted = false;
+	for (i = 0; i < ndirents; i++) {
+		dp = &vms_dirblk->entries[i];
+		if (dp->type == DIR_TYPE_NONE || !vms_find_exec(&f, dp))
+			continue;
+		nfound++;
+
+		memcpy(name, dp->name, DIR_NAMELEN);
+		name[DIR_NAMELEN] = '\0';
+		for (j = 0; j < f.nactions && dp->type != DIR_TYPE_NONE; j++) {
+			switch (f.actions[j]) {
+			case VMS_FIND_PRINT:
+				if (vms_output != VMS_OUTPUT_TEXT)
+					vms_dirent_output(dp);
+				else
+					vms_dirent_print(dp, 0);
+				break;
+			case VMS_FIND_GET:
+				if (vmsfs_savefile(dp, name) != 0)
+					anyerror = 1;
+				break;
+			case VMS_FIND_DEL:
+				/* the FAT and directory are written at last */
+				if (vmsfs_unlink_dirent(dp) != 0) {
+					warn("%s", name);
+					anyerror = 1;
+				} else {
+					deleted = true;
+				}
+				break;
+			case VMS_FIND_HASH:
+				if (vmsfs_hash_dirent(dp, false) != 0)
+					anyerror = 1;
+				break;
+			}
+		}
+	}
+	vms_find_free(&f);
+
+	if (deleted && (vms_save_fat() != 0 || vms_save_dir() != 0))
+		err(EX_IOERR, "%s", vms_filename);
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_array_end();
+		out_int("nfound", nfound);
+		out_record_end();
+	}
+	return anyerror ? EX_DATAERR : 0;
+}
+
+/*
+ * watch
+ *
+ * the root block, FAT and directory are read raw at every interval and
+ * compared with the previous snapshot; only the directory blocks which
+ * differ are compared entry by entry, unless the FAT is changed, for
+ * which the chains of the files are compared too. an image file is not
+ * read at all while its stat(2) is unchanged.
+ */
+#define VMS_WATCH_INTERVAL	1.0
+
+struct vms_watch_snapshot {
+	bool valid;
+	struct vmsfs_root root;
+	struct vmsfs_fat *fat;
+	struct vmsfs_dir *dir;
+	size_t dirsize;		/* allocated */
+	int nblocks;
+	int dir_blksize;
+};
+
+static int
+dcvmtool_cmd_watch_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools watch [-i interval] [-n count]\n");
+	fprintf(stderr, "\t-i interval	seconds between polls (default 1)\n");
+	fprintf(stderr, "\t-n count	exit after count polls\n");
+	return EX_USAGE;
+}
+
+/* read nblk blocks descending from blkno, as the FAT and directory are */
+static int
+vms_watch_read(void *buf, int blkno, int nblk)
+{
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < nblk; i++) {
+		len = pread(vms_fd, (char *)buf + (size_t)i * VMS_BLOCKSIZE,
+		    VMS_BLOCKSIZE, vms_bankoff + (off_t)(blkno - i) * VMS_BLOCKSIZE);
+		if (__predict_false(vms_stats))
+			vms_stats_io(blkno - i, false, len);
+		if (len != VMS_BLOCKSIZE) {
+			if (len >= 0)
+				errno = ENXIO;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+vms_watch_free(struct vms_watch_snapshot *snap)
+{
+	free(snap->fat);
+	free(snap->dir);
+	memset(snap, 0, sizeof(*snap));
+}
+
+/*
+ * returns -1 if the card is not readable or not formatted.
+ * the buffers of the snapshot are reused for every poll.
+ */
+static int
+vms_watch_load(struct vms_watch_snapshot *snap)
+{
+	int i, fat_blkno, fat_blksize, dir_blkno, dir_blksize;
+
+	snap->valid = false;
+	if (vms_watch_read(&snap->root, VMS_ROOTBLOCKNO, 1) != 0)
+		return -1;
+	for (i = 0; i < (int)sizeof(snap->root.magic); i++) {
+		if (snap->root.magic[i] != 0x55)
+			goto unformatted;
+	}
+
+	fat_blkno = le16toh(snap->root.fat_blockno);
+	fat_blksize = le16toh(snap->root.fat_nblocksize);
+	dir_blkno = le16toh(snap->root.directory_blockno);
+	dir_blksize = le16toh(snap->root.directory_blocksize);
+	if (fat_blkno >= VMS_ROOTBLOCKNO || fat_blksize < 1 ||
+	    fat_blksize > VMS_MAXFATBLOCKS || fat_blksize > fat_blkno + 1 ||
+	    dir_blkno >= VMS_ROOTBLOCKNO || dir_blksize <= 0 ||
+	    dir_blksize > dir_blkno + 1)
+		goto unformatted;
+
+	snap->nblocks = fat_blksize * VMS_FAT_NENTRIES_PER_BLOCK;
+	snap->dir_blksize = dir_blksize;
+	if (snap->fat == NULL && (snap->fat = malloc(sizeof(*snap->fat))) == NULL)
+		err(EX_OSERR, "malloc");
+	if (snap->dirsize < (size_t)dir_blksize * VMS_BLOCKSIZE) {
+		free(snap->dir);
+		snap->dirsize = (size_t)dir_blksize * VMS_BLOCKSIZE;
+		if ((snap->dir = malloc(snap->dirsize)) == NULL)
+			err(EX_OSERR, "malloc");
+	}
+	for (i = snap->nblocks; i < VMS_MAXNUM_BLOCKS; i++)
+		snap->fat->block[i] = htole16(BLOCK_UNALLOCATED);
+	if (vms_watch_read(snap->fat, fat_blkno, fat_blksize) != 0 ||
+	    vms_watch_read(snap->dir, dir_blkno, dir_blksize) != 0)
+		return -1;
+	snap->valid = true;
+	return 0;
+
+ unformatted:
+	errno = EFTYPE;
+	return -1;
+}
+
+static void
+vms_watch_event(const char *event, struct vmsfs_dirent *dp,
+    const struct vms_watch_snapshot *snap)
+{
+	struct vmsfs_fat *fatblk;
+	int nblocks;
+
+	/* the FAT of the entry is printed by vms_dirent_output() */
+	fatblk = vms_fatblk;
+	nblocks = vms_nblocks;
+	vms_fatblk = snap->fat;
+	vms_nblocks = snap->nblocks;
+
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_str("event", event);
+		out_array_begin("files");
+		vms_dirent_output(dp);
+		out_array_end();
+		out_record_end();
+	} else {
+		printf("%-6s ", event);
+		vms_dirent_print(dp, 0);
+	}
+	vms_fatblk = fatblk;
+	vms_nblocks = nblocks;
+}
+
+static bool
+vms_watch_chain_equal(const struct vms_watch_snapshot *old,
+    const struct vms_watch_snapshot *new, int blk, int nblk)
+{
+	int i, next;
+
+	for (i = 0; i < nblk && blk < old->nblocks && blk < new->nblocks; i++) {
+		next = le16toh(old->fat->block[blk]);
+		if (next != le16toh(new->fat->block[blk]))
+			return false;
+		blk = next;
+	}
+	return true;
+}
+
+static bool
+vms_watch_modified(const struct vms_watch_snapshot *old,
+    const struct vms_watch_snapshot *new, const struct vmsfs_dirent *o,
+    const struct vmsfs_dirent *n, bool fatchanged)
+{
+	return memcmp(o, n, sizeof(*o)) != 0 || (fatchanged &&
+	    !vms_watch_chain_equal(old, new, le16toh(n->block),
+	    le16toh(n->size)));
+}
+
+/*
+ * emit the events from old to new, and returns the number of them.
+ * an entry which is moved to another slot (a new card, or an image
+ * replaced) is matched by the name, and is not removed and added.
+ */
+static int
+vms_watch_diff(const struct vms_watch_snapshot *old,
+    const struct vms_watch_snapshot *new)
+{
+	struct vmsfs_dirent *o, *n, **removed, **added;
+	bool fatchanged, samelayout;
+	int i, j, nold, nnew, nremoved, nadded, nevent;
+
+	nold = old->valid ? VMSFS_DIR_NENTRIES_PER_BLOCK * old->dir_blksize : 0;
+	nnew = new->valid ? VMSFS_DIR_NENTRIES_PER_BLOCK * new->dir_blksize : 0;
+	samelayout = old->valid && new->valid &&
+	    memcmp(&old->root, &new->root, sizeof(old->root)) == 0;
+	fatchanged = !samelayout ||
+	    memcmp(old->fat, new->fat, sizeof(*old->fat)) != 0;
+
+	removed = calloc((size_t)(nold + 1), sizeof(*removed));
+	added = calloc((size_t)(nnew + 1), sizeof(*added));
+	if (removed == NULL || added == NULL)
+		err(EX_OSERR, "calloc");
+
+	nevent = nremoved = nadded = 0;
+	for (i = 0; i < nold || i < nnew; i++) {
+		if (samelayout && !fatchanged &&
+		    i % VMSFS_DIR_NENTRIES_PER_BLOCK == 0 &&
+		    memcmp(&old->dir->entries[i], &new->dir->entries[i],
+		    VMS_BLOCKSIZE) == 0) {
+			/* this directory block is not changed */
+			i += VMSFS_DIR_NENTRIES_PER_BLOCK - 1;
+			continue;
+		}
+
+		o = (i < nold && old->dir->entries[i].type != DIR_TYPE_NONE) ?
+		    &old->dir->entries[i] : NULL;
+		n = (i < nnew && new->dir->entries[i].type != DIR_TYPE_NONE) ?
+		    &new->dir->entries[i] : NULL;
+		if (o != NULL && n != NULL &&
+		    memcmp(o->name, n->name, DIR_NAMELEN) == 0) {
+			if (vms_watch_modified(old, new, o, n, fatchanged)) {
+				vms_watch_event("modify", n, new);
+				nevent++;
+			}
+			continue;
+		}
+		if (o != NULL)
+			removed[nremoved++] = o;
+		if (n != NULL)
+			added[nadded++] = n;
+	}
+
+	for (i = 0; i < nremoved; i++) {
+		o = removed[i];
+		for (j = 0; j < nadded; j++) {
+			if (added[j] != NULL &&
+			    memcmp(o->name, added[j]->name, DIR_NAMELEN) == 0)
 				break;
+		}
+		if (j == nadded) {
+			vms_watch_event("remove", o, old);
+			nevent++;
+			continue;
+		}
+		if (vms_watch_modified(old, new, o, added[j], fatchanged)) {
+			vms_watch_event("modify", added[j], new);
+			nevent++;
+		}
+		added[j] = NULL;
+	}
+	for (j = 0; j < nadded; j++) {
+		if (added[j] != NULL) {
+			vms_watch_event("add", added[j], new);
+			nevent++;
+		}
+	}
+
+	free(removed);
+	free(added);
+	return nevent;
+}
+
+static int
+dcvmtool_cmd_watch(int argc, char *argv[])
+{
+	struct vms_watch_snapshot snap[2], *old, *new, *tmp;
+	struct stat st, lastst;
+	struct timespec interval;
+	double sec;
+	long count, npoll;
+	bool regular, polled, readable;
+	char *ep;
+	int ch, fd;
+
+	sec = VMS_WATCH_INTERVAL;
+	count = 0;
+	while ((ch = getopt(argc, argv, "i:n:")) != -1) {
+		switch (ch) {
+		case 'i':
+			sec = strtod(optarg, &ep);
+			if (*ep != '\0' || sec <= 0)
+				return dcvmtool_cmd_watch_usage();
+			break;
+		case 'n':
+			count = strtol(optarg, &ep, 10);
+			if (*ep != '\0' || count < 0)
+				return dcvmtool_cmd_watch_usage();
+			break;
+		default:
+			return dcvmtool_cmd_watch_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		return dcvmtool_cmd_watch_usage();
+	if (vms_output == VMS_OUTPUT_JSON || vms_output == VMS_OUTPUT_CSV) {
+		warnx("watch: events are streamed, use -o ndjson");
+		return EX_USAGE;
+	}
+
+	interval.tv_sec = (time_t)sec;
+	interval.tv_nsec = (long)((sec - (double)interval.tv_sec) * 1e9);
+
+	memset(snap, 0, sizeof(snap));
+	old = &snap[0];
+	new = &snap[1];
+	memset(&lastst, 0, sizeof(lastst));
+	readable = true;
+	for (npoll = 0; count == 0 || npoll < count; npoll++) {
+		if (npoll > 0)
+			nanosleep(&interval, NULL);
+
+		/* an image is read only when it is changed or replaced */
+		if (stat(vms_filename, &st) != 0)
+			memset(&st, 0, sizeof(st));
+		regular = S_ISREG(st.st_mode);
+		if (regular && old->valid && st.st_dev == lastst.st_dev &&
+		    st.st_ino == lastst.st_ino && st.st_size == lastst.st_size &&
+		    st.st_mtim.tv_sec == lastst.st_mtim.tv_sec &&
+		    st.st_mtim.tv_nsec == lastst.st_mtim.tv_nsec)
+			continue;
+		if (npoll > 0 && (!readable || (regular &&
+		    (st.st_dev != lastst.st_dev || st.st_ino != lastst.st_ino)))) {
+			/* the image is replaced, or the card is inserted again */
+			if ((fd = open(vms_filename, O_RDONLY)) >= 0) {
+				close(vms_fd);
+				vms_fd = fd;
 			}
+		}
+		lastst = st;
 
-			printf(" %d", blk);
-			blk = vms_nextblock(blk);
+		polled = vms_watch_load(new) == 0;
+		if (!polled && readable)
+			warn("%s", vms_filename);
+		readable = polled;
+		if (!polled && !old->valid)
+			continue;
+
+		if (vms_watch_diff(old, new) > 0)
+			fflush(stdout);
+		tmp = old;
+		old = new;
+		new = tmp;
+	}
+	vms_watch_free(&snap[0]);
+	vms_watch_free(&snap[1]);
+	return 0;
+}
+
+/*
+ * catalog index of an archive of images (index build/update/query)
+ *
+ * the index file is little endian, and is used by mmap(2) as it is:
+ *	header, images[nimages], entries[nentries], strings[strsize]
+ * entries are sorted by name, so that a name is found by binary search.
+ */
+#define VMS_INDEX_MAGIC		"VMSINDEX"
+#define VMS_INDEX_VERSION	1
+
+struct vms_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nimages;
+	uint32_t nentries;
+	uint32_t strsize;
+};
+
+struct vms_index_image {
+	uint32_t path;			/* offset in strings */
+	int32_t bank;			/* -1 if not a multi-bank image */
+	int64_t mtime;			/* in nsec */
+	struct timestamp timestamp;	/* of the root block */
+	uint32_t nentries;
+	uint32_t error;			/* errno, if cannot be read */
+};
+
+struct vms_index_entry {
+	char name[DIR_NAMELEN];		/* +0x00 */
+	uint8_t type;			/* +0x0c */
+	uint8_t attr;			/* +0x0d */
+	uint16_t size;			/* +0x0e */
+	struct timestamp timestamp;	/* +0x10 */
+	uint32_t image;			/* +0x18 */
+	uint16_t crc;			/* +0x1c in the header */
+	uint8_t crc_ok;			/* +0x1e */
+	uint8_t reserved1;		/* +0x1f */
+	uint32_t datasize;		/* +0x20 */
+	uint32_t reserved2;		/* +0x24 */
+	uint64_t hash;			/* +0x28 XXH64 of the file */
+	char vms_name[16];		/* +0x30 */
+	char rom_name[32];		/* +0x40 */
+	uint8_t game_name[16];		/* +0x60 */
+};
+
+/* an index on memory. strings are not used while building */
+struct vms_index {
+	struct vms_index_image *images;
+	struct vms_index_entry *entries;
+	const char *strings;
+	uint32_t nimages;
+	uint32_t nentries;
+	uint32_t strsize;
+	void *map;
+	size_t mapsize;
+};
+
+static int
+vms_index_open(struct vms_index *idx, const char *file)
+{
+	const struct vms_index_header *hdr;
+	struct stat st;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	memset(idx, 0, sizeof(*idx));
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	idx->mapsize = (size_t)st.st_size;
+	if (idx->mapsize < sizeof(*hdr)) {
+		close(fd);
+		errno = EFTYPE;
+		return -1;
+	}
+	idx->map = mmap(NULL, idx->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (idx->map == MAP_FAILED)
+		return -1;
+
+	hdr = idx->map;
+	idx->nimages = le32toh(hdr->nimages);
+	idx->nentries = le32toh(hdr->nentries);
+	idx->strsize = le32toh(hdr->strsize);
+	size = sizeof(*hdr) + (size_t)idx->nimages * sizeof(*idx->images) +
+	    (size_t)idx->nentries * sizeof(*idx->entries) + idx->strsize;
+	if (memcmp(hdr->magic, VMS_INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    le32toh(hdr->version) != VMS_INDEX_VERSION || size != idx->mapsize ||
+	    idx->strsize == 0 || ((const char *)idx->map)[size - 1] != '\0') {
+		munmap(idx->map, idx->mapsize);
+		errno = EFTYPE;
+		return -1;
+	}
+	idx->images = (struct vms_index_image *)((char *)idx->map + sizeof(*hdr));
+	idx->entries = (struct vms_index_entry *)(idx->images + idx->nimages);
+	idx->strings = (const char *)(idx->entries + idx->nentries);
+
+	/* the image of every entry is used as an index of images[] */
+	for (i = 0; i < idx->nentries; i++) {
+		if (le32toh(idx->entries[i].image) >= idx->nimages) {
+			munmap(idx->map, idx->mapsize);
+			memset(idx, 0, sizeof(*idx));
+			errno = EFTYPE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+vms_index_close(struct vms_index *idx)
+{
+	if (idx->map != NULL)
+		munmap(idx->map, idx->mapsize);
+	else {
+		free(idx->images);
+		free(idx->entries);
+	}
+	memset(idx, 0, sizeof(*idx));
+}
+
+static const char *
+vms_index_path(const struct vms_index *idx, const struct vms_index_image *image)
+{
+	uint32_t off = le32toh(image->path);
+
+	return (off < idx->strsize) ? idx->strings + off : "?";
+}
+
+static int
+vms_index_entrycmp(const void *a, const void *b)
+{
+	const struct vms_index_entry *x = a, *y = b;
+	int rc;
+
+	rc = memcmp(x->name, y->name, DIR_NAMELEN);
+	if (rc != 0)
+		return rc;
+	return (le32toh(x->image) > le32toh(y->image)) -
+	    (le32toh(x->image) < le32toh(y->image));
+}
+
+static int
+vms_index_targetcmp(const void *a, const void *b)
+{
+	const struct vms_target *x = a, *y = b;
+	int rc;
+
+	rc = strcmp(x->filename, y->filename);
+	return (rc != 0) ? rc : (x->bank > y->bank) - (x->bank < y->bank);
+}
+
+static int64_t
+vms_index_mtime(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* read the directory and the header of each file of the current image */
+static void
+vmsfs_index_image(struct vms_index_image *image, FILE *out)
+{
+	struct vms_index_entry entry;
+	struct vmsfile_header *header;
+	struct vmsfs_dirent *dp;
+	struct stat st;
+	VMSDIR *dirp;
+	size_t size;
+	uint16_t crc;
+	char *buf;
+
+	if (fstat(vms_fd, &st) == 0)
+		image->mtime = (int64_t)htole64((uint64_t)vms_index_mtime(&st));
+	if ((dirp = vmsfs_opendir()) == NULL) {
+		image->error = htole32((uint32_t)errno);
+		fwrite(image, sizeof(*image), 1, out);
+		return;
+	}
+	image->timestamp = vms_rootblk->timestamp;
+
+	/* the entries follow the image, and the number is known at the end */
+	while ((dp = vmsfs_readdir(dirp)) != NULL)
+		image->nentries++;
+	vmsfs_closedir(dirp);
+	image->nentries = htole32(image->nentries);
+	fwrite(image, sizeof(*image), 1, out);
+
+	dirp = vmsfs_opendir();
+	while ((dp = vmsfs_readdir(dirp)) != NULL) {
+		memset(&entry, 0, sizeof(entry));
+		memcpy(entry.name, dp->name, DIR_NAMELEN);
+		entry.type = dp->type;
+		entry.attr = dp->attr;
+		entry.size = dp->size;
+		entry.timestamp = dp->timestamp;
+		entry.image = image->path;
+
+		buf = vms_loadfile_dirent(dp, &size);
+		if (buf != NULL) {
+			entry.hash = htole64(vms_xxh64(buf, size, 0));
+			header = (struct vmsfile_header *)(buf +
+			    ((dp->type == DIR_TYPE_GAME) ?
+			    le16toh(dp->header_block_offset) * VMS_BLOCKSIZE : 0));
+			if ((char *)header + VMS_BLOCKSIZE <= buf + size) {
+				memcpy(entry.vms_name, header->vms_name, sizeof(entry.vms_name));
+				memcpy(entry.rom_name, header->rom_name, sizeof(entry.rom_name));
+				memcpy(entry.game_name, header->game_name, sizeof(entry.game_name));
+				entry.crc = header->crc;
+				entry.datasize = header->datasize;
+				entry.crc_ok = (vmsfile_verify((char *)header,
+				    size - (size_t)((char *)header - buf), &crc) == 0 &&
+				    crc == le16toh(header->crc));
+			}
+			free(buf);
+		}
+		fwrite(&entry, sizeof(entry), 1, out);
+	}
+	vmsfs_closedir(dirp);
+}
+
+/*
+ * scan the targets in njobs child processes. each child writes the image
+ * and its entries to a temporary file, which are appended to idx.
+ * image->path is the number of the target until the index is written.
+ */
+static int
+vmsfs_index_scan(struct vms_index *idx, const struct vms_target *targets,
+    const uint32_t *toscan, uint32_t nscan, int njobs)
+{
+	struct vms_index_image image;
+	FILE **outputs;
+	pid_t pid;
+	uint32_t i, n;
+	int j, status, rc;
+
+	if ((uint32_t)njobs > nscan)
+		njobs = (nscan == 0) ? 1 : (int)nscan;
+	outputs = calloc((size_t)njobs, sizeof(*outputs));
+	if (outputs == NULL)
+		return -1;
+
+	fflush(stdout);
+	for (j = 0; j < njobs; j++) {
+		if ((outputs[j] = tmpfile()) == NULL)
+			err(EX_OSERR, "tmpfile");
+		pid = fork();
+		if (pid == -1)
+			err(EX_OSERR, "fork");
+		if (pid != 0)
+			continue;
+
+		for (i = (uint32_t)j; i < nscan; i += (uint32_t)njobs) {
+			memset(&image, 0, sizeof(image));
+			image.path = htole32(toscan[i]);
+			image.bank = (int32_t)htole32((uint32_t)targets[toscan[i]].bank);
+			vms_bank = targets[toscan[i]].bank;
+			if (vms_open(targets[toscan[i]].filename, O_RDONLY) != 0) {
+				image.error = htole32((uint32_t)errno);
+				fwrite(&image, sizeof(image), 1, outputs[j]);
+				continue;
+			}
+			vmsfs_index_image(&image, outputs[j]);
+		}
+		fflush(outputs[j]);
+		_exit(ferror(outputs[j]) ? EX_IOERR : 0);
+	}
+
+	rc = 0;
+	while (wait(&status) != -1) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			rc = -1;
+	}
+
+	for (j = 0; j < njobs; j++) {
+		rewind(outputs[j]);
+		while (rc == 0 && fread(&image, sizeof(image), 1, outputs[j]) == 1) {
+			struct vms_index_image *images;
+			struct vms_index_entry *entries;
+
+			n = le32toh(image.nentries);
+			images = realloc(idx->images,
+			    (idx->nimages + 1) * sizeof(*images));
+			entries = realloc(idx->entries,
+			    (idx->nentries + n + 1) * sizeof(*entries));
+			if (images != NULL)
+				idx->images = images;
+			if (entries != NULL)
+				idx->entries = entries;
+			if (images == NULL || entries == NULL ||
+			    fread(&idx->entries[idx->nentries], sizeof(*entries), n,
+			    outputs[j]) != n) {
+				rc = -1;
+				break;
+			}
+			idx->images[idx->nimages++] = image;
+			idx->nentries += n;
+		}
+		fclose(outputs[j]);
+	}
+	free(outputs);
+	return rc;
+}
+
+/*
+ * write the index. every target has an image, and image->path and
+ * entry->image are the number of the target, which is the number of the
+ * image in the index.
+ */
+static int
+vms_index_write(const char *file, struct vms_index *idx,
+    const struct vms_target *targets, uint32_t ntargets)
+{
+	struct vms_index_header hdr;
+	struct vms_index_image *images;
+	char tmpfile[PATH_MAX];
+	uint32_t i, t, off;
+	FILE *fh;
+
+	images = calloc(ntargets + 1, sizeof(*images));
+	if (images == NULL)
+		return -1;
+	for (i = 0; i < idx->nimages; i++)
+		images[le32toh(idx->images[i].path)] = idx->images[i];
+	for (off = 0, t = 0; t < ntargets; t++) {
+		images[t].path = htole32(off);
+		off += (uint32_t)strlen(targets[t].filename) + 1;
+	}
+	qsort(idx->entries, idx->nentries, sizeof(*idx->entries),
+	    vms_index_entrycmp);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, VMS_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(VMS_INDEX_VERSION);
+	hdr.nimages = htole32(ntargets);
+	hdr.nentries = htole32(idx->nentries);
+	hdr.strsize = htole32(off);
+
+	/* replace the index atomically */
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+	if ((fh = fopen(tmpfile, "wb")) == NULL) {
+		free(images);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fh);
+	fwrite(images, sizeof(*images), ntargets, fh);
+	fwrite(idx->entries, sizeof(*idx->entries), idx->nentries, fh);
+	for (t = 0; t < ntargets; t++)
+		fwrite(targets[t].filename, strlen(targets[t].filename) + 1, 1, fh);
+	free(images);
+	if ((ferror(fh) | fclose(fh)) != 0 || rename(tmpfile, file) != 0) {
+		unlink(tmpfile);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+vms_index_addtarget(struct vms_target **targetsp, uint32_t *ntargetsp,
+    const char *path)
+{
+	struct vms_target *targets;
+	char *filename;
+	int nbanks, i;
+
+	nbanks = vms_image_nbanks(path);
+	targets = realloc(*targetsp, (*ntargetsp + (uint32_t)nbanks) * sizeof(*targets));
+	filename = strdup(path);
+	if (targets == NULL || filename == NULL)
+		err(EX_OSERR, "malloc");
+	for (i = 0; i < nbanks; i++) {
+		targets[*ntargetsp].filename = filename;
+		targets[(*ntargetsp)++].bank = (nbanks == 1) ? -1 : i;
+	}
+	*targetsp = targets;
+}
+
+/*
+ * the images to index: the images in the old index which still exist,
+ * and paths. directories are walked, and the files of which size is
+ * a multiple of 128KB in them are taken as images.
+ */
+static uint32_t
+vms_index_targets(char *paths[], const struct vms_index *old,
+    struct vms_target **targetsp)
+{
+	struct stat st;
+	FTS *fts;
+	FTSENT *ent;
+	uint32_t ntargets, i, n;
+
+	*targetsp = calloc(old->nimages + 1, sizeof(**targetsp));
+	if (*targetsp == NULL)
+		err(EX_OSERR, "calloc");
+	for (ntargets = 0, i = 0; i < old->nimages; i++) {
+		(*targetsp)[ntargets].filename = vms_index_path(old, &old->images[i]);
+		(*targetsp)[ntargets].bank = (int32_t)le32toh(old->images[i].bank);
+		if (stat((*targetsp)[ntargets].filename, &st) == 0)
+			ntargets++;
+	}
+
+	if (*paths == NULL)
+		goto done;
+	fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if (fts == NULL)
+		err(EX_NOINPUT, "fts_open");
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_F:
+			if (ent->fts_level == FTS_ROOTLEVEL ||
+			    (ent->fts_statp->st_size > 0 &&
+			    ent->fts_statp->st_size % VMS_BANKSIZE == 0))
+				vms_index_addtarget(targetsp, &ntargets, ent->fts_path);
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			warnx("%s: %s", ent->fts_path, strerror(ent->fts_errno));
+			break;
+		default:
+			break;
+		}
+	}
+	fts_close(fts);
+
+ done:
+	/* sorted and unique, as the images in the index are */
+	qsort(*targetsp, ntargets, sizeof(**targetsp), vms_index_targetcmp);
+	for (n = 0, i = 0; i < ntargets; i++) {
+		if (n == 0 || vms_index_targetcmp(&(*targetsp)[n - 1], &(*targetsp)[i]) != 0)
+			(*targetsp)[n++] = (*targetsp)[i];
+	}
+	return n;
+}
+
+/* find the image of target in the index, which images are sorted */
+static int32_t
+vms_index_findimage(const struct vms_index *idx, const struct vms_target *target)
+{
+	uint32_t lo, hi, mid;
+	int rc;
+
+	for (lo = 0, hi = idx->nimages; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		rc = strcmp(target->filename, vms_index_path(idx, &idx->images[mid]));
+		if (rc == 0)
+			rc = (target->bank > (int32_t)le32toh(idx->images[mid].bank)) -
+			    (target->bank < (int32_t)le32toh(idx->images[mid].bank));
+		if (rc == 0)
+			return (int32_t)mid;
+		if (rc < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+/* the image is not modified since it was indexed */
+static bool
+vms_index_unchanged(const struct vms_index_image *image,
+    const struct vms_target *target)
+{
+	struct stat st;
+
+	if (image->error != 0 || stat(target->filename, &st) != 0 ||
+	    (int64_t)le64toh((uint64_t)image->mtime) != vms_index_mtime(&st))
+		return false;
+
+	/* the timestamp of root block is updated by format */
+	vms_bank = target->bank;
+	if (vms_open(target->filename, O_RDONLY) != 0 || vms_load_root() != 0)
+		return false;
+	return memcmp(&vms_rootblk->timestamp, &image->timestamp,
+	    sizeof(image->timestamp)) == 0;
+}
+
+static int
+dcvmtool_cmd_index_usage(void)
+{
+	fprintf(stderr, "usage: dcvmtools index build [-j njobs] -i index path ...\n");
+	fprintf(stderr, "       dcvmtools index update [-j njobs] -i index [path ...]\n");
+	fprintf(stderr, "       dcvmtools index query -i index [-c crc] [-g game_name] [-H hash]\n"
+	    "\t[-s string] [-t data|game] [-a since] [-b until] [name]\n");
+	return EX_USAGE;
+}
+
+static int
+dcvmtool_cmd_index_build(const char *indexfile, int njobs, char *paths[],
+    bool update)
+{
+	struct vms_index old, idx;
+	struct vms_target *targets;
+	uint32_t i, t, ntargets, nscan, nkept, *toscan, *newof;
+	int32_t n;
+
+	memset(&old, 0, sizeof(old));
+	if (update && vms_index_open(&old, indexfile) != 0)
+		err(1, "%s", indexfile);
+
+	ntargets = vms_index_targets(paths, &old, &targets);
+
+	memset(&idx, 0, sizeof(idx));
+	toscan = calloc(ntargets + 1, sizeof(*toscan));
+	newof = calloc(old.nimages + 1, sizeof(*newof));
+	if (toscan == NULL || newof == NULL)
+		err(EX_OSERR, "calloc");
+	for (i = 0; i < old.nimages; i++)
+		newof[i] = UINT32_MAX;
+
+	/* keep the unchanged images, and their entries */
+	for (nscan = nkept = 0, t = 0; t < ntargets; t++) {
+		n = update ? vms_index_findimage(&old, &targets[t]) : -1;
+		if (n < 0 || !vms_index_unchanged(&old.images[n], &targets[t])) {
+			toscan[nscan++] = t;
+			continue;
+		}
+		newof[n] = t;
+		nkept++;
+	}
+	idx.images = calloc(nkept + 1, sizeof(*idx.images));
+	idx.entries = calloc(old.nentries + 1, sizeof(*idx.entries));
+	if (idx.images == NULL || idx.entries == NULL)
+		err(EX_OSERR, "calloc");
+	for (i = 0; i < old.nimages; i++) {
+		if (newof[i] == UINT32_MAX)
+			continue;
+		idx.images[idx.nimages] = old.images[i];
+		idx.images[idx.nimages++].path = htole32(newof[i]);
+	}
+	for (i = 0; i < old.nentries; i++) {
+		t = newof[le32toh(old.entries[i].image)];
+		if (t == UINT32_MAX)
+			continue;
+		idx.entries[idx.nentries] = old.entries[i];
+		idx.entries[idx.nentries++].image = htole32(t);
+	}
+
+	if (vmsfs_index_scan(&idx, targets, toscan, nscan, njobs) != 0)
+		errx(1, "%s: failed to scan images", indexfile);
+	if (vms_index_write(indexfile, &idx, targets, ntargets) != 0)
+		err(1, "%s", indexfile);
+
+	if (vms_output == VMS_OUTPUT_TEXT) {
+		printf("%u images (%u scanned, %u unchanged), %u files\n",
+		    ntargets, nscan, nkept, idx.nentries);
+	}
+
+	vms_index_close(&idx);
+	vms_index_close(&old);
+	free(toscan);
+	free(newof);
+	free(targets);
+	return 0;
+}
+
+struct vms_index_query {
+	const char *pattern;	/* name or glob */
+	const char *string;	/* in vms_name or rom_name */
+	const char *game;	/* in game_name */
+	int type;
+	long crc;		/* -1 if any */
+	uint64_t hash;
+	bool anyhash;
+	struct vms_timerange range;
+};
+
+static bool
+vms_index_match(const struct vms_index_query *q, const struct vms_index_entry *e)
+{
+	char name[DIR_NAMELEN + 1], buf[VMS_TEXTBUFSIZE];
+
+	if (q->type != 0 && e->type != q->type)
+		return false;
+	if (q->crc >= 0 && le16toh(e->crc) != q->crc)
+		return false;
+	if (!vms_timerange_match(&q->range, &e->timestamp))
+		return false;
+	if (!q->anyhash && le64toh(e->hash) != q->hash)
+		return false;
+	if (q->pattern != NULL) {
+		memcpy(name, e->name, DIR_NAMELEN);
+		name[DIR_NAMELEN] = '\0';
+		if (fnmatch(q->pattern, name, 0) != 0)
+			return false;
+	}
+	if (q->string != NULL &&
+	    strstr(strjpstr(buf, sizeof(buf), e->vms_name, sizeof(e->vms_name)), q->string) == NULL &&
+	    strstr(strjpstr(buf, sizeof(buf), e->rom_name, sizeof(e->rom_name)), q->string) == NULL &&
+	    memmem(e->vms_name, strnlen(e->vms_name, sizeof(e->vms_name)), q->string, strlen(q->string)) == NULL &&
+	    memmem(e->rom_name, strnlen(e->rom_name, sizeof(e->rom_name)), q->string, strlen(q->string)) == NULL)
+		return false;
+	if (q->game != NULL &&
+	    strstr(strgamestr(buf, sizeof(buf), e->game_name, sizeof(e->game_name)), q->game) == NULL)
+		return false;
+	return true;
+}
+
+static void
+vms_index_print(const struct vms_index *idx, const struct vms_index_entry *e)
+{
+	const struct vms_index_image *image;
+	char buf[VMS_TEXTBUFSIZE];
+
+	image = &idx->images[le32toh(e->image)];
+	if ((int32_t)le32toh(image->bank) < 0)
+		printf("%s: ", vms_index_path(idx, image));
+	else
+		printf("%s (bank %d): ", vms_index_path(idx, image),
+		    (int32_t)le32toh(image->bank));
+	printf("%s %s %3d blocks %.12s crc=0x%04x%s hash=%016llx\n",
+	    strbcdtimestamp(buf, sizeof(buf), &e->timestamp),
+	    (e->type == DIR_TYPE_GAME) ? "GAME" : "DATA", le16toh(e->size),
+	    e->name, le16toh(e->crc), e->crc_ok ? "" : "(bad)",
+	    (unsigned long long)le64toh(e->hash));
+}
+
+static int
+dcvmtool_cmd_index_query(const char *indexfile, struct vms_index_query *q)
+{
+	struct vms_index idx;
+	struct vms_index_entry key;
+	uint32_t lo, hi, mid, i, nfound;
+
+	if (vms_index_open(&idx, indexfile) != 0)
+		err(1, "%s", indexfile);
+
+	nfound = 0;
+	if (q->pattern != NULL && strpbrk(q->pattern, "*?[") == NULL) {
+		/* a longer name cannot be in the directory, as lookup does */
+		if (strlen(q->pattern) > DIR_NAMELEN) {
+			errno = ENOENT;
+			warn("%s", q->pattern);
+			vms_index_close(&idx);
+			return 1;
+		}
+
+		/* a name. binary search, as entries are sorted by name */
+		memset(&key, 0, sizeof(key));
+		memcpy(key.name, q->pattern, strnlen(q->pattern, sizeof(key.name)));
+		for (lo = 0, hi = idx.nentries; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (memcmp(idx.entries[mid].name, key.name, DIR_NAMELEN) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		q->pattern = NULL;
+		for (i = lo; i < idx.nentries &&
+		    memcmp(idx.entries[i].name, key.name, DIR_NAMELEN) == 0; i++) {
+			if (vms_index_match(q, &idx.entries[i])) {
+				vms_index_print(&idx, &idx.entries[i]);
+				nfound++;
+			}
+		}
+	} else {
+		for (i = 0; i < idx.nentries; i++) {
+			if (vms_index_match(q, &idx.entries[i])) {
+				vms_index_print(&idx, &idx.entries[i]);
+				nfound++;
+			}
+		}
+	}
+
+	vms_index_close(&idx);
+	return (nfound == 0) ? 1 : 0;
+}
+
+static int
+dcvmtool_cmd_index(int argc, char *argv[])
+{
+	struct vms_index_query q;
+	const char *subcmd, *indexfile;
+	char *ep, *p;
+	int ch, njobs;
+
+	if (argc < 1)
+		return dcvmtool_cmd_index_usage();
+	subcmd = argv[0];
+	argc--;
+	argv++;
+
+	memset(&q, 0, sizeof(q));
+	q.crc = -1;
+	q.anyhash = true;
+	indexfile = NULL;
+	njobs = 4;
+	while ((ch = getopt(argc, argv, "a:b:c:g:H:i:j:s:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+		case 'b':
+			if (vms_timerange_getopt(&q.range, ch, optarg) != 0)
+				return dcvmtool_cmd_index_usage();
+			break;
+		case 'c':
+			q.crc = strtol(optarg, &ep, 16);
+			if (*ep != '\0' || q.crc < 0 || q.crc > 0xffff)
+				return dcvmtool_cmd_index_usage();
+			break;
+		case 'g':
+			q.game = optarg;
+			break;
+		case 'H':
+			q.hash = strtoull(optarg, &ep, 16);
+			if (*ep != '\0')
+				return dcvmtool_cmd_index_usage();
+			q.anyhash = false;
+			break;
+		case 'i':
+			indexfile = optarg;
+			break;
+		case 'j':
+			njobs = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || njobs <= 0)
+				return dcvmtool_cmd_index_usage();
+			break;
+		case 's':
+			q.string = optarg;
+			break;
+		case 't':
+			if (strcasecmp(optarg, "data") == 0)
+				q.type = DIR_TYPE_DATA;
+			else if (strcasecmp(optarg, "game") == 0)
+				q.type = DIR_TYPE_GAME;
+			else
+				return dcvmtool_cmd_index_usage();
+			break;
+		default:
+			return dcvmtool_cmd_index_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (indexfile == NULL)
+		return dcvmtool_cmd_index_usage();
+
+	if (strcmp(subcmd, "build") == 0) {
+		if (argc == 0)
+			return dcvmtool_cmd_index_usage();
+		return dcvmtool_cmd_index_build(indexfile, njobs, argv, false);
+	} else if (strcmp(subcmd, "update") == 0) {
+		return dcvmtool_cmd_index_build(indexfile, njobs, argv, true);
+	} else if (strcmp(subcmd, "query") == 0) {
+		if (argc > 1)
+			return dcvmtool_cmd_index_usage();
+		if (argc == 1) {
+			/* names are upper case */
+			for (p = argv[0]; *p != '\0'; p++)
+				*p = (char)toupper(*p & 0xff);
+			q.pattern = argv[0];
 		}
+		return dcvmtool_cmd_index_query(indexfile, &q);
 	}
+	return dcvmtool_cmd_index_usage();
+}
 
-	printf("\n");
-
-	return nblk;
+static int
+dcvmtool_cmd_dupes_usage(void)
+{
+	fprintf(stderr, "usage: dcvmstools [-b bank|all] [-j njobs] -f image ... dupes\n");
+	fprintf(stderr, "       dcvmstools dupes -i index\n");
+	return EX_USAGE;
 }
 
 static int
-vmsfs_unlink(const char *file)
+vms_index_hashcmp(const void *a, const void *b)
 {
-	struct vmsfs_dirent *dp;
+	const struct vms_index_entry *x = a, *y = b;
 
-	dp = vms_dirent_lookup(file);
-	if (dp == NULL) {
-		errno = ENOENT;
-		return -1;
-	}
+	if (x->hash != y->hash)
+		return (le64toh(x->hash) > le64toh(y->hash)) ? 1 : -1;
+	if (x->size != y->size)
+		return (le16toh(x->size) > le16toh(y->size)) ? 1 : -1;
+	return vms_index_entrycmp(a, b);
+}
 
-	/* free fat */
-	int blk, nextblk;
-	for (blk = le16toh(dp->block); blk >= 0;
-	    blk = nextblk) {
-		nextblk = vms_nextblock(blk);
+/*
+ * group identical files of the images, by XXH64 and the size.
+ * the entries are read from the index, or the images are scanned as
+ * "index build" does. targets is NULL for an index.
+ */
+static int
+dcvmtool_cmd_dupes(const struct vms_target *targets, uint32_t ntargets,
+    int njobs, int argc, char *argv[])
+{
+	struct vms_index idx;
+	struct vms_index_entry *entries, *e;
+	const struct vms_index_image *image;
+	const char *indexfile, *path;
+	uint32_t *toscan, i, j, ngroups, nfiles;
+	int ch, bank;
+
+	indexfile = NULL;
+	while ((ch = getopt(argc, argv, "i:")) != -1) {
+		switch (ch) {
+		case 'i':
+			indexfile = optarg;
+			break;
+		default:
+			return dcvmtool_cmd_dupes_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-		if (blk > VMS_MAXBLOCKNO) {
-			errno = ENXIO;
-			fprintf(stderr, "illegal block number: %d\n", blk);
-			return -1;
+	if (argc != 0 || (indexfile == NULL && targets == NULL))
+		return dcvmtool_cmd_dupes_usage();
+
+	if (indexfile != NULL) {
+		if (vms_index_open(&idx, indexfile) != 0)
+			err(EX_NOINPUT, "%s", indexfile);
+		/* the mapping is read only */
+		entries = malloc((idx.nentries + 1) * sizeof(*entries));
+		if (entries == NULL)
+			err(EX_OSERR, "malloc");
+		memcpy(entries, idx.entries, idx.nentries * sizeof(*entries));
+		targets = NULL;
+	} else {
+		toscan = malloc((ntargets + 1) * sizeof(*toscan));
+		if (toscan == NULL)
+			err(EX_OSERR, "malloc");
+		for (i = 0; i < ntargets; i++)
+			toscan[i] = i;
+		memset(&idx, 0, sizeof(idx));
+		if (vmsfs_index_scan(&idx, targets, toscan, ntargets, njobs) != 0)
+			err(EX_SOFTWARE, "scan");
+		free(toscan);
+		for (i = 0; i < idx.nimages; i++) {
+			if (idx.images[i].error != 0) {
+				errno = (int)le32toh(idx.images[i].error);
+				warn("%s", targets[le32toh(idx.images[i].path)].filename);
+			}
 		}
-		vms_fatblk->block[blk] = htole16(BLOCK_UNALLOCATED);
+		entries = idx.entries;
 	}
 
-	/* erase the directory entry */
-	dp->type = DIR_TYPE_NONE;
-#if 0
-	dp->attr = 0;
-	dp->block = 0;
-	memset(dp->name, 0, sizeof(dp->name));
-	dp->size = 0;
-	dp->header_block_offset = 0;
-	memset(dp->reserved, 0, sizeof(dp->reserved));
-#endif
+	qsort(entries, idx.nentries, sizeof(*entries), vms_index_hashcmp);
 
-	vms_save_dir();
-	vms_save_fat();
+	ngroups = nfiles = 0;
+	for (i = 0; i < idx.nentries; i = j) {
+		for (j = i + 1; j < idx.nentries &&
+		    entries[i].hash == entries[j].hash &&
+		    entries[i].size == entries[j].size; j++)
+			;
+		/* the hash is 0 if the file cannot be read */
+		if (j - i < 2 || entries[i].hash == 0)
+			continue;
+
+		printf("%s%016llx %d blocks, %u copies\n", (ngroups == 0) ? "" : "\n",
+		    (unsigned long long)le64toh(entries[i].hash),
+		    le16toh(entries[i].size), j - i);
+		for (e = &entries[i]; e < &entries[j]; e++) {
+			if (targets != NULL) {
+				path = targets[le32toh(e->image)].filename;
+				bank = targets[le32toh(e->image)].bank;
+			} else {
+				image = &idx.images[le32toh(e->image)];
+				path = vms_index_path(&idx, image);
+				bank = (int32_t)le32toh(image->bank);
+			}
+			if (bank < 0)
+				printf("\t%s: %.12s\n", path, e->name);
+			else
+				printf("\t%s (bank %d): %.12s\n", path, bank, e->name);
+		}
+		ngroups++;
+		nfiles += j - i;
+	}
+	if (ngroups != 0)
+		printf("\n");
+	printf("%u files in %u groups of identical files\n", nfiles, ngroups);
 
+	if (indexfile != NULL)
+		free(entries);
+	vms_index_close(&idx);
 	return 0;
 }
 
-static char *
-vms_loadfile(const char *filename, size_t *sizep)
+static int
+dcvmtool_cmd_consolidate_usage(void)
 {
-	struct vmsfs_dirent *dp;
-	size_t size;
-	int rc, startblk, nblk;
-	char *buf0, *buf;
-
-	dp = vms_dirent_lookup(filename);
-	if (dp == NULL)
-		return NULL;
-
-	startblk = le16toh(dp->block);
-	nblk = le16toh(dp->size);
-	size = (size_t)nblk * VMS_BLOCKSIZE;
-	buf = buf0 = malloc(size);
-	if (buf == NULL)
-		return NULL;
+	fprintf(stderr, "usage: dcvmstools [-b bank|all] -f source ... consolidate [-dn] target ...\n");
+	fprintf(stderr, "\t-d	delete the copied files from the sources\n");
+	fprintf(stderr, "\t-n	print the plan only\n");
+	return EX_USAGE;
+}
 
-	rc = vms_read_blocks(buf, startblk, nblk);
-	if (rc != 0) {
-		free(buf);
-		return NULL;
-	}
+/*
+ * consolidation of files of many cards into the fewest target cards.
+ * files are packed by first fit decreasing. a GAME file must be
+ * contiguous from block 0, and a card can have only one, so GAME files
+ * are packed first. see vms_allocate_fat_dirent().
+ */
+struct vms_consfile {
+	struct vmsfs_dirent dirent;
+	int source;
+	int target;		/* -1 if does not fit */
+	char *buf;
+};
 
-	if (sizep != NULL)
-		*sizep = size;
+struct vms_constarget {
+	const char *filename;
+	int user_blocks;
+	int free_blocks;	/* in user area */
+	int game_blocks;	/* free from block 0, or 0 if GAME exists */
+	int free_dirents;
+	int nfiles;		/* files to be copied */
+	int nblocks;
+	char (*names)[DIR_NAMELEN];
+	int nnames;
+};
 
-	return buf0;
+static int
+vms_consfile_sizecmp(const void *a, const void *b)
+{
+	const struct vms_consfile *x = a, *y = b;
+
+	if (x->dirent.type != y->dirent.type)
+		return (x->dirent.type == DIR_TYPE_GAME) ? -1 : 1;
+	if (x->dirent.size != y->dirent.size)
+		return (le16toh(x->dirent.size) > le16toh(y->dirent.size)) ? -1 : 1;
+	if (x->source != y->source)
+		return x->source - y->source;
+	return memcmp(x->dirent.name, y->dirent.name, DIR_NAMELEN);
 }
 
 static int
-dcvmtool_cmd_dump(int argc, char *argv[])
+vms_consfile_targetcmp(const void *a, const void *b)
 {
-	int rc, ch, opt_x;
-
-	opt_x = 0;
-	while ((ch = getopt(argc, argv, "x")) != -1) {
-		switch (ch) {
-		case 'x':
-			opt_x++;
-			break;
-		default:
-			fprintf(stderr, "usage: dcvmtools dump [options]\n");
-			return EX_USAGE;
-		}
-	}
-	argc -= optind;
-	argv += optind;
-
-	rc = vms_load_dir();
-	if (rc != 0)
-		return EX_DATAERR;
-
-	if (opt_x)
-		xdump((const char *)vms_rootblk, VMS_BLOCKSIZE);
-
-	printf("color               = %d(%s), #%02X%02X%02X * %.1f%%\n",
-	    vms_rootblk->color,
-	    (vms_rootblk->color == 0) ? "Standard" : "Custom",
-	    vms_rootblk->color_blue,
-	    vms_rootblk->color_green,
-	    vms_rootblk->color_red,
-	    100.0 * vms_rootblk->color_alpha / 255);
+	const struct vms_consfile *x = a, *y = b;
 
-	printf("timestamp           = %s\n", strbcdtimestamp(&vms_rootblk->timestamp));
+	/* files which do not fit (-1) are the last */
+	if (x->target != y->target)
+		return (unsigned int)x->target > (unsigned int)y->target ? 1 : -1;
+	return vms_consfile_sizecmp(a, b);
+}
 
-	printf("fat_blockno         = %d\n", le16toh(vms_rootblk->fat_blockno));
-	printf("fat_nblocksize      = %d\n", le16toh(vms_rootblk->fat_nblocksize));
-	printf("directory_blockno   = %d\n", le16toh(vms_rootblk->directory_blockno));
-	printf("directory_blocksize = %d\n", le16toh(vms_rootblk->directory_blocksize));
-	printf("icon_block          = %d\n", le16toh(vms_rootblk->icon_block));
-	printf("user_blocks         = %d\n", le16toh(vms_rootblk->user_blocks));
+static int
+vms_consfile_sourcecmp(const void *a, const void *b)
+{
+	const struct vms_consfile *x = a, *y = b;
 
-	return 0;
+	if (x->source != y->source)
+		return x->source - y->source;
+	return vms_consfile_sizecmp(a, b);
 }
 
+/* read the free space and the names of the current image as a target */
 static int
-dcvmtool_cmd_fat(int argc, char *argv[])
+vmsfs_constarget_load(struct vms_constarget *t)
 {
 	VMSDIR *dirp;
 	struct vmsfs_dirent *dp;
-	int rc;
-	uint16_t fatno;
-	__BITMAP_TYPE(, uint32_t, VMS_NUM_BLOCKS) startfat;
+	int i, ndirents;
 
-	rc = vms_load_fat();
-	if (rc != 0)
-		return EX_DATAERR;
-
-	__BITMAP_ZERO(&startfat);
-
-	__BITMAP_SET(le16toh(vms_rootblk->fat_blockno), &startfat);
-	__BITMAP_SET(le16toh(vms_rootblk->directory_blockno), &startfat);
-	__BITMAP_SET(VMS_ROOTBLOCKNO, &startfat);
+	if ((dirp = vmsfs_opendir()) == NULL)
+		return -1;
 
-	if ((dirp = vmsfs_opendir()) != NULL) {
-		while ((dp = vmsfs_readdir(dirp)) != NULL) {
-			fatno = le16toh(dp->block);
-			if (fatno <= VMS_MAXBLOCKNO)
-				__BITMAP_SET(fatno, &startfat);
-		}
+	t->user_blocks = le16toh(vms_rootblk->user_blocks);
+	if (t->user_blocks > vms_nblocks)
+		t->user_blocks = vms_nblocks;
+	for (t->free_blocks = 0, i = 0; i < t->user_blocks; i++) {
+		if (le16toh(vms_fatblk->block[i]) == BLOCK_UNALLOCATED)
+			t->free_blocks++;
+	}
+	for (t->game_blocks = 0; t->game_blocks < t->user_blocks &&
+	    le16toh(vms_fatblk->block[t->game_blocks]) == BLOCK_UNALLOCATED;
+	    t->game_blocks++)
+		;
+
+	ndirents = VMSFS_DIR_NENTRIES_PER_BLOCK *
+	    le16toh(vms_rootblk->directory_blocksize);
+	t->names = calloc((size_t)ndirents, sizeof(*t->names));
+	if (t->names == NULL) {
 		vmsfs_closedir(dirp);
+		return -1;
+	}
+	while ((dp = vmsfs_readdir(dirp)) != NULL) {
+		if (dp->type == DIR_TYPE_GAME)
+			t->game_blocks = 0;
+		memcpy(t->names[t->nnames++], dp->name, DIR_NAMELEN);
 	}
+	vmsfs_closedir(dirp);
+	t->free_dirents = ndirents - t->nnames;
+	return 0;
+}
 
-	printf("SYS block: %d\n", VMS_ROOTBLOCKNO);
-	printf("FAT block: %d\n", le16toh(vms_rootblk->fat_blockno));
-	printf("DIR block: %d...\n", le16toh(vms_rootblk->directory_blockno));
-	printf("#\n");
-	printf("# '*' = beginning of chain\n");
-	printf("#\n");
-	printf(" FAT|   +0   +1   +2   +3   +4   +5   +6   +7   +8   +9\n");
-	printf("----+--------------------------------------------------\n");
-	for (int i = 0; i < 256; i++) {
-		char mark = __BITMAP_ISSET((unsigned int)i, &startfat) ? '*' : ' ';
+static bool
+vms_constarget_fits(const struct vms_constarget *t, const struct vms_consfile *f)
+{
+	int i, nblk;
+
+	nblk = le16toh(f->dirent.size);
+	if (t->free_dirents == 0 || t->free_blocks < nblk)
+		return false;
+	if (f->dirent.type == DIR_TYPE_GAME && t->game_blocks < nblk)
+		return false;
+	for (i = 0; i < t->nnames; i++) {
+		if (memcmp(t->names[i], f->dirent.name, DIR_NAMELEN) == 0)
+			return false;
+	}
+	return true;
+}
 
-		if ((i % 10) == 0)
-			printf("+%03d|", i);
+static void
+vms_constarget_add(struct vms_constarget *t, const struct vms_consfile *f)
+{
+	int nblk;
+
+	nblk = le16toh(f->dirent.size);
+	t->free_blocks -= nblk;
+	t->free_dirents--;
+	/* the only GAME file, or DATA files from the top of user area */
+	if (f->dirent.type == DIR_TYPE_GAME)
+		t->game_blocks = 0;
+	else if (t->game_blocks > t->free_blocks)
+		t->game_blocks = t->free_blocks;
+	memcpy(t->names[t->nnames++], f->dirent.name, DIR_NAMELEN);
+	t->nfiles++;
+	t->nblocks += nblk;
+}
 
-		fatno = le16toh(vms_fatblk->block[i]);
-		switch (fatno) {
-		case BLOCK_UNALLOCATED:
-			printf(" %c   ", mark);
-			break;
-		case BLOCK_LAST:
-			printf(" %cEND", mark);
-			break;
-		default:
-			printf(" %c%03d", mark, fatno);
-			break;
+/*
+ * copy the files planned for the target. the files are read from the
+ * sources first, and the FAT and directory of the target are written
+ * once after all the data blocks.
+ */
+static int
+vmsfs_consolidate_target(const struct vms_target *sources,
+    struct vms_constarget *t, struct vms_consfile *files, int nfiles)
+{
+	struct vmsfs_dirent *dp;
+	int i, source, startblk, rc;
+
+	for (source = -1, i = 0; i < nfiles; i++) {
+		if (files[i].source != source) {
+			source = files[i].source;
+			vms_bank = sources[source].bank;
+			if (vms_open(sources[source].filename, O_RDONLY) != 0 ||
+			    vms_load_fat() != 0)
+				return -1;
 		}
-
-		if ((i % 10) == 9)
-			printf("\n");
+		files[i].buf = vms_loadfile_dirent(&files[i].dirent, NULL);
+		if (files[i].buf == NULL)
+			return -1;
 	}
-	printf("\n");
-	printf("----+--------------------------------------------------\n");
-	printf("    |   +0   +1   +2   +3   +4   +5   +6   +7   +8   +9\n");
 
-	return 0;
+	vms_bank = -1;
+	if (vms_open(t->filename, O_RDWR) != 0 || vms_load_dir() != 0)
+		return -1;
+	for (rc = 0, i = 0; rc == 0 && i < nfiles; i++) {
+		if ((dp = vms_dirent_alloc()) == NULL ||
+		    (startblk = vms_allocate_fat_dirent(&files[i].dirent)) < 0) {
+			rc = -1;
+			break;
+		}
+		*dp = files[i].dirent;
+		dp->block = htole16((uint16_t)startblk);
+		VMS_STATS_BEGIN("save_file");
+		rc = vms_write_blocks(files[i].buf, startblk, le16toh(dp->size));
+		VMS_STATS_END();
+	}
+	if (rc == 0)
+		rc = vms_save_fat();
+	if (rc == 0)
+		rc = vms_save_dir();
+
+	for (i = 0; i < nfiles; i++) {
+		free(files[i].buf);
+		files[i].buf = NULL;
+	}
+	return rc;
 }
 
 static int
-dcvmtool_cmd_dir(int argc, char *argv[])
+dcvmtool_cmd_consolidate(const struct vms_target *sources, int nsources,
+    int argc, char *argv[])
 {
-	VMSDIR *dirp;
+	struct vms_consfile *files, *f;
+	struct vms_constarget *targets, *t;
 	struct vmsfs_dirent *dp;
-	int ch, nfiles, total_blksize, user_freeblks, opt_v;
+	VMSDIR *dirp;
+	char name[DIR_NAMELEN + 1];
+	int ch, opt_d, opt_n, i, j, k, s, ntargets, nfiles, nunfit, ntused, rc;
 
-	opt_v = 0;
-	while ((ch = getopt(argc, argv, "v")) != -1) {
+	opt_d = opt_n = 0;
+	while ((ch = getopt(argc, argv, "dn")) != -1) {
 		switch (ch) {
-		case 'v':
-			opt_v++;
+		case 'd':
+			opt_d++;
+			break;
+		case 'n':
+			opt_n++;
 			break;
 		default:
-			fprintf(stderr, "usage: dcvmtools dir [options]\n");
-			return EX_USAGE;
+			return dcvmtool_cmd_consolidate_usage();
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
-	dirp = vmsfs_opendir();
-	if (dirp == NULL)
-		return EX_DATAERR;;
-
-	nfiles = total_blksize = 0;
-	while ((dp = vmsfs_readdir(dirp)) != NULL) {
-		total_blksize += vms_dirent_print(dp, opt_v);
-		nfiles++;
+	if (argc < 1)
+		return dcvmtool_cmd_consolidate_usage();
+
+	ntargets = argc;
+	targets = calloc((size_t)ntargets, sizeof(*targets));
+	if (targets == NULL)
+		err(EX_OSERR, "calloc");
+	for (i = 0; i < ntargets; i++) {
+		targets[i].filename = argv[i];
+		vms_bank = -1;
+		if (vms_open(argv[i], O_RDONLY) != 0 ||
+		    vmsfs_constarget_load(&targets[i]) != 0)
+			err(EX_NOINPUT, "%s", argv[i]);
 	}
-	vmsfs_closedir(dirp);
 
+	/* the files of a source which is also a target stay there */
+	files = NULL;
+	nfiles = 0;
+	for (s = 0; s < nsources; s++) {
+		for (i = 0; i < ntargets; i++) {
+			if (sources[s].bank <= 0 &&
+			    strcmp(sources[s].filename, targets[i].filename) == 0)
+				break;
+		}
+		if (i < ntargets)
+			continue;
 
-	user_freeblks = le16toh(vms_rootblk->user_blocks) - total_blksize;
-	printf("                       %3d file%s %3d/%3d user blocks used\n",
-	    nfiles, (nfiles <= 1) ? ", " : "s,",
-	    total_blksize, le16toh(vms_rootblk->user_blocks));
-	printf("                  %3d user blocks + %3d system blocks free\n",
-	    user_freeblks,
-	    vms_getfreeblock() - user_freeblks);
+		vms_bank = sources[s].bank;
+		if (vms_open(sources[s].filename, O_RDONLY) != 0 ||
+		    (dirp = vmsfs_opendir()) == NULL)
+			err(EX_NOINPUT, "%s", sources[s].filename);
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			if (dp->attr == DIR_ATTR_PROHIBIT) {
+				printf("%s: %.12s: copy prohibited, not moved\n",
+				    sources[s].filename, dp->name);
+				continue;
+			}
+			f = realloc(files, (size_t)(nfiles + 1) * sizeof(*files));
+			if (f == NULL)
+				err(EX_OSERR, "realloc");
+			files = f;
+			memset(&files[nfiles], 0, sizeof(files[nfiles]));
+			files[nfiles].dirent = *dp;
+			files[nfiles].source = s;
+			nfiles++;
+		}
+		vmsfs_closedir(dirp);
+	}
 
-	return 0;
-}
+	/* first fit decreasing */
+	qsort(files, (size_t)nfiles, sizeof(*files), vms_consfile_sizecmp);
+	for (nunfit = 0, i = 0; i < nfiles; i++) {
+		files[i].target = -1;
+		for (j = 0; j < ntargets; j++) {
+			if (vms_constarget_fits(&targets[j], &files[i])) {
+				vms_constarget_add(&targets[j], &files[i]);
+				files[i].target = j;
+				break;
+			}
+		}
+		if (files[i].target < 0)
+			nunfit++;
+	}
 
-static int
-dcvmtool_cmd_cat(int argc, char *argv[])
-{
-	size_t size;
-	int i, anyerror;
-	char *buf;
+	/* the plan */
+	qsort(files, (size_t)nfiles, sizeof(*files), vms_consfile_targetcmp);
+	for (ntused = 0, i = 0; i < nfiles; i = j) {
+		for (j = i; j < nfiles && files[j].target == files[i].target; j++)
+			;
+		if (files[i].target < 0) {
+			printf("%sdoes not fit:\n", (ntused == 0) ? "" : "\n");
+		} else {
+			t = &targets[files[i].target];
+			printf("%s%s: %d files, %d blocks, %d/%d user blocks free after\n",
+			    (ntused++ == 0) ? "" : "\n", t->filename, t->nfiles,
+			    t->nblocks, t->free_blocks, t->user_blocks);
+		}
+		for (k = i; k < j; k++) {
+			f = &files[k];
+			if (sources[f->source].bank < 0)
+				printf("\t%s: ", sources[f->source].filename);
+			else
+				printf("\t%s (bank %d): ", sources[f->source].filename,
+				    sources[f->source].bank);
+			printf("%.12s %s %3d block%s\n", f->dirent.name,
+			    (f->dirent.type == DIR_TYPE_GAME) ? "GAME" : "DATA",
+			    le16toh(f->dirent.size),
+			    (le16toh(f->dirent.size) == 1) ? "" : "s");
+		}
+	}
+	printf("%s%d files into %d of %d targets, %d files do not fit\n",
+	    (nfiles == 0) ? "" : "\n", nfiles - nunfit, ntused, ntargets, nunfit);
 
-	anyerror = 0;
-	for (i = 0; i < argc; i++) {
-		buf = vms_loadfile(argv[i], &size);
-		if (buf == NULL) {
-			warn("%s", argv[i]);
-			anyerror = 1;
-			continue;
+	if (opt_n)
+		return 0;
+	if (nunfit > 0)
+		errx(1, "%d files do not fit, nothing is copied", nunfit);
+
+	/* one commit per target */
+	rc = 0;
+	for (i = 0; i < nfiles; i = j) {
+		for (j = i; j < nfiles && files[j].target == files[i].target; j++)
+			;
+		qsort(&files[i], (size_t)(j - i), sizeof(*files),
+		    vms_consfile_sourcecmp);
+		if (vmsfs_consolidate_target(sources, &targets[files[i].target],
+		    &files[i], j - i) != 0)
+			err(1, "%s", targets[files[i].target].filename);
+	}
+
+	/* the sources are changed only after all the targets are written */
+	if (opt_d) {
+		qsort(files, (size_t)nfiles, sizeof(*files), vms_consfile_sourcecmp);
+		for (s = -1, i = 0; i < nfiles; i++) {
+			if (files[i].source != s) {
+				s = files[i].source;
+				vms_bank = sources[s].bank;
+				if (vms_open(sources[s].filename, O_RDWR) != 0) {
+					warn("%s", sources[s].filename);
+					rc = 1;
+					continue;
+				}
+			}
+			memcpy(name, files[i].dirent.name, DIR_NAMELEN);
+			name[DIR_NAMELEN] = '\0';
+			if (vmsfs_unlink(name) != 0) {
+				warn("%s: %s", sources[s].filename, name);
+				rc = 1;
+			}
 		}
-		fwrite(buf, size, 1, stdout);
-		free(buf);
 	}
 
-	return anyerror;
+	for (i = 0; i < ntargets; i++)
+		free(targets[i].names);
+	free(targets);
+	free(files);
+	return rc;
 }
 
 static int
-dcvmtool_cmd_show_usage(void)
+dcvmtool_cmd_bench_device_usage(void)
 {
-	fprintf(stderr, "usage: dcvmtools show [-v] file\n");
+	fprintf(stderr, "usage: dcvmtools bench-device [-wy] [-n passes]\n");
+	fprintf(stderr, "\t-n passes	read (and write) every block passes times\n");
+	fprintf(stderr, "\t-w		also measure write latency, by writing back the same data\n");
+	fprintf(stderr, "\t-y		allow -w on a device, not only on an image file\n");
 	return EX_USAGE;
 }
 
 static int
-dcvmtool_cmd_show(int argc, char *argv[])
+bench_cmp(const void *a, const void *b)
 {
-	struct vmsfile_header *header;
-	size_t size;
-	int ch, opt_v;
-	char *buf;
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-	opt_v = 0;
-	while ((ch = getopt(argc, argv, "v")) != -1) {
+	return (x < y) ? -1 : (x > y);
+}
+
+/* latency histogram in log2(usec) buckets */
+static void
+bench_histogram(const char *what, const uint64_t *sorted, int n)
+{
+	int bucket[24], i, b, max;
+	uint64_t us;
+
+	memset(bucket, 0, sizeof(bucket));
+	for (i = 0; i < n; i++) {
+		us = sorted[i] / 1000;
+		for (b = 0; us > 0 && b < (int)__arraycount(bucket) - 1; b++)
+			us >>= 1;
+		bucket[b]++;
+	}
+	for (max = 1, b = 0; b < (int)__arraycount(bucket); b++) {
+		if (bucket[b] > max)
+			max = bucket[b];
+	}
+
+	printf("%s latency (usec):\n", what);
+	for (b = 0; b < (int)__arraycount(bucket); b++) {
+		if (bucket[b] == 0)
+			continue;
+		printf("  %7d -%7d: %6d |%.*s\n",
+		    (b == 0) ? 0 : (1 << (b - 1)), (1 << b) - 1, bucket[b],
+		    (bucket[b] * 50 + max - 1) / max,
+		    "##################################################");
+	}
+	printf("  p50 %.1f usec, p99 %.1f usec, max %.1f usec\n",
+	    (double)sorted[n / 2] / 1e3, (double)sorted[n * 99 / 100] / 1e3,
+	    (double)sorted[n - 1] / 1e3);
+}
+
+/* per block latency, laid out as "fat" command does */
+static void
+bench_heatmap(const char *what, const uint64_t *lat, int nblocks)
+{
+	uint64_t us;
+	int i;
+
+	printf("%s latency per block (usec):\n", what);
+	printf(" BLK|   +0   +1   +2   +3   +4   +5   +6   +7   +8   +9\n");
+	printf("----+--------------------------------------------------\n");
+	for (i = 0; i < nblocks; i++) {
+		if ((i % 10) == 0)
+			printf("+%03d|", i);
+		us = lat[i] / 1000;
+		if (us < 10000)
+			printf(" %4llu", (unsigned long long)us);
+		else if (us < 1000000)
+			printf(" %3llum", (unsigned long long)(us / 1000));
+		else
+			printf(" ****");
+		if ((i % 10) == 9)
+			printf("\n");
+	}
+	printf("\n");
+	printf("----+--------------------------------------------------\n");
+	printf("    |   +0   +1   +2   +3   +4   +5   +6   +7   +8   +9\n");
+}
+
+static int
+dcvmtool_cmd_bench_device(int argc, char *argv[])
+{
+	struct stat st;
+	uint64_t *samples[2], *lat[2], total[2], t0;
+	char buf[VMS_BLOCKSIZE], *ep;
+	const char *what[2] = { "read", "write" };
+	off_t off;
+	int ch, opt_w, opt_y, npass, pass, blk, n, i, nmode;
+
+	npass = 1;
+	opt_w = opt_y = 0;
+	while ((ch = getopt(argc, argv, "n:wy")) != -1) {
 		switch (ch) {
-		case 'v':
-			opt_v++;
+		case 'n':
+			npass = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || npass <= 0)
+				return dcvmtool_cmd_bench_device_usage();
+			break;
+		case 'w':
+			opt_w++;
+			break;
+		case 'y':
+			opt_y++;
 			break;
 		default:
-			return dcvmtool_cmd_show_usage();
+			return dcvmtool_cmd_bench_device_usage();
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
-		return dcvmtool_cmd_show_usage();
-
-	buf = vms_loadfile(argv[0], &size);
-	if (buf == NULL)
-		errx(1, "%s", argv[0]);
-
-	printf("size         = %d bytes (%d blocks)\n", (int)size, (int)size / VMS_BLOCKSIZE);
+	if (argc != 0)
+		return dcvmtool_cmd_bench_device_usage();
+
+	if (fstat(vms_fd, &st) != 0)
+		err(1, "%s", vms_filename);
+	if (opt_w && !S_ISREG(st.st_mode) && !opt_y)
+		errx(EX_USAGE, "%s: not an image file, -y is required to write", vms_filename);
+
+	/* the card size is known from the FAT layout in the root block */
+	if (vms_load_fat() != 0)
+		warn("%s: measuring %d blocks", vms_filename, vms_nblocks);
+
+	nmode = opt_w ? 2 : 1;
+	n = npass * vms_nblocks;
+	samples[0] = calloc((size_t)n, sizeof(uint64_t));
+	samples[1] = calloc((size_t)n, sizeof(uint64_t));
+	lat[0] = calloc((size_t)vms_nblocks, sizeof(uint64_t));
+	lat[1] = calloc((size_t)vms_nblocks, sizeof(uint64_t));
+	if (samples[0] == NULL || samples[1] == NULL ||
+	    lat[0] == NULL || lat[1] == NULL)
+		err(EX_OSERR, "calloc");
+	memset(total, 0, sizeof(total));
+
+	for (pass = 0; pass < npass; pass++) {
+		for (blk = 0; blk < vms_nblocks; blk++) {
+			off = (off_t)blk * VMS_BLOCKSIZE;
+			i = pass * vms_nblocks + blk;
+
+			t0 = vms_clock(CLOCK_MONOTONIC);
+			if (pread(vms_fd, buf, sizeof(buf), vms_bankoff + off) != (ssize_t)sizeof(buf))
+				err(EX_IOERR, "%s: read block %d", vms_filename, blk);
+			samples[0][i] = vms_clock(CLOCK_MONOTONIC) - t0;
+
+			if (opt_w) {
+				/* write back the same data, and wait for the device */
+				t0 = vms_clock(CLOCK_MONOTONIC);
+				if (pwrite(vms_fd, buf, sizeof(buf), vms_bankoff + off) !=
+				    (ssize_t)sizeof(buf) ||
+				    fsync(vms_fd) != 0)
+					err(EX_IOERR, "%s: write block %d", vms_filename, blk);
+				samples[1][i] = vms_clock(CLOCK_MONOTONIC) - t0;
+			}
+		}
+	}
 
-	header = (struct vmsfile_header *)buf;
-	printf("vms_name     = <%s>\n", strjpstr(header->vms_name, 16));
-	printf("rom_name     = <%s>\n", strjpstr(header->rom_name, 32));
-	printf("game_name    = <%s>\n", strgamestr(header->game_name, 16));
+	for (i = 0; i < nmode; i++) {
+		for (pass = 0; pass < npass; pass++) {
+			for (blk = 0; blk < vms_nblocks; blk++) {
+				lat[i][blk] += samples[i][pass * vms_nblocks + blk] /
+				    (uint64_t)npass;
+				total[i] += samples[i][pass * vms_nblocks + blk];
+			}
+		}
+		qsort(samples[i], (size_t)n, sizeof(uint64_t), bench_cmp);
+	}
 
-	printf("icon num    = %d\n", le16toh(header->icon_num));
-	printf("icon speed  = %d\n", le16toh(header->icon_speed));
-	printf("type        = %d\n", le16toh(header->type));
-	printf("crc         = 0x%04x\n", le16toh(header->crc));
-	printf("datasize    = %d\n", le32toh(header->datasize));
+	if (vms_output != VMS_OUTPUT_TEXT) {
+		out_record_begin();
+		out_int("passes", npass);
+		for (i = 0; i < nmode; i++) {
+			out_object_begin(what[i]);
+			out_int("p50_ns", (long long)samples[i][n / 2]);
+			out_int("p99_ns", (long long)samples[i][n * 99 / 100]);
+			out_int("max_ns", (long long)samples[i][n - 1]);
+			out_int("bytes_per_sec", (long long)((double)n * VMS_BLOCKSIZE /
+			    ((double)total[i] / 1e9)));
+			out_object_end();
+		}
+		out_array_begin("blocks");
+		for (blk = 0; blk < vms_nblocks; blk++) {
+			out_row_begin(NULL);
+			out_int("block", blk);
+			out_int("read_ns", (long long)lat[0][blk]);
+			if (opt_w)
+				out_int("write_ns", (long long)lat[1][blk]);
+			out_row_end();
+		}
+		out_array_end();
+		out_record_end();
+	} else {
+		for (i = 0; i < nmode; i++) {
+			bench_histogram(what[i], samples[i], n);
+			printf("  %d blocks in %.3f msec, %.1f KB/sec\n", n,
+			    (double)total[i] / 1e6,
+			    (double)n * VMS_BLOCKSIZE / 1024 / ((double)total[i] / 1e9));
+			printf("\n");
+			bench_heatmap(what[i], lat[i], vms_nblocks);
+			if (i + 1 < nmode)
+				printf("\n");
+		}
+	}
 
-	free(buf);
+	free(samples[0]);
+	free(samples[1]);
+	free(lat[0]);
+	free(lat[1]);
 	return 0;
 }
 
-static int
-vmsfs_unixtime2bcdtimestamp(struct timestamp *timestamp, time_t mtime)
+#ifdef VMS_BENCH
+/*
+ * synthetic images and microbenchmarks. only in the "bench" build
+ * (bench/Makefile, -DVMS_BENCH), not in dcvmstools itself.
+ *
+ * images are made from a seed by our own PRNG, so that the same
+ * parameters make the same image on any host.
+ */
+struct vms_genimage {
+	uint32_t seed;
+	int nfiles;		/* number of DATA files */
+	int fill;		/* used user blocks in percent */
+	int frag;		/* probability of a non-sequential block in percent */
+	int gameblk;		/* size of GAME file in blocks, 0 if none */
+};
+
+static uint32_t vms_genimage_rand_state;
+
+/* 2000-01-01 00:00:00 Sat, not depending on the timezone of host */
+static const struct timestamp vms_genimage_timestamp = {
+	{ 0x20, 0x00, 0x01, 0x01, 0x00, 0x00, 0x00, 0x05 }
+};
+
+static uint32_t
+vms_genimage_rand(void)
 {
-	struct tm *tm;
-#define DEC2BCD(d)	((uint8_t)((((d) / 10) << 4) | ((d) % 10)))
+	uint32_t x = vms_genimage_rand_state;
 
-	tm = localtime(&mtime);
-	timestamp->bcd[0] = DEC2BCD((tm->tm_year + 1900) / 100);
-	timestamp->bcd[1] = DEC2BCD(tm->tm_year % 100);
-	timestamp->bcd[2] = DEC2BCD(tm->tm_mon + 1);
-	timestamp->bcd[3] = DEC2BCD(tm->tm_mday);
-	timestamp->bcd[4] = DEC2BCD(tm->tm_hour);
-	timestamp->bcd[5] = DEC2BCD(tm->tm_min);
-	timestamp->bcd[6] = DEC2BCD(tm->tm_sec);
-	return 0;
+	/* xorshift32 */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return vms_genimage_rand_state = x;
 }
 
-/* bcdtimestamp will be always treated as localtime */
-static time_t
-vmsfs_bcdtimestamp2unixtime(struct timestamp *timestamp)
+static void
+vms_genimage_fill(char *buf, size_t size)
 {
-	struct tm *tm;
-	time_t t = 0;
-#define BCD2DEC(b)	((((b) >> 4) * 10) + ((b) & 0x0f))
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (char)(vms_genimage_rand() >> 24);
+}
 
-	tm = localtime(&t);
-	tm->tm_year = BCD2DEC(timestamp->bcd[0]) * 100 +  BCD2DEC(timestamp->bcd[1]) - 1900;
-	tm->tm_mon = BCD2DEC(timestamp->bcd[2]) - 1;
-	tm->tm_mday = BCD2DEC(timestamp->bcd[3]);
-	tm->tm_hour = BCD2DEC(timestamp->bcd[4]);
-	tm->tm_min = BCD2DEC(timestamp->bcd[5]);
-	tm->tm_sec = BCD2DEC(timestamp->bcd[6]);
+/* make a file with a valid header and CRC, the header is at block hdrblk */
+static void
+vms_genimage_file(char *buf, int nblk, int hdrblk, const char *name)
+{
+	struct vmsfile_header *header;
+	size_t size;
 
-	return timelocal(tm);
+	size = (size_t)(nblk - hdrblk) * VMS_BLOCKSIZE;
+	vms_genimage_fill(buf, (size_t)nblk * VMS_BLOCKSIZE);
+
+	header = (struct vmsfile_header *)(buf + hdrblk * VMS_BLOCKSIZE);
+	memset(header, 0, sizeof(*header));
+	snprintf(header->vms_name, sizeof(header->vms_name), "%.12s", name);
+	snprintf(header->rom_name, sizeof(header->rom_name), "dcvmstools bench");
+	header->icon_num = htole16((uint16_t)((size > VMS_BLOCKSIZE) ? 1 : 0));
+	header->icon_speed = htole16(8);
+	header->type = htole16(0);
+	header->datasize = htole32((uint32_t)(size - sizeof(*header) -
+	    le16toh(header->icon_num) * sizeof(struct vmsfile_icon)));
+	header->crc = htole16(vmsfile_crc((char *)header,
+	    vmsfile_length(header, size)));
 }
 
-static int
-dcvmtool_cmd_get_usage(void)
+static void
+vms_genimage_dirent(struct vmsfs_dirent *dp, int type, int startblk, int nblk,
+    const char *name)
 {
-	fprintf(stderr, "usage: dcvmtools get [-v] file [...]\n");
-	return EX_USAGE;
+	memset(dp, 0, sizeof(*dp));
+	dp->type = (uint8_t)type;
+	dp->attr = DIR_ATTR_COPIABLE;
+	dp->block = htole16((uint16_t)startblk);
+	vmsfs_regular_name(dp->name, name);
+	dp->timestamp = vms_genimage_timestamp;
+	dp->size = htole16((uint16_t)nblk);
+	dp->header_block_offset = htole16((uint16_t)((type == DIR_TYPE_GAME) ? 1 : 0));
 }
 
+/*
+ * write a synthetic image to vms_fd. the GAME file is contiguous from
+ * block 0, and DATA files are allocated from the top of user area.
+ * with frag, each block is taken from a random free block instead of
+ * the next one by that probability.
+ */
 static int
-dcvmtool_cmd_get(int argc, char *argv[])
+vmsfs_genimage(const struct vms_genimage *param)
 {
-	VMSDIR *dirp;
-	FILE *fh;
-	struct vmsfs_dirent *dp;
-	size_t size;
-	int i, ch, opt_v;
-	const char *pattern;
-	char *buf;
-	int anyerror = 0;
-
-	opt_v = 0;
-	while ((ch = getopt(argc, argv, "v")) != -1) {
-		switch (ch) {
-		case 'v':
-			opt_v++;
-			break;
-		default:
-			return dcvmtool_cmd_get_usage();
-		}
+	char name[32], *buf;
+	uint8_t freeblk[VMS_USERBLOCKS];
+	int *size, nfree, ndata, i, j, k, blk, prev, rc;
+
+	ndata = VMS_USERBLOCKS * param->fill / 100 - param->gameblk;
+	if (param->gameblk < 0 || param->gameblk > VMS_USERBLOCKS || param->fill > 100 ||
+	    param->nfiles < 0 || param->nfiles > VMSFS_DIR_NENTRIES_PER_BLOCK *
+	    VMS_DIRBLOCKSIZE - 1 || ndata < param->nfiles ||
+	    (param->nfiles == 0 && ndata > 0)) {
+		errno = EINVAL;
+		return -1;
 	}
-	argc -= optind;
-	argv += optind;
 
-	for (i = 0; i < argc; i++) {
-		pattern = argv[i];
+	if (vmsfs_newfs(&vms_genimage_timestamp) != 0)
+		return -1;
 
-		dirp = vmsfs_opendir();
-		if (dirp == NULL)
-			return EX_DATAERR;;
+	size = calloc((size_t)param->nfiles + 1, sizeof(*size));
+	buf = malloc(VMS_USERBLOCKS * VMS_BLOCKSIZE);
+	if (size == NULL || buf == NULL) {
+		free(size);
+		free(buf);
+		return -1;
+	}
 
-		while ((dp = vmsfs_readdir(dirp)) != NULL) {
-			char name[DIR_NAMELEN + 1];
-			memcpy(name, dp->name, DIR_NAMELEN);
-			name[DIR_NAMELEN] = '\0';
+	vms_genimage_rand_state = (param->seed == 0) ? 1 : param->seed;
 
-			if (fnmatch(pattern, name, FNM_CASEFOLD) == 0) {
-				buf = vms_loadfile(name, &size);
-				if (buf == NULL) {
-					warn("%s", name);
-					anyerror = 1;
-					continue;
-				}
+	k = 0;
+	if (param->gameblk > 0) {
+		for (i = 0; i < param->gameblk - 1; i++)
+			vms_fatblk->block[i] = htole16((uint16_t)(i + 1));
+		vms_fatblk->block[i] = htole16(BLOCK_LAST);
+		vms_genimage_dirent(&vms_dirblk->entries[k++], DIR_TYPE_GAME,
+		    0, param->gameblk, "GAMEFILE.VMS");
+	}
 
-				if (opt_v)
-					printf("%s\n", name);
+	/* every file has one block at least, and the rest are spread randomly */
+	for (i = 0; i < param->nfiles; i++)
+		size[i] = 1;
+	for (i = param->nfiles; i < ndata; i++)
+		size[vms_genimage_rand() % (uint32_t)param->nfiles]++;
+
+	for (nfree = 0, blk = VMS_USERBLOCKS - 1; blk >= param->gameblk; blk--)
+		freeblk[nfree++] = (uint8_t)blk;
+
+	for (i = 0; i < param->nfiles; i++) {
+		struct vmsfs_dirent *dp = &vms_dirblk->entries[k++];
+
+		for (prev = -1, j = 0; j < size[i]; j++) {
+			int n = 0;
+			if ((int)(vms_genimage_rand() % 100) < param->frag)
+				n = (int)(vms_genimage_rand() % (uint32_t)nfree);
+			blk = freeblk[n];
+			memmove(&freeblk[n], &freeblk[n + 1], (size_t)(--nfree - n));
+
+			if (prev < 0)
+				dp->block = htole16((uint16_t)blk);
+			else
+				vms_fatblk->block[prev] = htole16((uint16_t)blk);
+			prev = blk;
+		}
+		vms_fatblk->block[prev] = htole16(BLOCK_LAST);
 
-				fh = fopen(name, "wb");
-				if (fh == NULL) {
-					warn("%s", name);
-					anyerror = 1;
-					continue;
-				}
-				fwrite(buf, size, 1, fh);
-				fclose(fh);
+		snprintf(name, sizeof(name), "FILE%08d", i);
+		vms_genimage_dirent(dp, DIR_TYPE_DATA, le16toh(dp->block),
+		    size[i], name);
+	}
 
-				free(buf);
+	/* write the contents of files along the chains */
+	rc = 0;
+	for (i = 0; rc == 0 && i < k; i++) {
+		struct vmsfs_dirent *dp = &vms_dirblk->entries[i];
 
-				/* keep timestamp */
-				struct timeval tv[2];
-				memset(tv, 0, sizeof(tv));
-				tv[0].tv_sec = vmsfs_bcdtimestamp2unixtime(&dp->timestamp);
-				tv[1] = tv[0];
-				utimes(name, tv);
-			}
-		}
-		vmsfs_closedir(dirp);
+		vms_genimage_file(buf, le16toh(dp->size),
+		    le16toh(dp->header_block_offset), dp->name);
+		rc = vms_write_blocks(buf, le16toh(dp->block), le16toh(dp->size));
 	}
+	if (rc == 0)
+		rc = vms_save_dir();
+	if (rc == 0)
+		rc = vms_save_fat();
+	if (rc == 0)
+		rc = vms_save_root();
 
-	return anyerror;
+	free(buf);
+	free(size);
+	return rc;
 }
 
 static int
-dcvmtool_cmd_del_usage(void)
+vms_genimage_getopt(struct vms_genimage *param, int ch, const char *arg)
 {
-	fprintf(stderr, "usage: dcvmtools del [options] file\n");
+	char *ep;
+	long val;
+
+	val = strtol(arg, &ep, 0);
+	if (*ep != '\0' || val < 0 || val > UINT32_MAX)
+		return -1;
+
+	switch (ch) {
+	case 's':
+		param->seed = (uint32_t)val;
+		break;
+	case 'n':
+		param->nfiles = (int)val;
+		break;
+	case 'u':
+		param->fill = (int)val;
+		break;
+	case 'F':
+		param->frag = (int)val;
+		break;
+	case 'g':
+		param->gameblk = (int)val;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+static int
+dcvmtool_cmd_genimage_usage(void)
+{
+	fprintf(stderr, "usage: vmsbench -f image genimage [-F frag] [-g gameblocks] [-n nfiles]\n"
+	    "\t[-s seed] [-u fill]\n");
+	fprintf(stderr, "\t-F frag		percentage of blocks not following the previous one\n");
+	fprintf(stderr, "\t-g gameblocks	size of GAME file (default: 0, none)\n");
+	fprintf(stderr, "\t-n nfiles	number of DATA files (default: 10)\n");
+	fprintf(stderr, "\t-s seed		seed of the contents (default: 1)\n");
+	fprintf(stderr, "\t-u fill		percentage of used user blocks (default: 80)\n");
 	return EX_USAGE;
 }
 
 static int
-dcvmtool_cmd_del(int argc, char *argv[])
+dcvmtool_cmd_genimage(int argc, char *argv[])
 {
-	char *filename;
-	int rc, ch, opt_v;
+	struct vms_genimage param = { 1, 10, 80, 0, 0 };
+	int ch;
 
-	opt_v = 0;
-	while ((ch = getopt(argc, argv, "v")) != -1) {
-		switch (ch) {
-		case 'v':
-			opt_v++;
-			break;
-		default:
-			return dcvmtool_cmd_del_usage();
-		}
+	while ((ch = getopt(argc, argv, "F:g:n:s:u:")) != -1) {
+		if (vms_genimage_getopt(&param, ch, optarg) != 0)
+			return dcvmtool_cmd_genimage_usage();
 	}
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
-		return dcvmtool_cmd_del_usage();
+	if (argc != 0)
+		return dcvmtool_cmd_genimage_usage();
 
-	filename = argv[0];
-	rc = vmsfs_unlink(filename);
-	if (rc != 0)
-		err(1, "del: %s", filename);
+	/* never overwrite a device with a synthetic image */
+	if (vms_image_create() != 0 || vmsfs_genimage(&param) != 0)
+		err(1, "%s", vms_filename);
 
 	return 0;
 }
 
-static int
-dcvmtool_cmd_put_usage(void)
+/*
+ * microbenchmarks. each benchmark is run on a fresh synthetic image in
+ * the scratch image (-f), with the number of iterations doubled until it
+ * takes the minimum time. the result is one line per benchmark in a
+ * fixed order, in the format of "go test -bench", so two runs can be
+ * compared by diff(1) or benchstat.
+ */
+struct vms_bench {
+	const char *name;
+	struct vms_genimage image;
+	void (*func)(int);
+	void (*setup)(void);
+	void (*teardown)(void);
+};
+
+#define VMS_BENCH_NIMAGES	8
+static char *vms_bench_scratch;
+static volatile int vms_bench_sink;
+
+static void
+vms_bench_alloc(int n)
 {
-	fprintf(stderr, "usage: dcvmtools put [options] file\n");
-	return EX_USAGE;
+	struct vmsfs_fat fat;
+	int i;
+
+	memcpy(&fat, vms_fatblk, vms_nblocks * sizeof(uint16_t));
+	for (i = 0; i < n; i++) {
+		vms_bench_sink += vms_allocate_fat(16);
+		memcpy(vms_fatblk, &fat, vms_nblocks * sizeof(uint16_t));
+	}
 }
 
-static int
-vmsfs_regular_name(char vmsname[DIR_NAMELEN], const char *filename)
+static void
+vms_bench_lookup_hit(int n)
 {
-	/* const char valid_character[] = ".0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_"; */
-	int i, ch;
-
-	for (i = 0; i < DIR_NAMELEN; i++) {
-		ch = toupper(filename[i] & 0xff);
-		if (ch == '\0') {
-			memset(&vmsname[i], '_', (size_t)(DIR_NAMELEN - i));
-			break;
-		}
+	char name[DIR_NAMELEN + 1];
+	int i;
 
-		if (!isalnum(ch) && ch != '_' && ch != '.')
-			ch = '_';
-		vmsname[i] = (char)ch;
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "FILE%08d", i % 100);
+		vms_bench_sink += (vms_dirent_lookup(name) != NULL);
 	}
+}
 
-	return 0;
+static void
+vms_bench_lookup_miss(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		vms_bench_sink += (vms_dirent_lookup("NOSUCHFILE__") != NULL);
 }
 
-static struct vmsfs_dirent *
-vmsfs_writefile(const char *filename, char *buf, size_t size, time_t mtime)
+static void
+vms_bench_chain(int n)
 {
+	VMSDIR *dirp;
 	struct vmsfs_dirent *dp;
-	size_t len, nblk;
-	int rc, startblk;
+	int i, blk;
 
-	len = strlen(filename);
-	if (len > DIR_NAMELEN) {
-		errno = ENAMETOOLONG;
-		return NULL;
+	for (i = 0; i < n; i++) {
+		dirp = vmsfs_opendir();
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			for (blk = le16toh(dp->block); blk >= 0; blk = vms_nextblock(blk))
+				vms_bench_sink++;
+		}
+		vmsfs_closedir(dirp);
 	}
+}
 
-	if (size == 0) {
-		errno = EINVAL;
-		return NULL;
-	}
-	nblk = (size + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE;
-	if (nblk > VMS_MAXBLOCKNO) {
-		errno = ENOSPC;
-		return NULL;
+static void
+vms_bench_extract(int n)
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	char *buf;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		dirp = vmsfs_opendir();
+		while ((dp = vmsfs_readdir(dirp)) != NULL) {
+			buf = vms_loadfile_dirent(dp, NULL);
+			if (buf == NULL)
+				err(1, "%.12s", dp->name);
+			vms_bench_sink += buf[0];
+			free(buf);
+		}
+		vmsfs_closedir(dirp);
 	}
+}
 
-	dp = vms_dirent_alloc();
-	if (dp == NULL)
-		return NULL;
-
-	memset(dp, 0, sizeof(*dp));
+/* delete all files and put them again, as "del" and "put" do */
+static void
+vms_bench_fill(int n)
+{
+	static char buf[VMS_USERBLOCKS * VMS_BLOCKSIZE];
+	char name[DIR_NAMELEN + 1];
+	int i, j;
 
-	//XXX: NOTYET: AUTO DETECT?
-	dp->type = DIR_TYPE_DATA;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < 16; j++) {
+			snprintf(name, sizeof(name), "FILE%08d", j);
+			if (vmsfs_unlink(name) != 0)
+				err(1, "%s", name);
+		}
+		for (j = 0; j < 16; j++) {
+			snprintf(name, sizeof(name), "FILE%08d", j);
+			if (vmsfs_writefile(name, buf, 10 * VMS_BLOCKSIZE, 946684800) == NULL)
+				err(1, "%s", name);
+		}
+		vms_save_fat();
+		vms_save_dir();
+	}
+}
 
-	dp->attr = DIR_ATTR_COPIABLE;
-	vmsfs_regular_name(dp->name, filename);
-	vmsfs_unixtime2bcdtimestamp(&dp->timestamp, mtime);
-	dp->size = htole16((uint16_t)nblk);
+static void
+vms_bench_scan_open(const char *file)
+{
+	if (vms_open(file, O_RDWR) != 0 || vms_load_dir() != 0)
+		err(1, "%s", file);
+}
 
-	//XXX: NOTYET: AUTO DETECT?
-	dp->header_block_offset = 0;
+/* reopen the image, as every command does */
+static void
+vms_bench_scan(int n)
+{
+	VMSDIR *dirp;
+	int i;
 
-	startblk = vms_allocate_fat((int)nblk);
-	if (startblk < 0)
-		return NULL;
+	for (i = 0; i < n; i++) {
+		vms_bench_scan_open(vms_bench_scratch);
+		dirp = vmsfs_opendir();
+		while (vmsfs_readdir(dirp) != NULL)
+			vms_bench_sink++;
+		vmsfs_closedir(dirp);
+	}
+}
 
-	dp->block = htole16((uint16_t)startblk);
+static void
+vms_bench_multiscan_name(char *buf, size_t bufsize, int i)
+{
+	snprintf(buf, bufsize, "%s.%d", vms_bench_scratch, i);
+}
 
-	rc = vms_write_blocks(buf, startblk, (int)nblk);
-	if (rc != 0)
-		return NULL;
+static void
+vms_bench_multiscan_setup(void)
+{
+	struct vms_genimage param = { 0, 20, 80, 20, 0 };
+	char path[PATH_MAX];
+	int i;
 
-	return dp;
+	for (i = 0; i < VMS_BENCH_NIMAGES; i++) {
+		vms_bench_multiscan_name(path, sizeof(path), i);
+		param.seed = (uint32_t)i + 1;
+		if (vms_open(path, O_RDWR | O_CREAT) != 0 ||
+		    vms_image_create() != 0 || vmsfs_genimage(&param) != 0)
+			err(1, "%s", path);
+	}
 }
 
-
-static char *
-readfile(const char *filename, size_t size)
+static void
+vms_bench_multiscan_teardown(void)
 {
-	FILE *fh;
-	size_t rc, padsize;
-	char *buf;
-
-	padsize = (size + VMS_BLOCKSIZE - 1) / VMS_BLOCKSIZE * VMS_BLOCKSIZE;
-	buf = malloc(padsize);
-	if (buf == NULL)
-		return NULL;
+	char path[PATH_MAX];
+	int i;
 
-	memset(buf, 0, padsize);
+	for (i = 0; i < VMS_BENCH_NIMAGES; i++) {
+		vms_bench_multiscan_name(path, sizeof(path), i);
+		unlink(path);
+	}
+}
 
-	fh = fopen(filename, "rb");
-	rc = fread(buf, size, 1, fh);
-	fclose(fh);
+/* read the directory and the header of every file of every image */
+static void
+vms_bench_multiscan(int n)
+{
+	VMSDIR *dirp;
+	struct vmsfs_dirent *dp;
+	char path[PATH_MAX], buf[VMS_BLOCKSIZE];
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < VMS_BENCH_NIMAGES; j++) {
+			vms_bench_multiscan_name(path, sizeof(path), j);
+			vms_bench_scan_open(path);
+			dirp = vmsfs_opendir();
+			while ((dp = vmsfs_readdir(dirp)) != NULL) {
+				if (vms_read_header(dp, buf) != 0)
+					err(1, "%s: %.12s", path, dp->name);
+				vms_bench_sink += buf[0];
+			}
+			vmsfs_closedir(dirp);
+		}
+	}
+}
 
-	if (rc != 1)
-		return NULL;
+static const struct vms_bench vms_benchmarks[] = {
+	{ "Alloc/empty",	{ 1,   0,   0,   0,   0 }, vms_bench_alloc, NULL, NULL },
+	{ "Alloc/full90",	{ 1,  20,  90,   0,   0 }, vms_bench_alloc, NULL, NULL },
+	{ "Alloc/game",		{ 1,  20,  90,   0, 128 }, vms_bench_alloc, NULL, NULL },
+	{ "Lookup/hit",		{ 1, 100,  80,   0,   0 }, vms_bench_lookup_hit, NULL, NULL },
+	{ "Lookup/miss",	{ 1, 100,  80,   0,   0 }, vms_bench_lookup_miss, NULL, NULL },
+	{ "Chain/contig",	{ 1,  20, 100,   0,   0 }, vms_bench_chain, NULL, NULL },
+	{ "Chain/frag50",	{ 1,  20, 100,  50,   0 }, vms_bench_chain, NULL, NULL },
+	{ "Chain/frag100",	{ 1,  20, 100, 100,   0 }, vms_bench_chain, NULL, NULL },
+	{ "Extract/contig",	{ 1,  20, 100,   0,   0 }, vms_bench_extract, NULL, NULL },
+	{ "Extract/frag100",	{ 1,  20, 100, 100,   0 }, vms_bench_extract, NULL, NULL },
+	{ "Extract/game",	{ 1,  10, 100,  20, 128 }, vms_bench_extract, NULL, NULL },
+	{ "Fill/16x10",		{ 1,  16,  80,   0,   0 }, vms_bench_fill, NULL, NULL },
+	{ "Scan/files20",	{ 1,  20,  80,  20,   0 }, vms_bench_scan, NULL, NULL },
+	{ "Scan/files200",	{ 1, 200, 100,  20,   0 }, vms_bench_scan, NULL, NULL },
+	{ "MultiScan/8",	{ 1,   0,   0,   0,   0 }, vms_bench_multiscan,
+	    vms_bench_multiscan_setup, vms_bench_multiscan_teardown },
+};
 
-	return buf;
+static int
+dcvmtool_cmd_bench_usage(void)
+{
+	fprintf(stderr, "usage: vmsbench -f scratch bench [-n iterations] [-t msec] [-x pattern]\n");
+	fprintf(stderr, "\t-n iterations	run each benchmark this many times\n");
+	fprintf(stderr, "\t-t msec		minimum time of each benchmark (default: 200)\n");
+	fprintf(stderr, "\t-x pattern	run only the benchmarks which name contains pattern\n");
+	return EX_USAGE;
 }
 
 static int
-dcvmtool_cmd_put(int argc, char *argv[])
+dcvmtool_cmd_bench(int argc, char *argv[])
 {
-	char *filename;
-	size_t size;
-	int rc, ch, opt_v;
-	char *buf;
-
-	opt_v = 0;
-	while ((ch = getopt(argc, argv, "v")) != -1) {
+	const struct vms_bench *bench;
+	const char *pattern;
+	uint64_t t, mintime;
+	char *ep;
+	size_t i;
+	int ch, n, niter;
+
+	niter = 0;
+	mintime = 200;
+	pattern = NULL;
+	while ((ch = getopt(argc, argv, "n:t:x:")) != -1) {
 		switch (ch) {
-		case 'v':
-			opt_v++;
+		case 'n':
+			niter = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || niter <= 0)
+				return dcvmtool_cmd_bench_usage();
+			break;
+		case 't':
+			mintime = strtoull(optarg, &ep, 10);
+			if (*ep != '\0')
+				return dcvmtool_cmd_bench_usage();
+			break;
+		case 'x':
+			pattern = optarg;
 			break;
 		default:
-			return dcvmtool_cmd_put_usage();
+			return dcvmtool_cmd_bench_usage();
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
-		return dcvmtool_cmd_del_usage();
-
-	filename = argv[0];
-
-	struct stat statbuf;
-	struct vmsfs_dirent *dp;
-	rc = stat(filename, &statbuf);
-	if (rc != 0)
-		err(1, "%s", filename);
+	if (argc != 0)
+		return dcvmtool_cmd_bench_usage();
 
-	size = (size_t)statbuf.st_size;
-	buf = readfile(filename, size);
-	if (buf == NULL)
-		err(1, "%s", filename);
+	mintime *= 1000000;
+	vms_bench_scratch = strdup(vms_filename);
+	if (vms_bench_scratch == NULL)
+		err(EX_OSERR, "strdup");
+	if (vms_image_create() != 0)
+		err(1, "%s", vms_filename);
 
-	vmsfs_unlink(filename);	/* ignore error if the file is not exists */
+	for (i = 0; i < __arraycount(vms_benchmarks); i++) {
+		bench = &vms_benchmarks[i];
+		if (pattern != NULL && strstr(bench->name, pattern) == NULL)
+			continue;
 
-	/* allocate fat and dirent, and write data */
-	dp = vmsfs_writefile(filename, buf, size, statbuf.st_mtime);
-	if (dp == NULL)
-		err(1, "%s", filename);
+		if (vms_open(vms_bench_scratch, O_RDWR) != 0 ||
+		    vmsfs_genimage(&bench->image) != 0)
+			err(1, "%s: %s", vms_bench_scratch, bench->name);
+		if (bench->setup != NULL)
+			bench->setup();
+
+		/* warm up, and then double n until it takes mintime */
+		bench->func(1);
+		for (n = (niter != 0) ? niter : 1; ; n *= 2) {
+			t = vms_clock(CLOCK_MONOTONIC);
+			bench->func(n);
+			t = vms_clock(CLOCK_MONOTONIC) - t;
+			if (niter != 0 || t >= mintime || n >= INT_MAX / 2)
+				break;
+		}
 
-	free(buf);
+		if (bench->teardown != NULL)
+			bench->teardown();
 
-	vms_save_fat();
-	vms_save_dir();
+		printf("Benchmark%-20s %10d %14.1f ns/op\n", bench->name, n,
+		    (double)t / n);
+		fflush(stdout);
+	}
 
+	free(vms_bench_scratch);
 	return 0;
 }
+#endif /* VMS_BENCH */
 
 static int
-dcvmtool_cmd_attr_usage(void)
+usage(void)
 {
-	fprintf(stderr, "usage: dcvmtools attr <attr> <file>\n");
-	fprintf(stderr, "\tattr:\n");
-	fprintf(stderr, "\t\tgame		change file type to GAME\n");
-	fprintf(stderr, "\t\tdata		change file type to DATA\n");
-	fprintf(stderr, "\t\t+prohibit	set prohibit flag\n");
-	fprintf(stderr, "\t\t-prohibit	unset prohibit flag\n");
+	fprintf(stderr, "usage: dcvmstools [-JS] [-b bank|all] [-C cachedir] [-j njobs]\n"
+	    "\t[-o json|ndjson|csv] [-T tracefile] [-f <device|VMSimage>] ...\n"
+	    "\t<command> [arg ...]\n");
 	return EX_USAGE;
 }
 
 static int
-dcvmtool_cmd_attr(int argc, char *argv[])
+dcvmtool_command(const char *cmd, int argc, char *argv[])
 {
-	struct vmsfs_dirent *dp;
-	char *attr, *filename;
+	if (strcmp(cmd, "dump") == 0) {
+		return dcvmtool_cmd_dump(argc, argv);
+	} else if (strcmp(cmd, "fat") == 0) {
+		return dcvmtool_cmd_fat(argc, argv);
+	} else if (strcmp(cmd, "hexdump") == 0) {
+		return dcvmtool_cmd_hexdump(argc, argv);
+	} else if (strcmp(cmd, "dir") == 0) {
+		return dcvmtool_cmd_dir(argc, argv);
+	} else if (strcmp(cmd, "cat") == 0) {
+		return dcvmtool_cmd_cat(argc, argv);
+	} else if (strcmp(cmd, "show") == 0) {
+		return dcvmtool_cmd_show(argc, argv);
+	} else if (strcmp(cmd, "get") == 0) {
+		return dcvmtool_cmd_get(argc, argv);
+	} else if (strcmp(cmd, "put") == 0) {
+		return dcvmtool_cmd_put(argc, argv);
+	} else if (strcmp(cmd, "del") == 0) {
+		return dcvmtool_cmd_del(argc, argv);
+	} else if (strcmp(cmd, "attr") == 0) {
+		return dcvmtool_cmd_attr(argc, argv);
+	} else if (strcmp(cmd, "fsck") == 0) {
+		return dcvmtool_cmd_fsck(argc, argv);
+	} else if (strcmp(cmd, "recover") == 0) {
+		return dcvmtool_cmd_recover(argc, argv);
+	} else if (strcmp(cmd, "verify") == 0) {
+		return dcvmtool_cmd_verify(argc, argv);
+	} else if (strcmp(cmd, "hash") == 0) {
+		return dcvmtool_cmd_hash(argc, argv);
+	} else if (strcmp(cmd, "find") == 0) {
+		return dcvmtool_cmd_find(argc, argv);
+	} else if (strcmp(cmd, "watch") == 0) {
+		return dcvmtool_cmd_watch(argc, argv);
+	} else if (strcmp(cmd, "icon") == 0) {
+		return dcvmtool_cmd_icon(argc, argv);
+	} else if (strcmp(cmd, "bench-device") == 0) {
+		return dcvmtool_cmd_bench_device(argc, argv);
+	} else if (strcmp(cmd, "format") == 0) {
+		return dcvmtool_cmd_format(argc, argv);
+	} else if (strcmp(cmd, "backup") == 0) {
+		return dcvmtool_cmd_backup(argc, argv);
+	} else if (strcmp(cmd, "restore") == 0) {
+		return dcvmtool_cmd_restore(argc, argv);
+#ifdef VMS_BENCH
+	} else if (strcmp(cmd, "genimage") == 0) {
+		return dcvmtool_cmd_genimage(argc, argv);
+	} else if (strcmp(cmd, "bench") == 0) {
+		return dcvmtool_cmd_bench(argc, argv);
+#endif
+	}
 
-	if (argc != 2)
-		return dcvmtool_cmd_attr_usage();
+	return usage();
+}
 
-	attr = argv[0];
-	filename = argv[1];
-	dp = vms_dirent_lookup(filename);
-	if (dp == NULL)
-		err(1, "attr: %s", filename);
+static int
+dcvmtool_image(const struct vms_target *target, int argc, char *argv[])
+{
+	const char *cmd, *filename;
+	int rc, flags;
+
+	filename = target->filename;
+	vms_bank = target->bank;
+
+	flags = O_RDWR;
+	/* format makes a new image, but never a file under /dev */
+	if (strcmp(argv[0], "format") == 0 && strncmp(filename, "/dev/", 5) != 0)
+		flags |= O_CREAT;
+#ifdef VMS_BENCH
+	/* these make the image */
+	if (strcmp(argv[0], "genimage") == 0 || strcmp(argv[0], "bench") == 0)
+		flags |= O_CREAT;
+#endif
 
-	if (strcasecmp(attr, "game") == 0) {
-		dp->type = DIR_TYPE_GAME;
-	} else if (strcasecmp(attr, "data") == 0) {
-		dp->type = DIR_TYPE_DATA;
-	} else if (strcasecmp(attr, "-prohibit") == 0) {
-		dp->attr = DIR_ATTR_COPIABLE;
-	} else if (strcasecmp(attr, "+prohibit") == 0) {
-		dp->attr = DIR_ATTR_PROHIBIT;
-	} else {
-		return dcvmtool_cmd_attr_usage();
+	if (vms_stats) {
+		atexit(vms_stats_report);
+		vms_stats_begin("image");
 	}
 
-	vms_save_dir();
+	VMS_STATS_BEGIN("open");
+	rc = vms_open(filename, flags);
+	VMS_STATS_END();
+	if (rc != 0)
+		err(EX_NOINPUT, "open: %s", filename);
 
-	return 0;
+	/* for reusing getopt(3) */
+	optreset = 1;
+	optind = 0;
+
+	cmd = *argv++;
+	argc--;
+
+	vms_command = cmd;
+	VMS_STATS_BEGIN(cmd);
+	rc = dcvmtool_command(cmd, argc, argv);
+	fflush(stdout);
+	VMS_STATS_END();
+	return rc;
+}
+
+/*
+ * copy the output of an image to stdout. JSON records are joined into an
+ * array, and the same CSV header is written only once.
+ */
+static void
+dcvmtool_output_merge(const struct vms_target *target, FILE *output, int nimage)
+{
+	static char *csvheader;
+	static int nrecord;
+	char buf[8192];
+	size_t n;
+
+	rewind(output);
+	switch (vms_output) {
+	case VMS_OUTPUT_TEXT:
+		if (target->bank < 0)
+			printf("%s%s:\n", (nimage == 0) ? "" : "\n", target->filename);
+		else
+			printf("%s%s (bank %d):\n", (nimage == 0) ? "" : "\n",
+			    target->filename, target->bank);
+		break;
+	case VMS_OUTPUT_JSON:
+		if ((n = fread(buf, 1, sizeof(buf), output)) == 0)
+			return;
+		printf("%s", (nrecord++ == 0) ? "" : ",");
+		fwrite(buf, 1, n, stdout);
+		break;
+	case VMS_OUTPUT_CSV:
+		if (fgets(buf, sizeof(buf), output) == NULL)
+			return;
+		if (csvheader == NULL) {
+			csvheader = strdup(buf);
+			fputs(buf, stdout);
+		} else if (strcmp(csvheader, buf) != 0) {
+			fputs(buf, stdout);
+		}
+		break;
+	default:
+		break;
+	}
+
+	while ((n = fread(buf, 1, sizeof(buf), output)) > 0)
+		fwrite(buf, 1, n, stdout);
 }
 
+/*
+ * run the command for each image (or bank) in a child process, at most
+ * njobs at once. the output of each child is kept in a temporary file,
+ * and is copied to stdout in the order of images.
+ */
+struct vms_job {
+	const struct vms_target *target;
+	pid_t pid;
+	FILE *output;
+	int status;
+};
+
 static int
-usage(void)
+dcvmtool_multi(const struct vms_target *targets, int ntargets, int njobs,
+    int argc, char *argv[])
 {
-	fprintf(stderr, "usage: dcvmstools [-f <device|VMSimage>] <command> [arg ...]\n");
-	return EX_USAGE;
+	struct vms_job *jobs, *job;
+	pid_t pid;
+	int i, status, next, flushed, nrunning, rc;
+
+	jobs = calloc((size_t)ntargets, sizeof(*jobs));
+	if (jobs == NULL)
+		err(EX_OSERR, "calloc");
+
+	fflush(stdout);
+	rc = 0;
+	for (next = flushed = nrunning = 0; flushed < ntargets; ) {
+		while (next < ntargets && nrunning < njobs) {
+			job = &jobs[next++];
+			job->target = &targets[next - 1];
+			job->output = tmpfile();
+			if (job->output == NULL)
+				err(EX_OSERR, "tmpfile");
+
+			pid = fork();
+			if (pid == -1)
+				err(EX_OSERR, "fork");
+			if (pid == 0) {
+				if (dup2(fileno(job->output), STDOUT_FILENO) == -1)
+					err(EX_OSERR, "dup2");
+				exit(dcvmtool_image(job->target, argc, argv));
+			}
+			job->pid = pid;
+			nrunning++;
+		}
+
+		pid = wait(&status);
+		if (pid == -1)
+			err(EX_OSERR, "wait");
+		for (i = flushed; i < next; i++) {
+			if (jobs[i].pid == pid) {
+				jobs[i].pid = 0;
+				jobs[i].status = WIFEXITED(status) ?
+				    WEXITSTATUS(status) : EX_SOFTWARE;
+				nrunning--;
+				break;
+			}
+		}
+
+		for (; flushed < next && jobs[flushed].pid == 0; flushed++) {
+			job = &jobs[flushed];
+			dcvmtool_output_merge(job->target, job->output, flushed);
+			fclose(job->output);
+			fflush(stdout);
+
+			if (job->status > rc)
+				rc = job->status;
+		}
+	}
+
+	free(jobs);
+	return rc;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int ch;
-	const char *cmd;
-	const char *filename = PATH_DEV_MMEM_DEFAULT;
-
-	while ((ch = getopt(argc, argv, "f:h")) != -1) {
+	struct vms_target *targets;
+	const char **files;
+	char *ep;
+	int ch, i, j, nfiles, ntargets, nbanks, bank, njobs, rc;
+
+	files = calloc((size_t)argc, sizeof(*files));
+	if (files == NULL)
+		err(EX_OSERR, "calloc");
+	nfiles = 0;
+	njobs = 0;
+	bank = -1;
+
+	while ((ch = getopt(argc, argv, "b:C:f:hJj:o:ST:")) != -1) {
 		switch (ch) {
+		case 'b':
+			if (strcmp(optarg, "all") == 0) {
+				bank = VMS_BANK_ALL;
+				break;
+			}
+			bank = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || bank < 0 || bank > INT_MAX / VMS_BANKSIZE)
+				return usage();
+			break;
+		case 'C':
+			vms_cachedir = optarg;
+			break;
 		case 'f':
-			filename = optarg;
+			files[nfiles++] = optarg;
+			break;
+		case 'J':
+			vms_region_jp = true;
+			break;
+		case 'j':
+			njobs = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || njobs <= 0)
+				return usage();
+			break;
+		case 'o':
+			if (strcmp(optarg, "json") == 0)
+				vms_output = VMS_OUTPUT_JSON;
+			else if (strcmp(optarg, "ndjson") == 0)
+				vms_output = VMS_OUTPUT_NDJSON;
+			else if (strcmp(optarg, "csv") == 0)
+				vms_output = VMS_OUTPUT_CSV;
+			else
+				return usage();
+			break;
+		case 'S':
+			vms_stats = true;
+			break;
+		case 'T':
+			vms_stats = true;
+			vms_tracefile = optarg;
 			break;
 		case 'h':
 		default:
@@ -1244,38 +9083,91 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (vms_open(filename, O_RDWR) != 0)
-		err(EX_NOINPUT, "open: %s", filename);
-
-	/* for reusing getopt(3) */
-	optreset = 1;
-	optind = 0;
-
 	if (argc < 1)
 		return usage();
 
-	cmd = *argv++;
-	argc--;
+	if (vms_cachedir != NULL) {
+		struct stat st;
 
-	if (strcmp(cmd, "dump") == 0) {
-		return dcvmtool_cmd_dump(argc, argv);
-	} else if (strcmp(cmd, "fat") == 0) {
-		return dcvmtool_cmd_fat(argc, argv);
-	} else if (strcmp(cmd, "dir") == 0) {
-		return dcvmtool_cmd_dir(argc, argv);
-	} else if (strcmp(cmd, "cat") == 0) {
-		return dcvmtool_cmd_cat(argc, argv);
-	} else if (strcmp(cmd, "show") == 0) {
-		return dcvmtool_cmd_show(argc, argv);
-	} else if (strcmp(cmd, "get") == 0) {
-		return dcvmtool_cmd_get(argc, argv);
-	} else if (strcmp(cmd, "put") == 0) {
-		return dcvmtool_cmd_put(argc, argv);
-	} else if (strcmp(cmd, "del") == 0) {
-		return dcvmtool_cmd_del(argc, argv);
-	} else if (strcmp(cmd, "attr") == 0) {
-		return dcvmtool_cmd_attr(argc, argv);
+		if (stat(vms_cachedir, &st) != 0)
+			err(EX_NOINPUT, "%s", vms_cachedir);
+		if (!S_ISDIR(st.st_mode))
+			errx(EX_USAGE, "%s: %s", vms_cachedir, strerror(ENOTDIR));
 	}
 
-	return usage();
+	/* index takes the paths of images as the arguments */
+	if (strcmp(argv[0], "index") == 0) {
+		optreset = 1;
+		optind = 0;
+		vms_command = argv[0];
+		return dcvmtool_cmd_index(argc - 1, argv + 1);
+	}
+
+	/* dupes with an index does not open images */
+	if (strcmp(argv[0], "dupes") == 0 && nfiles == 0) {
+		optreset = 1;
+		optind = 0;
+		vms_command = argv[0];
+		return dcvmtool_cmd_dupes(NULL, 0, 1, argc - 1, argv + 1);
+	}
+
+	if (nfiles == 0)
+		files[nfiles++] = PATH_DEV_MMEM_DEFAULT;
+
+	/* with "-b all", every bank of every image */
+	for (ntargets = 0, i = 0; i < nfiles; i++)
+		ntargets += (bank == VMS_BANK_ALL) ? vms_image_nbanks(files[i]) : 1;
+	targets = calloc((size_t)ntargets, sizeof(*targets));
+	if (targets == NULL)
+		err(EX_OSERR, "calloc");
+	for (ntargets = 0, i = 0; i < nfiles; i++) {
+		nbanks = (bank == VMS_BANK_ALL) ? vms_image_nbanks(files[i]) : 1;
+		for (j = 0; j < nbanks; j++) {
+			targets[ntargets].filename = files[i];
+			targets[ntargets++].bank = (bank == VMS_BANK_ALL) ? j : bank;
+		}
+	}
+
+	/* consolidate reads all the images as the sources */
+	if (strcmp(argv[0], "consolidate") == 0) {
+		optreset = 1;
+		optind = 0;
+		vms_command = argv[0];
+		return dcvmtool_cmd_consolidate(targets, ntargets, argc - 1, argv + 1);
+	}
+	/* dupes scans all the images at once */
+	if (strcmp(argv[0], "dupes") == 0) {
+		optreset = 1;
+		optind = 0;
+		vms_command = argv[0];
+		return dcvmtool_cmd_dupes(targets, (uint32_t)ntargets,
+		    (njobs == 0) ? VMS_BANK_NJOBS : njobs, argc - 1, argv + 1);
+	}
+	if (njobs == 0)
+		njobs = (bank == VMS_BANK_ALL) ? VMS_BANK_NJOBS : 1;
+
+	if (vms_tracefile != NULL) {
+		FILE *fh = fopen(vms_tracefile, "w");
+		if (fh == NULL)
+			err(EX_CANTCREAT, "%s", vms_tracefile);
+		fprintf(fh, "[\n");
+		fclose(fh);
+		vms_mainpid = getpid();
+		atexit(vms_trace_close);
+	}
+
+	/* make the conversion tables once, and share them with children */
+	if (vms_region_jp && vms_text_init() != 0)
+		warn("iconv: %s", OUTPUT_ENCODING);
+
+	if (vms_output == VMS_OUTPUT_JSON)
+		printf("[");
+	if (ntargets == 1)
+		rc = dcvmtool_image(&targets[0], argc, argv);
+	else
+		rc = dcvmtool_multi(targets, ntargets, njobs, argc, argv);
+	if (vms_output == VMS_OUTPUT_JSON)
+		printf("]\n");
+
+	return rc;
 }
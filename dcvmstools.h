@@ -33,6 +33,18 @@
 #define VMS_ROOTBLOCKNO	255
 #define VMS_MAXBLOCKNO	255
 #define VMS_NUM_BLOCKS	256
+#define VMS_BANKSIZE	(VMS_NUM_BLOCKS * VMS_BLOCKSIZE)
+
+/* larger cards have a FAT of fat_nblocksize blocks, 256 blocks per FAT block */
+#define VMS_FAT_NENTRIES_PER_BLOCK	256
+#define VMS_MAXFATBLOCKS		8
+#define VMS_MAXNUM_BLOCKS	(VMS_FAT_NENTRIES_PER_BLOCK * VMS_MAXFATBLOCKS)
+
+/* standard layout, as made by format */
+#define VMS_FATBLOCKNO		254
+#define VMS_DIRBLOCKNO		253
+#define VMS_DIRBLOCKSIZE	13
+#define VMS_USERBLOCKS		200
 
 struct timestamp {
 	uint8_t bcd[8];
@@ -59,7 +71,8 @@ struct vmsfs_root {
 };
 
 struct vmsfs_fat {
-	uint16_t block[256];
+	/* fat_nblocksize blocks on disk, and room for the largest FAT on memory */
+	uint16_t block[VMS_MAXNUM_BLOCKS];
 #define BLOCK_UNALLOCATED	0xfffc
 #define BLOCK_LAST		0xfffa
 };
@@ -104,4 +117,27 @@ struct vmsfile_header {
 	struct vmsfile_icon icondata[];	/* +0x80 */
 };
 
+/* .VMI, the descriptor of .VMS file used by emulators and web sites */
+struct vmsfile_vmi {
+	uint8_t checksum[4];		/* +0x00 resource_name & "SEGA" */
+	char description[32];		/* +0x04 */
+	char copyright[32];		/* +0x24 */
+	uint16_t year;			/* +0x44 */
+	uint8_t month;			/* +0x46 */
+	uint8_t day;			/* +0x47 */
+	uint8_t hour;			/* +0x48 */
+	uint8_t minute;			/* +0x49 */
+	uint8_t second;			/* +0x4a */
+	uint8_t weekday;		/* +0x4b 0=sunday */
+	uint16_t version;		/* +0x4c */
+	uint16_t filenum;		/* +0x4e */
+	char resource_name[8];		/* +0x50 .VMS file name without .VMS */
+	char filename[DIR_NAMELEN];	/* +0x58 */
+	uint16_t mode;			/* +0x64 */
+#define VMI_MODE_PROHIBIT	0x0001
+#define VMI_MODE_GAME		0x0002
+	uint16_t reserved;		/* +0x66 */
+	uint32_t filesize;		/* +0x68 in bytes */
+};
+
 #endif /* _DCVMSTOOLS_H_ */